@@ -10,6 +10,13 @@
 #include "ar_read.h"
 #include "ar_write.h"
 #include "ar_entry.h"
+#include "ar_buffer.h"
+#include "ar_copy.h"
+#include "ar_index.h"
+#include "ar_push.h"
+#include "ar_tree.h"
+#include "ar_extract.h"
+#include "ar_filter.h"
 
 //////////////////////////////////////////////////////////////////////
 static int ar_version(lua_State *L) {
@@ -50,6 +57,13 @@ LUALIB_API int luaopen_archive(lua_State *L) {
     ar_read_init(L);
     ar_write_init(L);
     ar_entry_init(L);
+    ar_buffer_init(L);
+    ar_index_init(L);
+    ar_filter_init(L);
+    ar_extract_init(L);
+    ar_copy_init(L);
+    ar_push_init(L);
+    ar_tree_init(L);
 
     return 1;
 }
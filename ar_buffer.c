@@ -0,0 +1,222 @@
+//////////////////////////////////////////////////////////////////////
+// Implement the archive{buffer} object, a mutable byte buffer that
+// can be filled and drained repeatedly without creating a new Lua
+// string for every block.
+//////////////////////////////////////////////////////////////////////
+
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ar_buffer.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+static int __ref_count = 0;
+
+//////////////////////////////////////////////////////////////////////
+// For debugging GC issues.
+static int ar_ref_count(lua_State *L) {
+    lua_pushnumber(L, __ref_count);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Constructor:
+int ar_buffer(lua_State *L) {
+    lua_Integer size = luaL_optinteger(L, 1, 0);
+    struct ar_buffer* self;
+
+    if ( size < 0 ) err("InvalidArgument: buffer size must not be negative");
+
+    self = (struct ar_buffer*)
+        lua_newuserdata(L, sizeof(struct ar_buffer)); // ..., {ud}
+    self->data = NULL;
+    self->len  = 0;
+    self->size = 0;
+    self->borrowed = 0;
+    luaL_getmetatable(L, AR_BUFFER); // ..., {ud}, {meta}
+    lua_setmetatable(L, -2); // ..., {ud}
+    __ref_count++;
+
+    ar_buffer_reserve(L, self, size);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the archive{buffer} at narg, or NULL if it is something
+// else.
+struct ar_buffer* ar_buffer_test(lua_State *L, int narg) {
+    void* ud = lua_touserdata(L, narg);
+    int   is_buffer;
+    if ( NULL == ud || ! lua_getmetatable(L, narg) ) return NULL; // {meta}
+    luaL_getmetatable(L, AR_BUFFER); // {meta}, {buffer}
+    is_buffer = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return is_buffer ? (struct ar_buffer*)ud : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Like ar_buffer_check(), but raises an error if an archive{read} is
+// reading straight out of the buffer.
+struct ar_buffer* ar_buffer_check_mutable(lua_State *L, int narg) {
+    struct ar_buffer* self = ar_buffer_check(L, narg);
+    if ( self->borrowed > 0 ) {
+        err("InvalidState: archive{buffer} can't be changed while archive.read { data = buffer } reads from it");
+    }
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Make sure the buffer can hold at least size bytes.  The current
+// contents are preserved.  Returns false if out of memory, so it can
+// be used where raising an error is not allowed (libarchive callbacks).
+int ar_buffer_grow(struct ar_buffer* self, size_t size) {
+    char* data;
+    if ( size <= self->size ) return 1;
+    data = (char*)realloc(self->data, size);
+    if ( NULL == data ) return 0;
+    self->data = data;
+    self->size = size;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Like ar_buffer_grow(), but raises an error if out of memory.
+void ar_buffer_reserve(lua_State *L, struct ar_buffer* self, size_t size) {
+    if ( ! ar_buffer_grow(self, size) ) {
+        err("OutOfMemory: unable to grow buffer to %d bytes", (int)size);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Like lua_tolstring(), but also accepts an archive{buffer}.
+const char* ar_buffer_tolstring(lua_State *L, int narg, size_t *len) {
+    struct ar_buffer* buf = ar_buffer_test(L, narg);
+    if ( NULL != buf ) {
+        if ( NULL != len ) *len = buf->len;
+        return NULL == buf->data ? "" : buf->data;
+    }
+    return lua_tolstring(L, narg, len);
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_buffer_destroy(lua_State *L) {
+    struct ar_buffer* self = ar_buffer_check(L, 1);
+    free(self->data);
+    __ref_count--;
+    self->data = NULL;
+    self->len  = 0;
+    self->size = 0;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_buffer_len(lua_State *L) {
+    lua_pushnumber(L, ar_buffer_check(L, 1)->len);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_buffer_size(lua_State *L) {
+    lua_pushnumber(L, ar_buffer_check(L, 1)->size);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Change the capacity of the buffer, truncating the contents if
+// necessary.
+static int ar_buffer_resize(lua_State *L) {
+    struct ar_buffer* self = ar_buffer_check_mutable(L, 1);
+    lua_Integer size = luaL_checkinteger(L, 2);
+
+    if ( size < 0 ) err("InvalidArgument: buffer size must not be negative");
+    if ( 0 == size ) {
+        free(self->data);
+        self->data = NULL;
+        self->size = 0;
+    } else if ( (size_t)size != self->size ) {
+        char* data = (char*)realloc(self->data, size);
+        if ( NULL == data ) err("OutOfMemory: unable to resize buffer to %d bytes", (int)size);
+        self->data = data;
+        self->size = size;
+    }
+    if ( self->len > self->size ) self->len = self->size;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Replace the contents with a copy of the string (or buffer).
+static int ar_buffer_set(lua_State *L) {
+    struct ar_buffer* self = ar_buffer_check_mutable(L, 1);
+    size_t len;
+    const char* str = ar_buffer_tolstring(L, 2, &len);
+    if ( NULL == str ) err("InvalidArgument: expected a string or archive{buffer}");
+
+    ar_buffer_reserve(L, self, len);
+    if ( len > 0 ) memmove(self->data, str, len);
+    self->len = len;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the contents (or a substring if i and j are specified, with
+// the same semantics as string.sub) as a new Lua string.
+static int ar_buffer_tostring(lua_State *L) {
+    struct ar_buffer* self = ar_buffer_check(L, 1);
+    lua_Integer len   = self->len;
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    lua_Integer end   = luaL_optinteger(L, 3, -1);
+
+    if ( start < 0 ) start += len + 1;
+    if ( end < 0 )   end   += len + 1;
+    if ( start < 1 ) start = 1;
+    if ( end > len ) end   = len;
+    if ( start > end ) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, self->data + start - 1, end - start + 1);
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: top of the stack contains a table for which we will
+// append our "static" methods.
+//
+// Postcondition: 'buffer' method is registered in the table at the
+// top of the stack, and the archive{buffer} metatable is registered.
+//////////////////////////////////////////////////////////////////////
+int ar_buffer_init(lua_State *L) {
+    static luaL_reg fns[] = {
+        { "buffer",  ar_buffer },
+        { "_buffer_ref_count", ar_ref_count },
+        { NULL, NULL }
+    };
+    static luaL_reg m_fns[] = {
+        { "len",      ar_buffer_len },
+        { "size",     ar_buffer_size },
+        { "resize",   ar_buffer_resize },
+        { "set",      ar_buffer_set },
+        { "tostring", ar_buffer_tostring },
+        { "__len",    ar_buffer_len },
+        { "__gc",     ar_buffer_destroy },
+        { NULL, NULL }
+    };
+
+    luaL_checktype(L, -1, LUA_TTABLE); // {class}
+
+    luaL_register(L, NULL, fns); // {class}
+
+    luaL_newmetatable(L, AR_BUFFER); // {class}, {meta}
+
+    lua_pushvalue(L, -1); // {class}, {meta}, {meta}
+    lua_setfield(L, -2, "__index"); // {class}, {meta}
+
+    luaL_register(L, NULL, m_fns); // {class}, {meta}
+
+    lua_pop(L, 1); // {class}
+
+    return 0;
+}
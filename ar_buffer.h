@@ -0,0 +1,24 @@
+// This is a private header subject to change.
+
+#define AR_BUFFER "archive{buffer}"
+
+struct ar_buffer {
+    char*  data;
+    size_t len;
+    size_t size;
+
+    // Number of archive{read} objects reading straight out of the
+    // buffer (data=), it can't be changed while they do:
+    int    borrowed;
+};
+
+#define ar_buffer_check(L, narg) \
+    ((struct ar_buffer*)luaL_checkudata((L), (narg), AR_BUFFER))
+
+int ar_buffer_init(lua_State *L);
+int ar_buffer(lua_State *L);
+struct ar_buffer* ar_buffer_test(lua_State *L, int narg);
+struct ar_buffer* ar_buffer_check_mutable(lua_State *L, int narg);
+int  ar_buffer_grow(struct ar_buffer* self, size_t size);
+void ar_buffer_reserve(lua_State *L, struct ar_buffer* self, size_t size);
+const char* ar_buffer_tolstring(lua_State *L, int narg, size_t *len);
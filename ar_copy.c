@@ -0,0 +1,230 @@
+//////////////////////////////////////////////////////////////////////
+// Implement archive.copy(), which pumps the headers and data of an
+// archive{read} into an archive{write} entirely in C, for example to
+// re-pack a tar.gz as a tar.xz.
+//////////////////////////////////////////////////////////////////////
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ar_copy.h"
+#include "ar_read.h"
+#include "ar_write.h"
+#include "ar_entry.h"
+#include "ar_filter.h"
+#include "ar_util.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+//////////////////////////////////////////////////////////////////////
+// Write len bytes from buff (or zeros if buff is NULL) to dst.  Returns
+// false if dst would not take all of them.
+static int ar_copy_write(lua_State *L, struct ar_write* dst, const void* buff, size_t len) {
+    static const char zeros[16384];
+    while ( len > 0 ) {
+        size_t chunk = len;
+        __LA_SSIZE_T wrote;
+        if ( NULL == buff && chunk > sizeof(zeros) ) chunk = sizeof(zeros);
+        wrote = ar_write_entry_data(dst, NULL == buff ? zeros : buff, chunk);
+        if ( wrote < 0 ) err("archive_write_data: %s", archive_error_string(dst->archive));
+        // The entry is full (the data exceeds the size in the header):
+        if ( 0 == wrote ) return 0;
+        if ( NULL != buff ) buff = (const char*)buff + wrote;
+        len -= wrote;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Copy the data of the current entry.  Holes in sparse entries are
+// written as zeros, since the sparse map is not copied.  Returns the
+// number of bytes copied, or -1 if the entry was truncated.
+static double ar_copy_data(lua_State *L,
+                           struct ar_read* src,
+                           struct ar_write* dst,
+                           la_int64_t size)
+{
+    const void* buff;
+    size_t      buff_len;
+    la_int64_t  offset;
+    la_int64_t  pos = 0;
+    int         result;
+
+    for ( ;; ) {
+        result = archive_read_data_block(src->archive, &buff, &buff_len, &offset);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( result < ARCHIVE_WARN ) {
+            err("archive_read_data_block: %s", archive_error_string(src->archive));
+        }
+        if ( ( offset > pos && ! ar_copy_write(L, dst, NULL, offset - pos) ) ||
+             ! ar_copy_write(L, dst, buff, buff_len) )
+        {
+            return -1;
+        }
+        pos = offset + buff_len;
+    }
+    if ( size > pos && ! ar_copy_write(L, dst, NULL, size - pos) ) return -1;
+    return (double)pos;
+}
+
+//////////////////////////////////////////////////////////////////////
+// stats = archive.copy(read, write, {
+//     include = ..., exclude = ..., paths = ...,
+//     rename = function(pathname) ... end,
+//     rename_match = { include = ..., exclude = ..., paths = ... },
+// })
+static int ar_copy(lua_State *L) {
+    static const char* stats_fields[] = {
+        "entries", "bytes", "skipped", "renamed", "dropped", "failed", NULL
+    };
+    struct ar_read* src = ar_read_check(L, 1);
+    struct ar_write* dst = (struct ar_write*)ar_write_check(L, 2);
+    struct archive_entry* entry;
+    struct ar_filter* filter;
+    struct ar_filter* rename_match = NULL;
+    double start = ar_util_now();
+    double seconds;
+    double bytes;
+    la_int64_t size;
+    int stats_idx;
+    int result;
+    int i;
+
+    if ( NULL == src->archive ) err("NULL archive{read}!");
+    if ( NULL == dst->archive ) err("NULL archive{write}!");
+    lua_settop(L, 3); // {read}, {write}, {opts}
+    if ( lua_isnil(L, 3) ) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    filter = ar_filter_new(L, 3); // {read}, {write}, {opts}, {filter}
+    lua_getfield(L, 3, "rename"); // ..., {filter}, rename
+    if ( ! lua_isnil(L, 5) && ! lua_isfunction(L, 5) ) {
+        err("InvalidArgument: 'rename' must be a function");
+    }
+    lua_getfield(L, 3, "rename_match"); // ..., {filter}, rename, {match}
+    if ( ! lua_isnil(L, 6) ) {
+        if ( ! lua_istable(L, 6) ) err("InvalidArgument: 'rename_match' must be a table");
+        rename_match = ar_filter_new(L, 6); // ..., {match}, {rename_filter}
+        if ( NULL == rename_match ) {
+            err("InvalidArgument: 'rename_match' must have include, exclude or paths");
+        }
+    } else {
+        lua_pushnil(L); // ..., {match}, nil
+    }
+
+    lua_pushcfunction(L, ar_entry); // ..., ar_entry
+    lua_call(L, 0, 1); // ..., {entry}
+    entry = *ar_entry_check(L, -1);
+
+    lua_createtable(L, 0, 10); // ..., {entry}, {stats}
+    stats_idx = lua_gettop(L);
+    for ( i=0; NULL != stats_fields[i]; i++ ) {
+        lua_pushnumber(L, 0);
+        lua_setfield(L, stats_idx, stats_fields[i]);
+    }
+    lua_newtable(L);
+    lua_setfield(L, stats_idx, "errors");
+
+    for ( ;; ) {
+        src->pending_len = 0;
+        result = archive_read_next_header2(src->archive, entry);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( result < ARCHIVE_WARN ) {
+            err("archive_read_next_header2: %s", archive_error_string(src->archive));
+        }
+        if ( ! ar_filter_match(filter, archive_entry_pathname(entry)) ) {
+            ar_util_count(L, stats_idx, "skipped", 1);
+            continue;
+        }
+
+        // Only call into Lua for the entries that might be renamed:
+        if ( ! lua_isnil(L, 5) &&
+             ( NULL == rename_match ||
+               ar_filter_match(rename_match, archive_entry_pathname(entry)) ) )
+        {
+            lua_pushvalue(L, 5); // ..., rename
+            lua_pushstring(L, archive_entry_pathname(entry)); // ..., rename, pathname
+            lua_call(L, 1, 1); // ..., result
+            if ( LUA_TSTRING == lua_type(L, -1) ) {
+                archive_entry_copy_pathname(entry, lua_tostring(L, -1));
+                ar_util_count(L, stats_idx, "renamed", 1);
+            } else if ( LUA_TBOOLEAN == lua_type(L, -1) && ! lua_toboolean(L, -1) ) {
+                lua_pop(L, 1);
+                ar_util_count(L, stats_idx, "dropped", 1);
+                continue;
+            } else if ( ! lua_isnil(L, -1) && LUA_TBOOLEAN != lua_type(L, -1) ) {
+                err("InvalidResult: 'rename' must return a string, false or nil");
+            }
+            lua_pop(L, 1);
+        }
+
+        // The holes are filled in, so the sparse map no longer applies:
+        archive_entry_sparse_clear(entry);
+        // Writers may zero the size of entries they store no data for:
+        size = archive_entry_size(entry);
+
+        // So the zip policy of the output applies:
+        result = ar_write_entry_header(L, 2, entry, AR_WRITE_AUTO);
+        if ( ARCHIVE_FATAL == result ) {
+            err("archive_write_header: %s", archive_error_string(dst->archive));
+        }
+        if ( result < ARCHIVE_WARN ) {
+            // For example an entry type the output format can't hold:
+            ar_util_error(L, stats_idx, archive_entry_pathname(entry),
+                          archive_error_string(dst->archive));
+            continue;
+        }
+
+        bytes = 0;
+        if ( size > 0 ) bytes = ar_copy_data(L, src, dst, size);
+        if ( ar_write_entry_finish(dst) < ARCHIVE_WARN ) {
+            err("archive_write_finish_entry: %s", archive_error_string(dst->archive));
+        }
+        if ( bytes < 0 ) {
+            ar_util_error(L, stats_idx, archive_entry_pathname(entry),
+                          "Entry data was truncated by the output");
+            continue;
+        }
+        ar_util_count(L, stats_idx, "entries", 1);
+        ar_util_count(L, stats_idx, "bytes", bytes);
+    }
+
+    seconds = ar_util_now() - start;
+    lua_pushnumber(L, seconds);
+    lua_setfield(L, stats_idx, "seconds");
+    // Raw bytes consumed and produced, before and after compression:
+    lua_pushnumber(L, (double)archive_filter_bytes(src->archive, -1));
+    lua_setfield(L, stats_idx, "read_bytes");
+    lua_pushnumber(L, (double)archive_filter_bytes(dst->archive, -1));
+    lua_setfield(L, stats_idx, "written_bytes");
+    lua_getfield(L, stats_idx, "bytes");
+    lua_pushnumber(L, seconds > 0 ? lua_tonumber(L, -1) / seconds : 0);
+    lua_setfield(L, stats_idx, "bytes_per_second");
+    lua_pop(L, 1);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: top of the stack contains a table for which we will
+// append our "static" methods.
+//
+// Postcondition: 'copy' method is registered in the table at the top
+// of the stack.
+//////////////////////////////////////////////////////////////////////
+int ar_copy_init(lua_State *L) {
+    static luaL_reg fns[] = {
+        { "copy",  ar_copy },
+        { NULL, NULL }
+    };
+
+    luaL_checktype(L, -1, LUA_TTABLE); // {class}
+    luaL_register(L, NULL, fns); // {class}
+    return 0;
+}
@@ -0,0 +1,3 @@
+// This is a private header subject to change.
+
+int ar_copy_init(lua_State *L);
@@ -0,0 +1,288 @@
+//////////////////////////////////////////////////////////////////////
+// Ordered block compression shared by ar_gzip and ar_zip.
+//
+// Like pigz the data is split into blocks which are deflated
+// independently by a pool of threads.  Each block may be primed with
+// the last 32K of the block before it (so the ratio is close to a
+// single stream) and ends with a sync flush so the raw deflate
+// streams can simply be concatenated.  At most 4 blocks per thread
+// are outstanding, and they are handed back to the caller in the
+// order they were submitted.
+//////////////////////////////////////////////////////////////////////
+
+#ifdef AR_HAVE_ZLIB
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "ar_deflate.h"
+
+#define AR_DEFLATE_DICT (32*1024)
+
+struct ar_deflate {
+    int                     level;
+    ar_deflate_emit         emit;
+    void*                   ctx;
+    const char**            error;
+
+    // Jobs in the order their output must be written:
+    struct ar_deflate_job** pending;
+    size_t                  pending_head;
+    size_t                  pending_len;
+    size_t                  pending_size;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          work;     // signaled when a job is queued
+    pthread_cond_t          finished; // signaled when a job is done
+    struct ar_deflate_job*  queue_head;
+    struct ar_deflate_job*  queue_tail;
+    int                     stop;
+    pthread_t*              threads;
+    int                     nthreads;
+};
+
+//////////////////////////////////////////////////////////////////////
+void ar_deflate_job_free(struct ar_deflate_job* job) {
+    if ( NULL == job ) return;
+    free(job->in);
+    free(job->out);
+    free(job);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Make a job primed with dict, with room for size bytes (the caller
+// may grow in).
+struct ar_deflate_job* ar_deflate_job_new(const unsigned char* dict, size_t dict_len, size_t size) {
+    struct ar_deflate_job* job = (struct ar_deflate_job*)calloc(1, sizeof(struct ar_deflate_job));
+    if ( NULL == job ) return NULL;
+    if ( 0 == size ) size = 1;
+    job->in_size = dict_len + size;
+    job->in = (unsigned char*)malloc(job->in_size);
+    if ( NULL == job->in ) {
+        free(job);
+        return NULL;
+    }
+    if ( dict_len > 0 ) memcpy(job->in, dict, dict_len);
+    job->dict_len = dict_len;
+    return job;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Make the job for the block after job, primed with its last 32K
+// unless it is stored.
+struct ar_deflate_job* ar_deflate_job_next(struct ar_deflate_job* job, size_t size) {
+    struct ar_deflate_job* next;
+    size_t dict_len = 0;
+
+    if ( ! job->store ) {
+        dict_len = job->in_len < AR_DEFLATE_DICT ? job->in_len : AR_DEFLATE_DICT;
+    }
+    next = ar_deflate_job_new(job->in + job->dict_len + job->in_len - dict_len, dict_len, size);
+    if ( NULL == next ) return NULL;
+    next->store = job->store;
+    next->file = job->file;
+    return next;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Checksum and deflate a block, run by the worker threads.
+static void ar_deflate_compress(struct ar_deflate* self, struct ar_deflate_job* job) {
+    unsigned char* in = job->in + job->dict_len;
+    z_stream strm;
+    uLong bound;
+
+    job->crc = crc32(crc32(0L, Z_NULL, 0), in, job->in_len);
+    if ( job->store ) return;
+
+    memset(&strm, 0, sizeof(strm));
+    if ( Z_OK != deflateInit2(&strm, self->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) ) {
+        job->failed = 1;
+        return;
+    }
+    // Room for the sync flush marker as well:
+    bound = deflateBound(&strm, job->in_len) + 16;
+    job->out = (unsigned char*)malloc(bound);
+    if ( NULL == job->out ) {
+        deflateEnd(&strm);
+        job->failed = 1;
+        return;
+    }
+    if ( job->dict_len > 0 ) deflateSetDictionary(&strm, job->in, job->dict_len);
+
+    strm.next_in   = in;
+    strm.avail_in  = job->in_len;
+    strm.next_out  = job->out;
+    strm.avail_out = bound;
+    if ( deflate(&strm, job->last ? Z_FINISH : Z_SYNC_FLUSH) < 0 ||
+         0 != strm.avail_in )
+    {
+        job->failed = 1;
+    }
+    job->out_len = bound - strm.avail_out;
+    deflateEnd(&strm);
+}
+
+//////////////////////////////////////////////////////////////////////
+static void* ar_deflate_thread(void* arg) {
+    struct ar_deflate* self = (struct ar_deflate*)arg;
+
+    pthread_mutex_lock(&self->lock);
+    for ( ;; ) {
+        struct ar_deflate_job* job;
+        while ( ! self->stop && NULL == self->queue_head ) {
+            pthread_cond_wait(&self->work, &self->lock);
+        }
+        if ( self->stop ) break;
+        job = self->queue_head;
+        self->queue_head = job->next;
+        if ( NULL == self->queue_head ) self->queue_tail = NULL;
+        pthread_mutex_unlock(&self->lock);
+
+        ar_deflate_compress(self, job);
+
+        pthread_mutex_lock(&self->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&self->finished);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Start the threads.  Errors are reported by setting *error (which
+// the emit callback must do as well).
+struct ar_deflate* ar_deflate_new(int threads, int level, ar_deflate_emit emit, void* ctx,
+                                  const char** error)
+{
+    struct ar_deflate* self = (struct ar_deflate*)calloc(1, sizeof(struct ar_deflate));
+    if ( NULL == self ) return NULL;
+
+    self->level = level < 0 ? Z_DEFAULT_COMPRESSION : level;
+    self->emit  = emit;
+    self->ctx   = ctx;
+    self->error = error;
+    self->pending_size = 4 * threads;
+    self->pending = (struct ar_deflate_job**)calloc(self->pending_size, sizeof(struct ar_deflate_job*));
+    self->threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    if ( NULL == self->pending || NULL == self->threads ) {
+        ar_deflate_free(self);
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->work, NULL);
+    pthread_cond_init(&self->finished, NULL);
+    for ( ; self->nthreads < threads; self->nthreads++ ) {
+        if ( 0 != pthread_create(&self->threads[self->nthreads], NULL, ar_deflate_thread, self) ) {
+            break;
+        }
+    }
+    if ( 0 == self->nthreads ) {
+        ar_deflate_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit the oldest pending job, waiting for it if needed.  Returns
+// false on error.
+static int ar_deflate_drain_one(struct ar_deflate* self) {
+    struct ar_deflate_job* job = self->pending[self->pending_head];
+    int ok;
+
+    pthread_mutex_lock(&self->lock);
+    while ( ! job->done ) pthread_cond_wait(&self->finished, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+
+    self->pending[self->pending_head] = NULL;
+    self->pending_head = (self->pending_head + 1) % self->pending_size;
+    self->pending_len--;
+
+    if ( job->failed ) {
+        *self->error = "deflate failed";
+        ar_deflate_job_free(job);
+        return 0;
+    }
+    ok = self->emit(self->ctx, job);
+    ar_deflate_job_free(job);
+    return ok;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Hand job (which is freed on error) to the threads.  Output that is
+// ready is emitted without waiting, unless too many jobs are
+// outstanding.
+int ar_deflate_submit(struct ar_deflate* self, struct ar_deflate_job* job) {
+    while ( self->pending_len == self->pending_size ) {
+        if ( ! ar_deflate_drain_one(self) ) {
+            ar_deflate_job_free(job);
+            return 0;
+        }
+    }
+
+    self->pending[(self->pending_head + self->pending_len) % self->pending_size] = job;
+    self->pending_len++;
+
+    pthread_mutex_lock(&self->lock);
+    if ( NULL == self->queue_tail ) {
+        self->queue_head = job;
+    } else {
+        self->queue_tail->next = job;
+    }
+    self->queue_tail = job;
+    pthread_cond_signal(&self->work);
+    pthread_mutex_unlock(&self->lock);
+
+    // Emit whatever is already compressed:
+    for ( ;; ) {
+        struct ar_deflate_job* head;
+        int done;
+        if ( 0 == self->pending_len ) break;
+        head = self->pending[self->pending_head];
+        pthread_mutex_lock(&self->lock);
+        done = head->done;
+        pthread_mutex_unlock(&self->lock);
+        if ( ! done ) break;
+        if ( ! ar_deflate_drain_one(self) ) return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Wait for every job and emit it.
+int ar_deflate_flush(struct ar_deflate* self) {
+    while ( self->pending_len > 0 ) {
+        if ( ! ar_deflate_drain_one(self) ) return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+void ar_deflate_free(struct ar_deflate* self) {
+    size_t i;
+    int t;
+    if ( NULL == self ) return;
+
+    if ( self->nthreads > 0 ) {
+        pthread_mutex_lock(&self->lock);
+        self->stop = 1;
+        pthread_cond_broadcast(&self->work);
+        pthread_mutex_unlock(&self->lock);
+        for ( t=0; t < self->nthreads; t++ ) pthread_join(self->threads[t], NULL);
+        pthread_mutex_destroy(&self->lock);
+        pthread_cond_destroy(&self->work);
+        pthread_cond_destroy(&self->finished);
+    }
+    // Jobs still queued are also in pending:
+    for ( i=0; i < self->pending_len; i++ ) {
+        ar_deflate_job_free(self->pending[(self->pending_head + i) % self->pending_size]);
+    }
+    free(self->pending);
+    free(self->threads);
+    free(self);
+}
+
+#endif
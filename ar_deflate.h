@@ -0,0 +1,40 @@
+// This is a private header subject to change.
+
+// A block of data to be deflated (or only checksummed if store is
+// set) by the threads of an ar_deflate.
+struct ar_deflate_job {
+    struct ar_deflate_job* next;     // in the work queue
+    unsigned char*         in;       // dictionary followed by the block
+    size_t                 in_size;  // allocated
+    size_t                 dict_len;
+    size_t                 in_len;   // not including the dictionary
+    unsigned char*         out;
+    size_t                 out_len;
+    unsigned long          crc;      // of the block
+    int                    store;
+    int                    last;     // end the stream rather than sync flush
+    int                    done;
+    int                    failed;
+
+    // Left to the caller:
+    size_t                 file;
+    int                    first;
+};
+
+// Called (always from the thread calling ar_deflate_submit() or
+// ar_deflate_flush()) with each job in the order they were submitted
+// once it is compressed, returns false on error (which it must
+// set).
+typedef int (*ar_deflate_emit)(void* ctx, struct ar_deflate_job* job);
+
+struct ar_deflate;
+
+struct ar_deflate_job* ar_deflate_job_new(const unsigned char* dict, size_t dict_len, size_t size);
+struct ar_deflate_job* ar_deflate_job_next(struct ar_deflate_job* job, size_t size);
+void ar_deflate_job_free(struct ar_deflate_job* job);
+
+struct ar_deflate* ar_deflate_new(int threads, int level, ar_deflate_emit emit, void* ctx,
+                                  const char** error);
+int  ar_deflate_submit(struct ar_deflate* self, struct ar_deflate_job* job);
+int  ar_deflate_flush(struct ar_deflate* self);
+void ar_deflate_free(struct ar_deflate* self);
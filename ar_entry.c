@@ -20,6 +20,46 @@ static int ar_ref_count(lua_State *L) {
     return 1;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Set the fields of the archive{entry} at ud_idx from the table at
+// table_idx by calling the method with the name of each field.
+void ar_entry_set_fields(lua_State *L, int ud_idx, int table_idx) {
+    struct archive_entry* self = *ar_entry_check(L, ud_idx);
+
+    // If given a sourcepath, copy stat buffer from there:
+    lua_pushliteral(L, "sourcepath"); // ..., "sourcepath"
+    lua_rawget(L, table_idx); // ..., src
+    if ( lua_isstring(L, -1) ) {
+        struct stat sb;
+#ifdef _MSC_VER
+        stat(lua_tostring(L, -1), &sb);
+#else
+        lstat(lua_tostring(L, -1), &sb);
+#endif
+        archive_entry_copy_stat(self, &sb);
+    } else {
+        // Give a reasonable default mode:
+        archive_entry_set_mode(self, S_IFREG);
+    }
+    lua_pop(L, 1); // ...
+    assert(0 != lua_getmetatable(L, ud_idx)); // ..., {meta}
+
+    // Iterate over the table and call the method with that name
+    lua_pushnil(L); // ..., {meta}, nil
+    while (lua_next(L, table_idx) != 0) { // ..., {meta}, key, value
+        lua_pushvalue(L, -2); // ..., {meta}, key, value, key
+        lua_gettable(L, -4); // ..., {meta}, key, value, func
+        if ( lua_isnil(L, -1) ) {
+            err("InvalidArgument: '%s' is not a valid field", lua_tostring(L, -3));
+        }
+        lua_pushvalue(L, ud_idx); // ..., {meta}, key, value, func, {ud}
+        lua_pushvalue(L, -3); // ..., {meta}, key, value, func, {ud}, value
+        lua_call(L, 2, 0); // ..., {meta}, key, value
+        lua_pop(L, 1);     // ..., {meta}, key
+    } // ..., {meta}
+    lua_pop(L, 1);
+}
+
 //////////////////////////////////////////////////////////////////////
 int ar_entry(lua_State *L) {
     struct archive_entry** self_ref = (struct archive_entry**)
@@ -30,40 +70,7 @@ int ar_entry(lua_State *L) {
     __ref_count++;
     *self_ref = archive_entry_new();
 
-    if ( lua_istable(L, 1) ) {
-        // If given a sourcepath, copy stat buffer from there:
-        lua_pushliteral(L, "sourcepath"); // ..., {ud}, "sourcepath"
-        lua_rawget(L, 1); // ..., {ud}, src
-        if ( lua_isstring(L, -1) ) {
-            struct stat sb;
-#ifdef _MSC_VER
-            stat(lua_tostring(L, -1), &sb);
-#else
-            lstat(lua_tostring(L, -1), &sb);
-#endif
-            archive_entry_copy_stat(*self_ref, &sb);
-        } else {
-            // Give a reasonable default mode:
-            archive_entry_set_mode(*self_ref, S_IFREG);
-        }
-        lua_pop(L, 1); // ... {ud}
-        assert(0 != lua_getmetatable(L, -1)); // ..., {ud}, {meta}
-
-        // Iterate over the table and call the method with that name
-        lua_pushnil(L); // ..., {ud}, {meta}, nil
-        while (lua_next(L, 1) != 0) { // ..., {ud}, {meta}, key, value
-            lua_pushvalue(L, -2); // ..., {ud}, {meta}, key, value, key
-            lua_gettable(L, -4); // ..., {ud}, {meta}, key, value, func
-            if ( lua_isnil(L, -1) ) {
-                err("InvalidArgument: '%s' is not a valid field", lua_tostring(L, -3));
-            }
-            lua_pushvalue(L, -5); // ..., {ud}, {meta}, key, value, func, {ud}
-            lua_pushvalue(L, -3); // ..., {ud}, {meta}, key, value, func, {ud}, value
-            lua_call(L, 2, 0); // ..., {ud}, {meta}, key, value
-            lua_pop(L, 1);     // ..., {ud}, {meta}, key
-        } // ..., {ud}, {meta}
-        lua_pop(L, 1);
-    }
+    if ( lua_istable(L, 1) ) ar_entry_set_fields(L, lua_gettop(L), 1);
     return 1;
 }
 
@@ -7,3 +7,4 @@
 
 int ar_entry_init(lua_State *L);
 int ar_entry(lua_State *L);
+void ar_entry_set_fields(lua_State *L, int ud_idx, int table_idx);
@@ -0,0 +1,971 @@
+//////////////////////////////////////////////////////////////////////
+// Implement read:extract(), which writes the rest of the archive to
+// disk with libarchive's write_disk support.  All of the data is
+// copied in C, nothing but the final stats table is created in Lua.
+//
+// With threads=N small regular files are handed off to a pool of N
+// writer threads (see ar_pool below) so that the open, write, fchmod,
+// futimens and close syscalls of many small files overlap with the
+// decoding done by the calling thread.
+//////////////////////////////////////////////////////////////////////
+
+#ifdef __linux__
+#define _GNU_SOURCE // for fallocate() and syncfs()
+#endif
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "ar_extract.h"
+#include "ar_read.h"
+#include "ar_entry.h"
+#include "ar_filter.h"
+#include "ar_util.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+// Regular files up to this size are written by the pool, larger ones
+// are streamed by the calling thread:
+#define AR_POOL_MAX_FILE   (1024*1024)
+
+// Bytes of file data that may be queued for each writer thread:
+#define AR_POOL_MAX_QUEUED (16*1024*1024)
+
+#ifndef _WIN32
+// A regular file waiting to be written by the pool.  The path and
+// data live in the same allocation as the job.
+struct ar_job {
+    struct ar_job* next;
+    char*          path;
+    char*          data;
+    size_t         size;
+    mode_t         mode;
+    uid_t          uid;
+    gid_t          gid;
+    int            has_atime;
+    int            has_mtime;
+    struct timespec atime;
+    struct timespec mtime;
+};
+
+// Each writer thread has its own queue.  Entries are assigned to a
+// queue by a hash of their path, so if a path appears twice in an
+// archive the later entry is still written last.
+struct ar_queue {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty; // signaled when a job is added or done is set
+    pthread_cond_t  not_full;  // broadcast when a job finishes
+    struct ar_job*  head;
+    struct ar_job*  tail;
+    size_t          queued;    // bytes of data in queued or running jobs
+    int             busy;      // number of queued or running jobs
+    int             done;
+    int             started;
+    struct ar_pool* pool;
+};
+
+struct ar_pool {
+    int              flags;
+    int              nqueues;
+    struct ar_queue* queues;
+
+    // Results from the writer threads, protected by lock:
+    pthread_mutex_t  lock;
+    double           files;
+    double           bytes;
+    double           failed;   // even if the message could not be kept
+    char**           errors;
+    size_t           errors_len;
+    size_t           errors_size;
+
+    // Last parent directory known to exist:
+    char*            parent;
+    size_t           parent_size;
+};
+#endif
+
+// The write_disk archive and a scratch buffer used to prefix entry
+// paths with the destination directory.  Kept in a userdata so both
+// (and the writer threads, if any) are released even if we raise an
+// error part way through.
+struct ar_disk {
+    struct archive* archive;
+    char*           path;
+    size_t          path_size;
+#ifndef _WIN32
+    struct ar_pool* pool;
+#endif
+};
+
+static struct {
+    const char* name;
+    int         flag;
+} extract_flags[] = {
+    { "owner",           ARCHIVE_EXTRACT_OWNER },
+    { "perm",            ARCHIVE_EXTRACT_PERM },
+    { "time",            ARCHIVE_EXTRACT_TIME },
+    { "no_overwrite",    ARCHIVE_EXTRACT_NO_OVERWRITE },
+    { "unlink",          ARCHIVE_EXTRACT_UNLINK },
+    { "acl",             ARCHIVE_EXTRACT_ACL },
+    { "fflags",          ARCHIVE_EXTRACT_FFLAGS },
+    { "xattr",           ARCHIVE_EXTRACT_XATTR },
+    { "secure_symlinks", ARCHIVE_EXTRACT_SECURE_SYMLINKS },
+    { "secure_nodotdot", ARCHIVE_EXTRACT_SECURE_NODOTDOT },
+#ifdef ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
+    { "secure_noabsolutepaths", ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS },
+#endif
+    { "no_autodir",      ARCHIVE_EXTRACT_NO_AUTODIR },
+    { "no_overwrite_newer", ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER },
+    { "sparse",          ARCHIVE_EXTRACT_SPARSE },
+    { NULL,              0 }
+};
+
+// The counters in the table returned by read:extract():
+static const char* stats_fields[] = {
+    "entries", "files", "directories", "symlinks", "hardlinks", "others",
+    "bytes", "skipped", "warnings", "failed", NULL
+};
+
+#define AR_EXTRACT_DEFAULT_FLAGS \
+    (ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_SYMLINKS | ARCHIVE_EXTRACT_SECURE_NODOTDOT)
+
+#ifndef _WIN32
+static void ar_pool_free(struct ar_pool* self);
+#endif
+
+//////////////////////////////////////////////////////////////////////
+static int ar_disk_destroy(lua_State *L) {
+    struct ar_disk* self = (struct ar_disk*)luaL_checkudata(L, 1, AR_DISK);
+#ifndef _WIN32
+    if ( NULL != self->pool ) {
+        ar_pool_free(self->pool);
+        self->pool = NULL;
+    }
+#endif
+    if ( NULL != self->archive ) {
+        archive_write_free(self->archive);
+        self->archive = NULL;
+    }
+    free(self->path);
+    self->path = NULL;
+    self->path_size = 0;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Convert the flags option (an array of names, or a number) into
+// ARCHIVE_EXTRACT_* bits.
+static int ar_extract_flags(lua_State *L, int idx) {
+    int flags = 0;
+    size_t len, i;
+    if ( lua_isnil(L, idx) ) return AR_EXTRACT_DEFAULT_FLAGS;
+    if ( LUA_TNUMBER == lua_type(L, idx) ) return lua_tointeger(L, idx);
+    if ( ! lua_istable(L, idx) ) err("InvalidArgument: 'flags' must be a table of flag names");
+
+    len = lua_objlen(L, idx);
+    for ( i=1; i <= len; i++ ) {
+        const char* name;
+        int f;
+        lua_rawgeti(L, idx, i);
+        name = lua_tostring(L, -1);
+        for ( f=0; ; f++ ) {
+            if ( NULL == extract_flags[f].name ) {
+                err("InvalidArgument: '%s' is not a valid extract flag", name ? name : "?");
+            }
+            if ( NULL != name && 0 == strcmp(name, extract_flags[f].name) ) break;
+        }
+        flags |= extract_flags[f].flag;
+        lua_pop(L, 1);
+    }
+    return flags;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns dir .. "/" .. path in the scratch buffer of disk.
+static const char* ar_extract_join(lua_State *L,
+                                   struct ar_disk* disk,
+                                   const char* dir,
+                                   size_t dir_len,
+                                   const char* path)
+{
+    size_t path_len = strlen(path);
+    size_t size = dir_len + path_len + 2;
+    if ( size > disk->path_size ) {
+        char* buf = (char*)realloc(disk->path, size);
+        if ( NULL == buf ) err("OutOfMemory: unable to allocate path");
+        disk->path = buf;
+        disk->path_size = size;
+    }
+    memcpy(disk->path, dir, dir_len);
+    disk->path[dir_len] = '/';
+    memcpy(disk->path + dir_len + 1, path, path_len + 1);
+    return disk->path;
+}
+
+//////////////////////////////////////////////////////////////////////
+static void ar_extract_failed(lua_State *L,
+                              int stats_idx,
+                              struct archive_entry* entry,
+                              struct archive* ar)
+{
+    ar_util_error(L, stats_idx, archive_entry_pathname(entry), archive_error_string(ar));
+}
+
+//////////////////////////////////////////////////////////////////////
+// When a destination dir is given write_disk only sees the joined
+// path (and files written by the pool are never seen by write_disk),
+// so the checks for '..' and absolute paths are done here on the path
+// from the archive.  Returns NULL if path is allowed.
+static const char* ar_extract_check_path(const char* path, int flags) {
+    const char* p;
+    if ( NULL == path ) return NULL;
+#ifdef ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
+    if ( (flags & ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS) && '/' == path[0] ) {
+        return "Path is absolute";
+    }
+#endif
+    if ( flags & ARCHIVE_EXTRACT_SECURE_NODOTDOT ) {
+        for ( p = path; NULL != p; p = strchr(p, '/') ) {
+            if ( '/' == *p ) p++;
+            if ( '.' == p[0] && '.' == p[1] && ( '\0' == p[2] || '/' == p[2] ) ) {
+                return "Path contains '..'";
+            }
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Copy the data of the current entry from ar to disk.  Sparse holes
+// are preserved since write_data_block() is given the offset of every
+// block.  Returns the number of bytes copied, or -1 if the entry
+// could not be written.
+static double ar_extract_data(lua_State *L,
+                              struct ar_read* self_ref,
+                              struct archive* disk)
+{
+    struct archive* self = self_ref->archive;
+    const void* buff;
+    size_t      buff_len;
+    la_int64_t  offset;
+    double      total = 0;
+    int         result;
+
+    for ( ;; ) {
+        result = archive_read_data_block(self, &buff, &buff_len, &offset);
+        if ( ARCHIVE_EOF == result ) return total;
+        if ( result < ARCHIVE_WARN ) {
+            err("archive_read_data_block: %s", archive_error_string(self));
+        }
+        result = archive_write_data_block(disk, buff, buff_len, offset);
+        if ( ARCHIVE_FATAL == result ) {
+            err("archive_write_data_block: %s", archive_error_string(disk));
+        }
+        if ( result < ARCHIVE_WARN ) return -1;
+        total += buff_len;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Returns the stats field an entry is counted under.
+static const char* ar_extract_type(struct archive_entry* entry) {
+    if ( NULL != archive_entry_hardlink(entry) ) return "hardlinks";
+    switch ( archive_entry_filetype(entry) ) {
+    case AE_IFREG: return "files";
+    case AE_IFDIR: return "directories";
+    case AE_IFLNK: return "symlinks";
+    }
+    return "others";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write entry (and its data, if ar is not NULL) with write_disk and
+// update the stats table.
+static void ar_extract_entry(lua_State *L,
+                             struct ar_read* self_ref,
+                             struct archive* disk,
+                             struct archive_entry* entry,
+                             int stats_idx)
+{
+    const char* type_field = ar_extract_type(entry);
+    double bytes = 0;
+    int result = archive_write_header(disk, entry);
+    if ( ARCHIVE_FATAL == result ) {
+        err("archive_write_header: %s", archive_error_string(disk));
+    }
+    if ( result < ARCHIVE_WARN ) {
+        ar_extract_failed(L, stats_idx, entry, disk);
+        return;
+    }
+    if ( ARCHIVE_WARN == result ) ar_util_count(L, stats_idx, "warnings", 1);
+
+    if ( NULL != self_ref && archive_entry_size(entry) > 0 ) {
+        bytes = ar_extract_data(L, self_ref, disk);
+    }
+    if ( bytes >= 0 ) {
+        result = archive_write_finish_entry(disk);
+        if ( ARCHIVE_FATAL == result ) {
+            err("archive_write_finish_entry: %s", archive_error_string(disk));
+        }
+    }
+    if ( bytes < 0 || result < ARCHIVE_WARN ) {
+        ar_extract_failed(L, stats_idx, entry, disk);
+        return;
+    }
+    if ( ARCHIVE_WARN == result ) ar_util_count(L, stats_idx, "warnings", 1);
+
+    ar_util_count(L, stats_idx, "entries", 1);
+    ar_util_count(L, stats_idx, type_field, 1);
+    ar_util_count(L, stats_idx, "bytes", bytes);
+}
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Record an error from a writer thread.
+static void ar_pool_error(struct ar_pool* self, const char* path, int errnum) {
+    char buf[256];
+    const char* msg;
+    size_t len;
+    char* str;
+
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+    msg = strerror_r(errnum, buf, sizeof(buf));
+#else
+    msg = 0 == strerror_r(errnum, buf, sizeof(buf)) ? buf : "Unknown error";
+#endif
+    len = strlen(path) + strlen(msg) + 3;
+    str = (char*)malloc(len);
+    pthread_mutex_lock(&self->lock);
+    self->failed++;
+    if ( self->errors_len == self->errors_size ) {
+        size_t size = self->errors_size ? self->errors_size * 2 : 16;
+        char** errors = (char**)realloc(self->errors, size * sizeof(char*));
+        if ( NULL != errors ) {
+            self->errors = errors;
+            self->errors_size = size;
+        }
+    }
+    if ( NULL != str && self->errors_len < self->errors_size ) {
+        snprintf(str, len, "%s: %s", path, msg);
+        self->errors[self->errors_len++] = str;
+    } else {
+        free(str);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write a single file in a writer thread.
+static void ar_pool_write(struct ar_pool* self, struct ar_job* job) {
+    int oflags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+    int fd;
+
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    if ( ! (self->flags & ARCHIVE_EXTRACT_NO_OVERWRITE) &&
+         (self->flags & ARCHIVE_EXTRACT_UNLINK) )
+    {
+        unlink(job->path);
+    }
+    fd = open(job->path, oflags, job->mode & 0777);
+    if ( fd < 0 && EEXIST == errno && ! (self->flags & ARCHIVE_EXTRACT_NO_OVERWRITE) ) {
+        // Replace (rather than write through) whatever is there, like
+        // write_disk does, so a hardlink or symlink to a file
+        // elsewhere is left alone.  An empty directory is removed too:
+        if ( 0 != unlink(job->path) && ( EISDIR == errno || EPERM == errno ) ) {
+            rmdir(job->path);
+        }
+        fd = open(job->path, oflags, job->mode & 0777);
+    }
+    if ( fd < 0 ) {
+        ar_pool_error(self, job->path, errno);
+        return;
+    }
+
+    if ( job->size > 0 ) {
+#if defined(__linux__)
+        fallocate(fd, 0, 0, job->size);
+#elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+        posix_fallocate(fd, 0, job->size);
+#endif
+    }
+    if ( ! ar_util_write_all(fd, job->data, job->size) ) {
+        ar_pool_error(self, job->path, errno);
+        close(fd);
+        return;
+    }
+
+    // Set the owner first, since chown() clears the suid bits:
+    if ( (self->flags & ARCHIVE_EXTRACT_OWNER) && 0 != fchown(fd, job->uid, job->gid) ) {
+        ar_pool_error(self, job->path, errno);
+    }
+    if ( (self->flags & ARCHIVE_EXTRACT_PERM) && 0 != fchmod(fd, job->mode & 07777) ) {
+        ar_pool_error(self, job->path, errno);
+    }
+    if ( (self->flags & ARCHIVE_EXTRACT_TIME) && ( job->has_atime || job->has_mtime ) ) {
+        struct timespec times[2];
+        times[0] = job->atime;
+        times[1] = job->mtime;
+        if ( ! job->has_atime ) times[0].tv_nsec = UTIME_OMIT;
+        if ( ! job->has_mtime ) times[1].tv_nsec = UTIME_OMIT;
+        if ( 0 != futimens(fd, times) ) ar_pool_error(self, job->path, errno);
+    }
+    if ( 0 != close(fd) ) {
+        ar_pool_error(self, job->path, errno);
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    self->files++;
+    self->bytes += job->size;
+    pthread_mutex_unlock(&self->lock);
+}
+
+//////////////////////////////////////////////////////////////////////
+static void* ar_pool_thread(void* arg) {
+    struct ar_queue* queue = (struct ar_queue*)arg;
+    struct ar_job* job;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&queue->lock);
+        while ( NULL == queue->head && ! queue->done ) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        job = queue->head;
+        if ( NULL == job ) {
+            pthread_mutex_unlock(&queue->lock);
+            return NULL;
+        }
+        queue->head = job->next;
+        if ( NULL == queue->head ) queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        ar_pool_write(queue->pool, job);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->queued -= job->size;
+        queue->busy--;
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+        free(job);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Start nqueues writer threads.  Returns NULL if out of memory.
+static struct ar_pool* ar_pool_new(int nqueues, int flags) {
+    struct ar_pool* self = (struct ar_pool*)calloc(1, sizeof(struct ar_pool));
+    int i;
+    if ( NULL == self ) return NULL;
+    self->queues = (struct ar_queue*)calloc(nqueues, sizeof(struct ar_queue));
+    if ( NULL == self->queues ) {
+        free(self);
+        return NULL;
+    }
+    self->flags = flags;
+    self->nqueues = nqueues;
+    pthread_mutex_init(&self->lock, NULL);
+    for ( i=0; i < nqueues; i++ ) {
+        struct ar_queue* queue = &self->queues[i];
+        queue->pool = self;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->not_empty, NULL);
+        pthread_cond_init(&queue->not_full, NULL);
+        queue->started = ( 0 == pthread_create(&queue->thread, NULL, ar_pool_thread, queue) );
+    }
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Add a job to the queue for its path, blocking while that queue is
+// full.
+static void ar_pool_submit(struct ar_pool* self, struct ar_job* job) {
+    struct ar_queue* queue = &self->queues[ar_filter_hash(job->path) % self->nqueues];
+
+    pthread_mutex_lock(&queue->lock);
+    while ( queue->queued > 0 && queue->queued + job->size > AR_POOL_MAX_QUEUED ) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    job->next = NULL;
+    if ( NULL == queue->tail ) {
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+    queue->queued += job->size;
+    queue->busy++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Wait for every job in queue to be written.
+static void ar_pool_wait_queue(struct ar_queue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while ( queue->busy > 0 ) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Wait for every job queued for the same path as path to be written.
+static void ar_pool_wait_path(struct ar_pool* self, const char* path) {
+    ar_pool_wait_queue(&self->queues[ar_filter_hash(path) % self->nqueues]);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Wait for every queued job to be written.
+static void ar_pool_wait_all(struct ar_pool* self) {
+    int i;
+    for ( i=0; i < self->nqueues; i++ ) ar_pool_wait_queue(&self->queues[i]);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns true if write_disk may replace a directory with entry.
+// Only a directory over a directory (or over nothing) is safe.
+static int ar_pool_may_replace_dir(struct archive_entry* entry) {
+    struct stat st;
+    if ( AE_IFDIR != archive_entry_filetype(entry) ) return 1;
+    if ( 0 != lstat(archive_entry_pathname(entry), &st) ) return ENOENT != errno;
+    return ! S_ISDIR(st.st_mode);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Stop the writer threads once their queues are drained.
+static void ar_pool_join(struct ar_pool* self) {
+    int i;
+    for ( i=0; i < self->nqueues; i++ ) {
+        struct ar_queue* queue = &self->queues[i];
+        pthread_mutex_lock(&queue->lock);
+        queue->done = 1;
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    for ( i=0; i < self->nqueues; i++ ) {
+        struct ar_queue* queue = &self->queues[i];
+        if ( queue->started ) pthread_join(queue->thread, NULL);
+        queue->started = 0;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+static void ar_pool_free(struct ar_pool* self) {
+    size_t i;
+    ar_pool_join(self);
+    for ( i=0; i < (size_t)self->nqueues; i++ ) {
+        struct ar_queue* queue = &self->queues[i];
+        while ( NULL != queue->head ) {
+            struct ar_job* job = queue->head;
+            queue->head = job->next;
+            free(job);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_cond_destroy(&queue->not_full);
+    }
+    for ( i=0; i < self->errors_len; i++ ) free(self->errors[i]);
+    pthread_mutex_destroy(&self->lock);
+    free(self->errors);
+    free(self->parent);
+    free(self->queues);
+    free(self);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns true if entry is a small regular file the pool can write.
+// Anything needing more than open, write, fchown, fchmod and futimens
+// (such as the xattrs, ACLs or file flags the flags ask for) is left
+// to write_disk.
+static int ar_pool_can_write(struct ar_pool* self, struct archive_entry* entry) {
+    unsigned long set = 0, clear = 0;
+    if ( AE_IFREG != archive_entry_filetype(entry) ||
+         NULL != archive_entry_hardlink(entry) ||
+         archive_entry_size(entry) > AR_POOL_MAX_FILE )
+    {
+        return 0;
+    }
+    if ( self->flags & ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER ) return 0;
+    if ( (self->flags & ARCHIVE_EXTRACT_SPARSE) && archive_entry_sparse_count(entry) > 0 ) {
+        return 0;
+    }
+    if ( (self->flags & ARCHIVE_EXTRACT_XATTR) && archive_entry_xattr_count(entry) > 0 ) {
+        return 0;
+    }
+    if ( (self->flags & ARCHIVE_EXTRACT_ACL) &&
+         archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS |
+                                        ARCHIVE_ENTRY_ACL_TYPE_DEFAULT |
+                                        ARCHIVE_ENTRY_ACL_TYPE_NFS4) > 0 )
+    {
+        return 0;
+    }
+    if ( self->flags & ARCHIVE_EXTRACT_FFLAGS ) {
+        archive_entry_fflags(entry, &set, &clear);
+        if ( 0 != set || 0 != clear ) return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Make sure the parent directories of path exist, creating them as
+// write_disk would.  Returns false if the file should be written by
+// write_disk instead (so that it can handle anything unusual, such as
+// a symlink in the path, and report errors).
+static int ar_pool_parents(lua_State *L, struct ar_pool* self, const char* path) {
+    const char* slash = strrchr(path, '/');
+    size_t len;
+    char* p;
+
+    if ( NULL == slash || slash == path ) return 1;
+    len = slash - path;
+    if ( NULL != self->parent && 0 == strncmp(self->parent, path, len) &&
+         '\0' == self->parent[len] )
+    {
+        return 1;
+    }
+
+    if ( len + 1 > self->parent_size ) {
+        char* parent = (char*)realloc(self->parent, len + 1);
+        if ( NULL == parent ) err("OutOfMemory: unable to allocate path");
+        self->parent = parent;
+        self->parent_size = len + 1;
+    }
+    memcpy(self->parent, path, len);
+    self->parent[len] = '\0';
+
+    // Walk each component, so we never follow a symlink:
+    for ( p = self->parent + 1; ; p++ ) {
+        struct stat st;
+        int is_last = ( '\0' == *p );
+        if ( '/' != *p && ! is_last ) continue;
+        *p = '\0';
+        if ( 0 != lstat(self->parent, &st) ) {
+            if ( ENOENT != errno || 0 != mkdir(self->parent, 0777) ) {
+                self->parent[0] = '\0';
+                return 0;
+            }
+        } else if ( ! S_ISDIR(st.st_mode) ) {
+            if ( ! S_ISLNK(st.st_mode) ||
+                 (self->flags & ARCHIVE_EXTRACT_SECURE_SYMLINKS) ||
+                 0 != stat(self->parent, &st) ||
+                 ! S_ISDIR(st.st_mode) )
+            {
+                self->parent[0] = '\0';
+                return 0;
+            }
+        }
+        if ( is_last ) break;
+        *p = '/';
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read the data of a small regular file and queue it for the writer
+// threads.  Holes in sparse files are filled with zeros.
+static void ar_pool_add_file(lua_State *L,
+                             struct ar_read* self_ref,
+                             struct ar_pool* self,
+                             struct archive_entry* entry,
+                             struct archive* disk,
+                             int stats_idx)
+{
+    const char* path = archive_entry_pathname(entry);
+    size_t      path_len = strlen(path);
+    size_t      size = (size_t)archive_entry_size(entry);
+    size_t      filled = 0;
+    struct ar_job* job;
+
+    job = (struct ar_job*)malloc(sizeof(struct ar_job) + path_len + 1 + size);
+    if ( NULL == job ) err("OutOfMemory: unable to queue '%s'", path);
+    memset(job, 0, sizeof(struct ar_job));
+    job->path = (char*)(job + 1);
+    job->data = job->path + path_len + 1;
+    job->size = size;
+    memcpy(job->path, path, path_len + 1);
+
+    job->mode = archive_entry_perm(entry);
+    if ( self->flags & ARCHIVE_EXTRACT_OWNER ) {
+        job->uid = (uid_t)archive_write_disk_uid(
+            disk, archive_entry_uname(entry), archive_entry_uid(entry));
+        job->gid = (gid_t)archive_write_disk_gid(
+            disk, archive_entry_gname(entry), archive_entry_gid(entry));
+    }
+    job->has_atime = archive_entry_atime_is_set(entry);
+    job->atime.tv_sec = archive_entry_atime(entry);
+    job->atime.tv_nsec = archive_entry_atime_nsec(entry);
+    job->has_mtime = archive_entry_mtime_is_set(entry);
+    job->mtime.tv_sec = archive_entry_mtime(entry);
+    job->mtime.tv_nsec = archive_entry_mtime_nsec(entry);
+
+    for ( ;; ) {
+        const void* buff;
+        size_t      buff_len;
+        la_int64_t  offset;
+        int result = archive_read_data_block(self_ref->archive, &buff, &buff_len, &offset);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( result < ARCHIVE_WARN ) {
+            free(job);
+            err("archive_read_data_block: %s", archive_error_string(self_ref->archive));
+        }
+        if ( offset < (la_int64_t)filled || offset + buff_len > size ) {
+            ar_util_error(L, stats_idx, path, "Entry data does not match its size");
+            free(job);
+            return;
+        }
+        memset(job->data + filled, 0, offset - filled);
+        memcpy(job->data + offset, buff, buff_len);
+        filled = offset + buff_len;
+    }
+    memset(job->data + filled, 0, size - filled);
+
+    ar_pool_submit(self, job);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Stop the writer threads and merge their results into the stats
+// table.
+static void ar_pool_finish(lua_State *L,
+                           struct ar_pool* self,
+                           int stats_idx)
+{
+    size_t i;
+    ar_pool_join(self);
+
+    ar_util_count(L, stats_idx, "entries", self->files);
+    ar_util_count(L, stats_idx, "files", self->files);
+    ar_util_count(L, stats_idx, "bytes", self->bytes);
+    ar_util_count(L, stats_idx, "failed", self->failed);
+    for ( i=0; i < self->errors_len; i++ ) {
+        lua_getfield(L, stats_idx, "errors"); // {errors}
+        lua_pushstring(L, self->errors[i]); // {errors}, msg
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1); // {errors}
+        lua_pop(L, 1);
+    }
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Extract the rest of the archive:
+//
+//   stats = read:extract { dir = "dest", flags = { "perm", "time" },
+//                          threads = N, fsync = true,
+//                          include = ..., exclude = ..., paths = ... }
+//
+int ar_read_extract(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    struct archive* self = self_ref->archive;
+    struct archive_entry* entry;
+    struct ar_filter* filter;
+    struct ar_disk* disk;
+    const char* dir = NULL;
+    size_t dir_len = 0;
+    double start = ar_util_now();
+    int threads = 0;
+    int do_fsync;
+    int flags;
+    int result;
+    int stats_idx;
+    int i;
+
+    if ( NULL == self ) err("NULL archive{read}!");
+    lua_settop(L, 2); // {self}, {opts}
+    if ( lua_isnil(L, 2) ) {
+        lua_newtable(L);
+        lua_replace(L, 2);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_getfield(L, 2, "threads");
+    if ( ! lua_isnil(L, -1) ) {
+        threads = lua_tointeger(L, -1);
+        if ( threads <= 0 ) err("InvalidArgument: 'threads' must be a positive number");
+#ifdef _WIN32
+        if ( threads > 1 ) err("NotSupported: 'threads' is not supported on this platform");
+#endif
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "fsync");
+    do_fsync = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "dir"); // {self}, {opts}, dir
+    if ( ! lua_isnil(L, -1) ) {
+        if ( ! lua_isstring(L, -1) ) err("InvalidArgument: 'dir' must be a string");
+        dir = lua_tolstring(L, -1, &dir_len);
+        // Avoid a double slash, but keep "/" meaning the root:
+        while ( dir_len > 1 && '/' == dir[dir_len-1] ) dir_len--;
+    }
+    lua_getfield(L, 2, "flags"); // {self}, {opts}, dir, flags
+    flags = ar_extract_flags(L, 4);
+    lua_pop(L, 1); // {self}, {opts}, dir
+
+    filter = ar_filter_new(L, 2); // {self}, {opts}, dir, {filter}
+
+    disk = (struct ar_disk*)lua_newuserdata(L, sizeof(struct ar_disk)); // ..., {disk}
+    memset(disk, 0, sizeof(struct ar_disk));
+    luaL_getmetatable(L, AR_DISK);
+    lua_setmetatable(L, -2);
+    disk->archive = archive_write_disk_new();
+    if ( NULL == disk->archive ) err("OutOfMemory: archive_write_disk_new failed");
+    if ( ARCHIVE_OK != archive_write_disk_set_options(
+             disk->archive,
+             // The joined path would fail these checks, so they are
+             // done by ar_extract_check_path() instead:
+             NULL == dir ? flags : flags & ~(ARCHIVE_EXTRACT_SECURE_NODOTDOT
+#ifdef ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
+                                             | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
+#endif
+                 )) )
+    {
+        err("archive_write_disk_set_options: %s", archive_error_string(disk->archive));
+    }
+    if ( ARCHIVE_OK != archive_write_disk_set_standard_lookup(disk->archive) ) {
+        err("archive_write_disk_set_standard_lookup: %s", archive_error_string(disk->archive));
+    }
+#ifndef _WIN32
+    if ( threads > 1 ) {
+        disk->pool = ar_pool_new(threads, flags);
+        if ( NULL == disk->pool ) err("OutOfMemory: unable to start %d threads", threads);
+    }
+#endif
+
+    lua_pushcfunction(L, ar_entry); // ..., {disk}, ar_entry
+    lua_call(L, 0, 1); // ..., {disk}, {entry}
+    entry = *ar_entry_check(L, -1);
+
+    lua_createtable(L, 0, 12); // ..., {disk}, {entry}, {stats}
+    for ( i=0; NULL != stats_fields[i]; i++ ) {
+        lua_pushnumber(L, 0);
+        lua_setfield(L, -2, stats_fields[i]);
+    }
+    lua_newtable(L);
+    lua_setfield(L, -2, "errors");
+    stats_idx = lua_gettop(L);
+
+    for ( ;; ) {
+        const char* msg;
+
+        self_ref->pending_len = 0;
+        result = archive_read_next_header2(self, entry);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( result < ARCHIVE_WARN ) {
+            err("archive_read_next_header2: %s", archive_error_string(self));
+        }
+        if ( ! ar_filter_match(filter, archive_entry_pathname(entry)) ) {
+            ar_util_count(L, stats_idx, "skipped", 1);
+            continue;
+        }
+
+        // Entries written by the pool never reach write_disk, so the
+        // checks are done here even without a dir:
+        msg = ar_extract_check_path(archive_entry_pathname(entry), flags);
+        if ( NULL == msg ) msg = ar_extract_check_path(archive_entry_hardlink(entry), flags);
+        if ( NULL != msg ) {
+            ar_util_error(L, stats_idx, archive_entry_pathname(entry), msg);
+            continue;
+        }
+        if ( NULL != dir ) {
+            archive_entry_copy_pathname(
+                entry, ar_extract_join(L, disk, dir, dir_len, archive_entry_pathname(entry)));
+            if ( NULL != archive_entry_hardlink(entry) ) {
+                archive_entry_copy_hardlink(
+                    entry, ar_extract_join(L, disk, dir, dir_len, archive_entry_hardlink(entry)));
+            }
+        }
+
+#ifndef _WIN32
+        if ( NULL != disk->pool ) {
+            struct ar_pool* pool = disk->pool;
+            if ( ar_pool_can_write(pool, entry) &&
+                 ar_pool_parents(L, pool, archive_entry_pathname(entry)) )
+            {
+                ar_pool_add_file(L, self_ref, pool, entry, disk->archive, stats_idx);
+                continue;
+            }
+            // Anything else is written in archive order, after a file
+            // still queued for the same path.  The parents of queued
+            // files were checked when they were queued, so an entry
+            // that may replace a directory (with a symlink, say) waits
+            // for all of them:
+            if ( ar_pool_may_replace_dir(entry) ) {
+                ar_pool_wait_all(pool);
+            } else {
+                ar_pool_wait_path(pool, archive_entry_pathname(entry));
+            }
+        }
+#endif
+        ar_extract_entry(L, self_ref, disk->archive, entry, stats_idx);
+#ifndef _WIN32
+        // A symlink may now be where a parent directory was:
+        if ( NULL != disk->pool && AE_IFDIR != archive_entry_filetype(entry) &&
+             NULL != disk->pool->parent )
+        {
+            disk->pool->parent[0] = '\0';
+        }
+#endif
+    }
+
+#ifndef _WIN32
+    if ( NULL != disk->pool ) ar_pool_finish(L, disk->pool, stats_idx);
+#endif
+
+    // Directory permissions and times are fixed up on close:
+    if ( ARCHIVE_OK != archive_write_close(disk->archive) ) {
+        err("archive_write_close: %s", archive_error_string(disk->archive));
+    }
+
+#ifndef _WIN32
+    // A single sync of the file system rather than one per file:
+    if ( do_fsync ) {
+        const char* sync_dir = NULL == dir ? "." : dir;
+        int oflags = O_RDONLY;
+        int fd;
+#ifdef O_CLOEXEC
+        oflags |= O_CLOEXEC;
+#endif
+        fd = open(sync_dir, oflags);
+        if ( fd < 0 ) err("open: %s: %s", sync_dir, strerror(errno));
+#ifdef __linux__
+        result = syncfs(fd);
+#else
+        sync();
+        result = 0;
+#endif
+        close(fd);
+        if ( 0 != result ) err("syncfs: %s", strerror(errno));
+    }
+#endif
+
+    lua_pushnumber(L, ar_util_now() - start);
+    lua_setfield(L, stats_idx, "seconds");
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Postcondition: the archive{disk} metatable is registered.
+//////////////////////////////////////////////////////////////////////
+int ar_extract_init(lua_State *L) {
+    luaL_newmetatable(L, AR_DISK); // {meta}
+    lua_pushcfunction(L, ar_disk_destroy); // {meta}, fn
+    lua_setfield(L, -2, "__gc"); // {meta}
+    lua_pop(L, 1);
+    return 0;
+}
@@ -0,0 +1,6 @@
+// This is a private header subject to change.
+
+#define AR_DISK "archive{disk}"
+
+int ar_extract_init(lua_State *L);
+int ar_read_extract(lua_State *L);
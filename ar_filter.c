@@ -0,0 +1,238 @@
+//////////////////////////////////////////////////////////////////////
+// Implement the archive{filter} object, used to select entries by
+// pathname entirely in C so that rejected entries never cross into
+// Lua.
+//////////////////////////////////////////////////////////////////////
+
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fnmatch.h>
+#endif
+
+#include "ar_filter.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+//////////////////////////////////////////////////////////////////////
+// FNV-1a, also used to pick a writer thread in ar_extract.c.
+size_t ar_filter_hash(const char* str) {
+    size_t hash = 2166136261u;
+    for ( ; *str; str++ ) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//////////////////////////////////////////////////////////////////////
+static char* ar_filter_strdup(lua_State *L, const char* str, size_t len) {
+    char* copy = (char*)malloc(len + 1);
+    if ( NULL == copy ) err("OutOfMemory: unable to copy filter pattern");
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: the value at idx is nil or an array of glob
+// patterns.
+static void ar_filter_patterns(lua_State *L,
+                               int idx,
+                               const char* field,
+                               char*** patterns,
+                               size_t* patterns_len)
+{
+    size_t len, i;
+    if ( lua_isnil(L, idx) ) return;
+    if ( lua_isstring(L, idx) ) {
+        // Allow a single pattern as a shortcut:
+        *patterns = (char**)calloc(1, sizeof(char*));
+        if ( NULL == *patterns ) err("OutOfMemory: unable to allocate '%s'", field);
+        *patterns_len = 1;
+        (*patterns)[0] = ar_filter_strdup(L, lua_tostring(L, idx), lua_strlen(L, idx));
+        return;
+    }
+    if ( ! lua_istable(L, idx) ) err("InvalidArgument: '%s' must be a table of patterns", field);
+
+    len = lua_objlen(L, idx);
+    if ( 0 == len ) return;
+    *patterns = (char**)calloc(len, sizeof(char*));
+    if ( NULL == *patterns ) err("OutOfMemory: unable to allocate '%s'", field);
+    for ( i=0; i < len; i++ ) {
+        lua_rawgeti(L, idx, i+1);
+        if ( ! lua_isstring(L, -1) ) err("InvalidArgument: '%s' must be a table of patterns", field);
+        (*patterns)[i] = ar_filter_strdup(L, lua_tostring(L, -1), lua_strlen(L, -1));
+        *patterns_len = i+1;
+        lua_pop(L, 1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: the table at idx is either a set ({ [path] = true })
+// or an array ({ path, ... }) of pathnames.
+static void ar_filter_paths(lua_State *L, struct ar_filter* self, int idx) {
+    size_t count = 0;
+    size_t size  = 1;
+
+    if ( lua_isnil(L, idx) ) return;
+    if ( ! lua_istable(L, idx) ) err("InvalidArgument: 'paths' must be a table");
+
+    lua_pushnil(L);
+    while ( lua_next(L, idx) != 0 ) {
+        count++;
+        lua_pop(L, 1);
+    }
+
+    // Keep the load factor at or below 1/2:
+    while ( size < count * 2 ) size <<= 1;
+    self->paths = (char**)calloc(size, sizeof(char*));
+    if ( NULL == self->paths ) err("OutOfMemory: unable to allocate 'paths'");
+    self->paths_size = size;
+
+    lua_pushnil(L); // nil
+    while ( lua_next(L, idx) != 0 ) { // key, value
+        const char* path = NULL;
+        size_t      len  = 0;
+        size_t      slot;
+        if ( LUA_TSTRING == lua_type(L, -2) ) {
+            if ( lua_toboolean(L, -1) ) path = lua_tolstring(L, -2, &len);
+        } else if ( LUA_TSTRING == lua_type(L, -1) ) {
+            path = lua_tolstring(L, -1, &len);
+        }
+        if ( NULL != path ) {
+            slot = ar_filter_hash(path) & (size - 1);
+            while ( NULL != self->paths[slot] ) {
+                if ( 0 == strcmp(self->paths[slot], path) ) break;
+                slot = (slot + 1) & (size - 1);
+            }
+            if ( NULL == self->paths[slot] ) {
+                self->paths[slot] = ar_filter_strdup(L, path, len);
+            }
+        }
+        lua_pop(L, 1); // key
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Create a filter from the include, exclude and paths fields of the
+// table at opts_idx.  Pushes the archive{filter} (which owns the C
+// memory) onto the stack and returns it.  If the table has none of
+// those fields, nil is pushed and NULL is returned.
+struct ar_filter* ar_filter_new(lua_State *L, int opts_idx) {
+    struct ar_filter* self;
+    int top = lua_gettop(L);
+
+    if ( opts_idx < 0 ) opts_idx += top + 1;
+    if ( ! lua_istable(L, opts_idx) ) {
+        lua_pushnil(L);
+        return NULL;
+    }
+
+    lua_getfield(L, opts_idx, "include"); // top+1
+    lua_getfield(L, opts_idx, "exclude"); // top+2
+    lua_getfield(L, opts_idx, "paths");   // top+3
+    if ( lua_isnil(L, top+1) && lua_isnil(L, top+2) && lua_isnil(L, top+3) ) {
+        lua_settop(L, top);
+        lua_pushnil(L);
+        return NULL;
+    }
+
+    self = (struct ar_filter*)lua_newuserdata(L, sizeof(struct ar_filter)); // top+4
+    memset(self, 0, sizeof(struct ar_filter));
+    luaL_getmetatable(L, AR_FILTER);
+    lua_setmetatable(L, -2);
+
+    ar_filter_patterns(L, top+1, "include", &self->include, &self->include_len);
+    ar_filter_patterns(L, top+2, "exclude", &self->exclude, &self->exclude_len);
+    ar_filter_paths(L, self, top+3);
+
+    lua_replace(L, top+1);
+    lua_settop(L, top+1);
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_filter_glob(const char* pattern, const char* pathname) {
+#ifdef _WIN32
+    return 0 == strcmp(pattern, pathname);
+#else
+    return 0 == fnmatch(pattern, pathname, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns true if pathname is in the set of paths or matches an
+// include pattern (or if neither were given), and does not match any
+// exclude pattern.
+int ar_filter_match(struct ar_filter* self, const char* pathname) {
+    size_t i;
+    int included;
+
+    if ( NULL == self ) return 1;
+    if ( NULL == pathname ) return 0;
+
+    included = ( 0 == self->paths_size && 0 == self->include_len );
+    if ( ! included && self->paths_size > 0 ) {
+        size_t slot = ar_filter_hash(pathname) & (self->paths_size - 1);
+        while ( NULL != self->paths[slot] ) {
+            if ( 0 == strcmp(self->paths[slot], pathname) ) {
+                included = 1;
+                break;
+            }
+            slot = (slot + 1) & (self->paths_size - 1);
+        }
+    }
+    for ( i=0; ! included && i < self->include_len; i++ ) {
+        included = ar_filter_glob(self->include[i], pathname);
+    }
+    if ( ! included ) return 0;
+
+    for ( i=0; i < self->exclude_len; i++ ) {
+        if ( ar_filter_glob(self->exclude[i], pathname) ) return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns true if pathname matches one of the exclude patterns, used
+// to decide if a directory should be descended into.
+int ar_filter_excluded(struct ar_filter* self, const char* pathname) {
+    size_t i;
+
+    if ( NULL == self ) return 0;
+    for ( i=0; i < self->exclude_len; i++ ) {
+        if ( ar_filter_glob(self->exclude[i], pathname) ) return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+static void ar_filter_free_strings(char** strs, size_t len) {
+    size_t i;
+    if ( NULL == strs ) return;
+    for ( i=0; i < len; i++ ) free(strs[i]);
+    free(strs);
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_filter_destroy(lua_State *L) {
+    struct ar_filter* self = (struct ar_filter*)luaL_checkudata(L, 1, AR_FILTER);
+    ar_filter_free_strings(self->include, self->include_len);
+    ar_filter_free_strings(self->exclude, self->exclude_len);
+    ar_filter_free_strings(self->paths, self->paths_size);
+    memset(self, 0, sizeof(struct ar_filter));
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Postcondition: the archive{filter} metatable is registered.
+//////////////////////////////////////////////////////////////////////
+int ar_filter_init(lua_State *L) {
+    luaL_newmetatable(L, AR_FILTER); // {meta}
+    lua_pushcfunction(L, ar_filter_destroy); // {meta}, fn
+    lua_setfield(L, -2, "__gc"); // {meta}
+    lua_pop(L, 1);
+    return 0;
+}
@@ -0,0 +1,22 @@
+// This is a private header subject to change.
+
+#define AR_FILTER "archive{filter}"
+
+struct ar_filter {
+    // Glob patterns (matched with fnmatch):
+    char**  include;
+    size_t  include_len;
+    char**  exclude;
+    size_t  exclude_len;
+
+    // Open addressing hash set of exact pathnames, size is a power of
+    // two (or zero if no paths were given):
+    char**  paths;
+    size_t  paths_size;
+};
+
+int ar_filter_init(lua_State *L);
+struct ar_filter* ar_filter_new(lua_State *L, int opts_idx);
+int ar_filter_match(struct ar_filter* self, const char* pathname);
+int ar_filter_excluded(struct ar_filter* self, const char* pathname);
+size_t ar_filter_hash(const char* str);
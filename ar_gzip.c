@@ -0,0 +1,148 @@
+//////////////////////////////////////////////////////////////////////
+// Parallel gzip compression used by archive.write { compression =
+// "gzip", threads = N }.
+//
+// The input is split into AR_GZIP_BLOCK sized blocks which are
+// deflated by ar_deflate, each primed with the last 32K of the block
+// before it.  The output is a standard gzip stream that any gunzip
+// can read.
+//////////////////////////////////////////////////////////////////////
+
+#ifdef AR_HAVE_ZLIB
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "ar_deflate.h"
+#include "ar_gzip.h"
+
+#define AR_GZIP_BLOCK (128*1024)
+
+struct ar_gzip {
+    ar_gzip_sink           sink;
+    void*                  ctx;
+    const char*            error;
+    struct ar_deflate*     pool;
+
+    // The block being filled by the caller:
+    struct ar_deflate_job* current;
+
+    uLong                  crc;
+    uLong                  total;
+    int                    wrote_header;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Emit callback of the pool.
+static int ar_gzip_emit(void* ctx, struct ar_deflate_job* job) {
+    struct ar_gzip* self = (struct ar_gzip*)ctx;
+
+    self->crc = crc32_combine(self->crc, job->crc, job->in_len);
+    self->total += job->in_len;
+    if ( ! self->sink(self->ctx, job->out, job->out_len) ) {
+        self->error = "write failed";
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+struct ar_gzip* ar_gzip_new(int threads, int level, ar_gzip_sink sink, void* ctx) {
+    struct ar_gzip* self = (struct ar_gzip*)calloc(1, sizeof(struct ar_gzip));
+    if ( NULL == self ) return NULL;
+
+    self->sink  = sink;
+    self->ctx   = ctx;
+    self->crc   = crc32(0L, Z_NULL, 0);
+    self->pool  = ar_deflate_new(threads, level, ar_gzip_emit, self, &self->error);
+    self->current = ar_deflate_job_new(NULL, 0, AR_GZIP_BLOCK);
+    if ( NULL == self->pool || NULL == self->current ) {
+        ar_gzip_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Hand the current block to the pool and start a new one primed with
+// its last 32K.
+static int ar_gzip_submit(struct ar_gzip* self, int last) {
+    struct ar_deflate_job* job = self->current;
+
+    if ( ! self->wrote_header ) {
+        static const unsigned char header[10] = {
+            0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+        };
+        self->wrote_header = 1;
+        if ( ! self->sink(self->ctx, header, sizeof(header)) ) {
+            self->error = "write failed";
+            return 0;
+        }
+    }
+
+    self->current = NULL;
+    if ( ! last ) {
+        self->current = ar_deflate_job_next(job, AR_GZIP_BLOCK);
+        if ( NULL == self->current ) {
+            self->error = "out of memory";
+            ar_deflate_job_free(job);
+            return 0;
+        }
+    }
+    job->last = last;
+    return ar_deflate_submit(self->pool, job);
+}
+
+//////////////////////////////////////////////////////////////////////
+int ar_gzip_write(struct ar_gzip* self, const void* buff, size_t len) {
+    const unsigned char* ptr = (const unsigned char*)buff;
+
+    if ( NULL != self->error ) return 0;
+    while ( len > 0 ) {
+        struct ar_deflate_job* job = self->current;
+        size_t chunk = AR_GZIP_BLOCK - job->in_len;
+        if ( chunk > len ) chunk = len;
+        memcpy(job->in + job->dict_len + job->in_len, ptr, chunk);
+        job->in_len += chunk;
+        ptr += chunk;
+        len -= chunk;
+        if ( AR_GZIP_BLOCK == job->in_len && ! ar_gzip_submit(self, 0) ) return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Compress the final block, write everything out and the trailer.
+int ar_gzip_finish(struct ar_gzip* self) {
+    unsigned char trailer[8];
+    int i;
+
+    if ( NULL != self->error ) return 0;
+    if ( NULL == self->current ) return 1; // Already finished.
+    if ( ! ar_gzip_submit(self, 1) || ! ar_deflate_flush(self->pool) ) return 0;
+    for ( i=0; i < 4; i++ ) {
+        trailer[i]   = (unsigned char)(self->crc >> (8*i));
+        trailer[4+i] = (unsigned char)(self->total >> (8*i));
+    }
+    if ( ! self->sink(self->ctx, trailer, sizeof(trailer)) ) {
+        self->error = "write failed";
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+const char* ar_gzip_error(struct ar_gzip* self) {
+    return self->error;
+}
+
+//////////////////////////////////////////////////////////////////////
+void ar_gzip_free(struct ar_gzip* self) {
+    if ( NULL == self ) return;
+    ar_deflate_free(self->pool);
+    ar_deflate_job_free(self->current);
+    free(self);
+}
+
+#endif
@@ -0,0 +1,14 @@
+// This is a private header subject to change.
+
+// Called (always from the thread calling ar_gzip_write() or
+// ar_gzip_finish()) with the compressed output in order, returns
+// false on error.
+typedef int (*ar_gzip_sink)(void* ctx, const void* buff, size_t len);
+
+struct ar_gzip;
+
+struct ar_gzip* ar_gzip_new(int threads, int level, ar_gzip_sink sink, void* ctx);
+int  ar_gzip_write(struct ar_gzip* self, const void* buff, size_t len);
+int  ar_gzip_finish(struct ar_gzip* self);
+void ar_gzip_free(struct ar_gzip* self);
+const char* ar_gzip_error(struct ar_gzip* self);
@@ -0,0 +1,561 @@
+//////////////////////////////////////////////////////////////////////
+// Implement the archive{index} object, which records where every
+// entry of an uncompressed tar archive lives so that a single entry
+// can be read by seeking straight to it.
+//
+// An archive{index} is a plain table with this layout:
+//
+//   {
+//     source  = "/path/to/archive.tar", -- may be nil
+//     entries = {                       -- in archive order
+//       { header_offset, data_offset, size, pathname },
+//       ...
+//     },
+//     paths   = {                       -- the last entry for a path
+//       [pathname] = n,
+//       ...
+//     },
+//     globals = {                       -- pax global headers
+//       offset, length, ...
+//     },
+//   }
+//////////////////////////////////////////////////////////////////////
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ar_index.h"
+#include "ar_read.h"
+#include "ar_entry.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+// First line of a saved index file is the magic and a version, 1
+// had no globals line:
+#define AR_INDEX_MAGIC   "lua-archive-index"
+#define AR_INDEX_VERSION 2
+
+// Size of a tar header block:
+#define AR_INDEX_BLOCK 512
+
+//////////////////////////////////////////////////////////////////////
+// Push a new empty archive{index} onto the stack.
+static void ar_index_new(lua_State *L) {
+    lua_createtable(L, 0, 4); // {index}
+    lua_newtable(L); // {index}, {entries}
+    lua_setfield(L, -2, "entries"); // {index}
+    lua_newtable(L); // {index}, {paths}
+    lua_setfield(L, -2, "paths"); // {index}
+    lua_newtable(L); // {index}, {globals}
+    lua_setfield(L, -2, "globals"); // {index}
+    luaL_getmetatable(L, AR_INDEX); // {index}, {meta}
+    lua_setmetatable(L, -2); // {index}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Append an entry to the {index} at index_idx.  The pathname is at the
+// top of the stack and is popped.
+static void ar_index_add(lua_State *L,
+                         int index_idx,
+                         lua_Number header_offset,
+                         lua_Number data_offset,
+                         lua_Number size)
+{
+    int n;
+    lua_getfield(L, index_idx, "entries"); // path, {entries}
+    n = lua_objlen(L, -1) + 1;
+    lua_createtable(L, 4, 0); // path, {entries}, {loc}
+    lua_pushnumber(L, header_offset);
+    lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, data_offset);
+    lua_rawseti(L, -2, 2);
+    lua_pushnumber(L, size);
+    lua_rawseti(L, -2, 3);
+    lua_pushvalue(L, -3); // path, {entries}, {loc}, path
+    lua_rawseti(L, -2, 4); // path, {entries}, {loc}
+    lua_rawseti(L, -2, n); // path, {entries}
+    lua_pop(L, 1); // path
+
+    // Later entries replace earlier ones when extracted, so the path
+    // lookup finds the last one:
+    lua_getfield(L, index_idx, "paths"); // path, {paths}
+    lua_insert(L, -2); // {paths}, path
+    lua_pushinteger(L, n); // {paths}, path, n
+    lua_rawset(L, -3); // {paths}
+    lua_pop(L, 1); // <nothing>
+}
+
+//////////////////////////////////////////////////////////////////////
+// Append offset, length to the globals of the {index} at index_idx.
+static void ar_index_add_global(lua_State *L,
+                                int index_idx,
+                                lua_Number offset,
+                                lua_Number length)
+{
+    int n;
+    lua_getfield(L, index_idx, "globals"); // {globals}
+    n = lua_objlen(L, -1);
+    lua_pushnumber(L, offset);
+    lua_rawseti(L, -2, n + 1);
+    lua_pushnumber(L, length);
+    lua_rawseti(L, -2, n + 2);
+    lua_pop(L, 1); // <nothing>
+}
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Returns the value of an octal tar header field, or -1.
+static double ar_index_octal(const char* field, size_t len) {
+    double value = 0;
+    size_t i = 0;
+    while ( i < len && ' ' == field[i] ) i++;
+    if ( i == len || field[i] < '0' || field[i] > '7' ) return -1;
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; i++ ) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+//////////////////////////////////////////////////////////////////////
+// libarchive consumes pax global headers along with the header of the
+// entry that follows them, so walk the blocks between header_offset
+// and the entry's own header looking for them.  Each one found is
+// recorded in the globals of the {index} at index_idx.
+static void ar_index_find_globals(lua_State *L,
+                                  int index_idx,
+                                  int fd,
+                                  double pos,
+                                  double data_offset)
+{
+    char block[AR_INDEX_BLOCK];
+    while ( pos + AR_INDEX_BLOCK < data_offset ) {
+        double size, length;
+        if ( AR_INDEX_BLOCK != pread(fd, block, AR_INDEX_BLOCK, (off_t)pos) ) return;
+        size = ar_index_octal(block + 124, 12);
+        if ( size < 0 ) return;
+        length = AR_INDEX_BLOCK +
+            AR_INDEX_BLOCK * ((unsigned long long)(size + AR_INDEX_BLOCK - 1) / AR_INDEX_BLOCK);
+        if ( 'g' == block[156] ) ar_index_add_global(L, index_idx, pos, length);
+        pos += length;
+    }
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Walk the rest of the archive in one pass, recording the position of
+// every entry.  The data is skipped over, so this is cheap for native
+// sources.
+int ar_read_index(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    struct archive* self = self_ref->archive;
+    struct archive_entry* entry;
+    int is_first = 1;
+    int result;
+    int fd = -1;
+
+    if ( NULL == self ) err("NULL archive{read}!");
+    lua_settop(L, 1); // {self}
+
+    lua_pushcfunction(L, ar_entry); // {self}, ar_entry
+    lua_call(L, 0, 1); // {self}, {entry}
+    entry = *ar_entry_check(L, 2);
+
+    ar_index_new(L); // {self}, {entry}, {index}
+    lua_getfenv(L, 1); // {self}, {entry}, {index}, {fenv}
+    lua_getfield(L, -1, "path"); // {self}, {entry}, {index}, {fenv}, path
+    lua_setfield(L, 3, "source"); // {self}, {entry}, {index}, {fenv}
+    lua_pop(L, 1); // {self}, {entry}, {index}
+
+    for ( ;; ) {
+        const char* pathname;
+        double header_offset, data_offset;
+
+        self_ref->pending_len = 0;
+        result = archive_read_next_header2(self, entry);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( ARCHIVE_OK != result ) {
+#ifndef _WIN32
+            if ( fd >= 0 ) close(fd);
+#endif
+            err("archive_read_next_header2: %s", archive_error_string(self));
+        }
+        if ( is_first ) {
+            if ( ARCHIVE_FILTER_NONE != archive_filter_code(self, 0) ) {
+                err("NotSupported: read:index() requires an uncompressed archive, got %s",
+                    archive_filter_name(self, 0));
+            }
+            if ( ARCHIVE_FORMAT_TAR != (archive_format(self) & ARCHIVE_FORMAT_BASE_MASK) ) {
+                err("NotSupported: read:index() requires a tar archive, got %s",
+                    archive_format_name(self));
+            }
+            is_first = 0;
+#ifndef _WIN32
+            // The raw headers are read to find pax global headers:
+            lua_getfield(L, 3, "source"); // {self}, {entry}, {index}, source
+            if ( lua_isstring(L, -1) ) {
+                int oflags = O_RDONLY;
+#ifdef O_CLOEXEC
+                oflags |= O_CLOEXEC;
+#endif
+                fd = open(lua_tostring(L, -1), oflags);
+            }
+            lua_pop(L, 1); // {self}, {entry}, {index}
+#endif
+        }
+
+        // The header has been consumed, so the position of the
+        // uncompressed stream is where the data begins:
+        header_offset = archive_read_header_position(self);
+        data_offset   = archive_filter_bytes(self, 0);
+#ifndef _WIN32
+        if ( fd >= 0 ) ar_index_find_globals(L, 3, fd, header_offset, data_offset);
+#endif
+
+        pathname = archive_entry_pathname(entry);
+        if ( NULL == pathname ) continue;
+
+        lua_pushstring(L, pathname); // {self}, {entry}, {index}, path
+        ar_index_add(L, 3, header_offset, data_offset, archive_entry_size(entry));
+    }
+#ifndef _WIN32
+    if ( fd >= 0 ) close(fd);
+#endif
+
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns header_offset, data_offset, size for the (last) entry at
+// path, or nil if there is no such entry.
+static int ar_index_lookup(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkstring(L, 2);
+    lua_settop(L, 2);
+
+    lua_getfield(L, 1, "entries"); // {index}, path, {entries}
+    if ( ! lua_istable(L, 3) ) err("InvalidIndex: missing 'entries' table");
+    lua_getfield(L, 1, "paths"); // {index}, path, {entries}, {paths}
+    if ( ! lua_istable(L, 4) ) err("InvalidIndex: missing 'paths' table");
+    lua_pushvalue(L, 2); // {index}, path, {entries}, {paths}, path
+    lua_rawget(L, 4); // {index}, path, {entries}, {paths}, n
+    if ( ! lua_isnumber(L, 5) ) return 0;
+    lua_rawgeti(L, 3, lua_tointeger(L, 5)); // ..., n, {loc}
+    if ( ! lua_istable(L, 6) ) return 0;
+
+    lua_rawgeti(L, 6, 1);
+    lua_rawgeti(L, 6, 2);
+    lua_rawgeti(L, 6, 3);
+    return 3;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the index to a sidecar file:
+//
+//   lua-archive-index 2
+//   source <source_len>:<source>
+//   globals <n> <offset> <length> ...
+//   <header_offset> <data_offset> <size> <pathname_len>:<pathname>
+//   ...
+//
+// The entries are in archive order.  Strings are length prefixed
+// since they may contain anything.
+static int ar_index_save(lua_State *L) {
+    const char* path = luaL_checkstring(L, 2);
+    const char* str;
+    size_t      len, i, count;
+    FILE*       fh;
+    int         failed;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_getfield(L, 1, "entries"); // {index}, path, {entries}
+    if ( ! lua_istable(L, 3) ) err("InvalidIndex: missing 'entries' table");
+    lua_getfield(L, 1, "source"); // {index}, path, {entries}, source
+    lua_getfield(L, 1, "globals"); // {index}, path, {entries}, source, {globals}
+
+    fh = fopen(path, "wb");
+    if ( NULL == fh ) err("fopen: %s: %s", path, strerror(errno));
+
+    str = lua_tolstring(L, 4, &len);
+    if ( NULL == str ) len = 0;
+    fprintf(fh, "%s %d\nsource %lu:", AR_INDEX_MAGIC, AR_INDEX_VERSION, (unsigned long)len);
+    fwrite(str, 1, len, fh);
+    fputc('\n', fh);
+
+    count = lua_istable(L, 5) ? lua_objlen(L, 5) / 2 : 0;
+    fprintf(fh, "globals %lu", (unsigned long)count);
+    for ( i=1; i <= count; i++ ) {
+        lua_rawgeti(L, 5, 2*i - 1);
+        lua_rawgeti(L, 5, 2*i); // ..., {globals}, offset, length
+        fprintf(fh, " %.0f %.0f", lua_tonumber(L, -2), lua_tonumber(L, -1));
+        lua_pop(L, 2); // ..., {globals}
+    }
+    fputc('\n', fh);
+
+    count = lua_objlen(L, 3);
+    for ( i=1; i <= count; i++ ) {
+        lua_rawgeti(L, 3, i); // ..., {loc}
+        if ( lua_istable(L, -1) ) {
+            lua_rawgeti(L, -1, 1);
+            lua_rawgeti(L, -2, 2);
+            lua_rawgeti(L, -3, 3);
+            lua_rawgeti(L, -4, 4); // ..., {loc}, header, data, size, path
+            str = lua_tolstring(L, -1, &len);
+            if ( NULL == str ) len = 0;
+            fprintf(fh, "%.0f %.0f %.0f %lu:",
+                    lua_tonumber(L, -4),
+                    lua_tonumber(L, -3),
+                    lua_tonumber(L, -2),
+                    (unsigned long)len);
+            fwrite(str, 1, len, fh);
+            fputc('\n', fh);
+            lua_pop(L, 4); // ..., {loc}
+        }
+        lua_pop(L, 1); // ...
+    }
+
+    failed = ferror(fh);
+    if ( 0 != fclose(fh) || failed ) err("fwrite: %s: %s", path, strerror(errno));
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read a length prefixed string (as written by ar_index_save) and
+// push it onto the stack.  Returns 0 if the file is malformed.
+static int ar_index_read_string(lua_State *L, FILE* fh, size_t len) {
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    while ( len > 0 ) {
+        size_t want = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+        size_t got  = fread(luaL_prepbuffer(&buf), 1, want, fh);
+        luaL_addsize(&buf, got);
+        if ( got != want ) {
+            luaL_pushresult(&buf);
+            lua_pop(L, 1);
+            return 0;
+        }
+        len -= got;
+    }
+    luaL_pushresult(&buf);
+    if ( '\n' != fgetc(fh) ) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read the globals line of a saved index into the {index} at
+// index_idx.  Returns 0 if the file is malformed.
+static int ar_index_read_globals(lua_State *L, FILE* fh, int index_idx) {
+    double offset, length;
+    unsigned long count, i;
+    if ( 1 != fscanf(fh, "globals %lu", &count) ) return 0;
+    for ( i=0; i < count; i++ ) {
+        if ( 2 != fscanf(fh, "%lf %lf", &offset, &length) ) return 0;
+        ar_index_add_global(L, index_idx, offset, length);
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Load an index saved with index:save(path).  Version 1 files (which
+// have no globals) are still accepted.
+static int ar_index_load(lua_State *L) {
+    const char* path = luaL_checkstring(L, 1);
+    double      header_offset, data_offset, size;
+    unsigned long len;
+    int         version = 0;
+    int         valid = 0;
+    FILE*       fh;
+
+    lua_settop(L, 1);
+    ar_index_new(L); // path, {index}
+
+    fh = fopen(path, "rb");
+    if ( NULL == fh ) err("fopen: %s: %s", path, strerror(errno));
+
+    if ( 1 == fscanf(fh, AR_INDEX_MAGIC " %d\n", &version) &&
+         version >= 1 && version <= AR_INDEX_VERSION &&
+         1 == fscanf(fh, "source %lu:", &len) &&
+         ar_index_read_string(L, fh, len) ) // path, {index}, source
+    {
+        if ( len > 0 ) {
+            lua_setfield(L, 2, "source"); // path, {index}
+        } else {
+            lua_pop(L, 1); // path, {index}
+        }
+        if ( version < 2 || ar_index_read_globals(L, fh, 2) ) {
+            for ( ;; ) {
+                if ( 4 != fscanf(fh, "%lf %lf %lf %lu:",
+                                 &header_offset, &data_offset, &size, &len) )
+                {
+                    valid = feof(fh);
+                    break;
+                }
+                if ( ! ar_index_read_string(L, fh, len) ) break; // path, {index}, name
+                ar_index_add(L, 2, header_offset, data_offset, size); // path, {index}
+            }
+        }
+    }
+    fclose(fh);
+
+    if ( ! valid ) err("InvalidIndex: '%s' is not a valid index file", path);
+
+    lua_settop(L, 2); // path, {index}
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Push the pax global headers that come before header_offset in the
+// source archive as a string, or nil if there are none.  Reading them
+// first means the entry is read with the same global attributes as
+// when the archive is read from the start.
+static void ar_index_push_globals(lua_State *L,
+                                  int index_idx,
+                                  const char* source,
+                                  double header_offset)
+{
+#ifdef _WIN32
+    lua_pushnil(L);
+#else
+    luaL_Buffer buf;
+    size_t i, count;
+    int oflags = O_RDONLY;
+    int fd = -1;
+    int globals_idx;
+
+    lua_getfield(L, index_idx, "globals"); // {globals}
+    globals_idx = lua_gettop(L);
+    count = lua_istable(L, -1) ? lua_objlen(L, -1) / 2 : 0;
+    // The buffer may push onto the stack, so {globals} is only used
+    // by absolute index from here on:
+    luaL_buffinit(L, &buf);
+    for ( i=1; i <= count; i++ ) {
+        double offset, length;
+        lua_rawgeti(L, globals_idx, 2*i - 1);
+        lua_rawgeti(L, globals_idx, 2*i); // ..., offset, length
+        offset = lua_tonumber(L, -2);
+        length = lua_tonumber(L, -1);
+        lua_pop(L, 2); // ...
+        // Those in the entry's own header are read anyway:
+        if ( offset + length > header_offset ) break;
+        if ( fd < 0 ) {
+#ifdef O_CLOEXEC
+            oflags |= O_CLOEXEC;
+#endif
+            fd = open(source, oflags);
+            if ( fd < 0 ) err("open: %s: %s", source, strerror(errno));
+        }
+        while ( length > 0 ) {
+            size_t  want = length < LUAL_BUFFERSIZE ? (size_t)length : LUAL_BUFFERSIZE;
+            ssize_t got  = pread(fd, luaL_prepbuffer(&buf), want, (off_t)offset);
+            if ( got <= 0 ) {
+                close(fd);
+                err("pread: %s: %s", source, got < 0 ? strerror(errno) : "unexpected end of file");
+            }
+            luaL_addsize(&buf, got);
+            offset += got;
+            length -= got;
+        }
+    }
+    if ( fd >= 0 ) close(fd);
+    luaL_pushresult(&buf); // {globals}, str
+    lua_remove(L, globals_idx); // str
+    if ( 0 == lua_objlen(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+// Open the archive the index was built from positioned at the entry
+// for path, returns the archive{read} and the archive{entry} (ready
+// for read:data()), or nil if the index has no such entry.  The source
+// archive path may be given if the index does not have one.
+static int ar_index_open_entry(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkstring(L, 2);
+    lua_settop(L, 3); // {index}, path, source
+
+    if ( lua_isnil(L, 3) ) {
+        lua_getfield(L, 1, "source"); // {index}, path, nil, source
+        lua_replace(L, 3); // {index}, path, source
+    }
+    if ( ! lua_isstring(L, 3) ) {
+        err("MissingArgument: the index has no source, so it must be passed to archive.open_entry()");
+    }
+
+    lua_pushcfunction(L, ar_index_lookup); // {index}, path, source, lookup
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2); // {index}, path, source, lookup, {index}, path
+    lua_call(L, 2, 1); // {index}, path, source, header_offset
+    if ( lua_isnil(L, -1) ) return 1;
+
+    // archive.read { path = source, offset = header_offset, format = "tar",
+    //                prefix = globals }
+    lua_pushcfunction(L, ar_read); // ..., header_offset, ar_read
+    lua_createtable(L, 0, 4); // ..., header_offset, ar_read, {args}
+    lua_pushvalue(L, 3);
+    lua_setfield(L, -2, "path");
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "offset");
+    lua_pushliteral(L, "tar");
+    lua_setfield(L, -2, "format");
+    ar_index_push_globals(L, 1, lua_tostring(L, 3), lua_tonumber(L, 4));
+    lua_setfield(L, -2, "prefix");
+    lua_call(L, 1, 1); // ..., header_offset, {read}
+
+    lua_getfield(L, -1, "next_header"); // ..., {read}, next_header
+    lua_pushvalue(L, -2); // ..., {read}, next_header, {read}
+    lua_call(L, 1, 1); // ..., {read}, {entry}
+    return 2;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: top of the stack contains a table for which we will
+// append our "static" methods.
+//
+// Postcondition: 'load_index' and 'open_entry' methods are registered
+// in the table at the top of the stack, and the archive{index}
+// metatable is registered.
+//////////////////////////////////////////////////////////////////////
+int ar_index_init(lua_State *L) {
+    static luaL_reg fns[] = {
+        { "load_index",  ar_index_load },
+        { "open_entry",  ar_index_open_entry },
+        { NULL, NULL }
+    };
+    static luaL_reg m_fns[] = {
+        { "lookup",      ar_index_lookup },
+        { "save",        ar_index_save },
+        { "open_entry",  ar_index_open_entry },
+        { NULL, NULL }
+    };
+
+    luaL_checktype(L, -1, LUA_TTABLE); // {class}
+
+    luaL_register(L, NULL, fns); // {class}
+
+    luaL_newmetatable(L, AR_INDEX); // {class}, {meta}
+
+    lua_pushvalue(L, -1); // {class}, {meta}, {meta}
+    lua_setfield(L, -2, "__index"); // {class}, {meta}
+
+    luaL_register(L, NULL, m_fns); // {class}, {meta}
+
+    lua_pop(L, 1); // {class}
+
+    return 0;
+}
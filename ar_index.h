@@ -0,0 +1,6 @@
+// This is a private header subject to change.
+
+#define AR_INDEX "archive{index}"
+
+int ar_index_init(lua_State *L);
+int ar_read_index(lua_State *L);
@@ -0,0 +1,432 @@
+//////////////////////////////////////////////////////////////////////
+// Implement the archive{push} object, a push based reader for use in
+// event loops: chunks of the archive are fed in as they arrive and
+// the headers and data they complete are returned as events.
+//
+// libarchive only knows how to pull data, so it runs on a parser
+// thread whose read callback blocks until the next chunk is fed.
+// Control is strictly handed back and forth, so only one of the two
+// threads runs at a time and the parser thread never touches Lua:
+//
+//   feed(chunk) --> parser runs until it needs more input
+//                   (each header or data block it finds parks the
+//                   parser while feed() turns it into a Lua event)
+//
+// Fed chunks are used in place (libarchive copies what it needs to
+// keep before asking for more), so nothing is buffered by us.
+//////////////////////////////////////////////////////////////////////
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "ar_push.h"
+#include "ar_entry.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+#ifndef _WIN32
+
+enum {
+    AR_PUSH_RUNNING,    // the parser thread is running
+    AR_PUSH_NEED_INPUT, // the parser is waiting for feed()
+    AR_PUSH_EVENT,      // the parser is waiting for the event to be consumed
+    AR_PUSH_DONE        // the parser thread has exited
+};
+
+enum {
+    AR_PUSH_HEADER,
+    AR_PUSH_DATA
+};
+
+struct ar_push {
+    struct archive* archive;
+    pthread_t       thread;
+    int             started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             state;
+    int             stop;   // set to make the parser give up
+
+    // Input for the read callback:
+    const char*     input;
+    size_t          input_len;
+    int             eof;
+
+    // The event the parser is waiting on:
+    int             event;
+    struct archive_entry* entry;
+    const void*     data;
+    size_t          data_len;
+    la_int64_t      offset;
+
+    // Set if the parser failed, or if turning its event into Lua
+    // raised (error is NULL if out of memory):
+    int             failed;
+    char*           error;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Parser thread: set the state and wait for the main thread to change
+// it.  Precondition: lock is held.
+static void ar_push_handoff(struct ar_push* self, int state) {
+    self->state = state;
+    pthread_cond_broadcast(&self->cond);
+    while ( state == self->state && ! self->stop ) {
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+static __LA_SSIZE_T ar_push_read_cb(struct archive * ar,
+                                    void *opaque,
+                                    const void **result)
+{
+    struct ar_push* self = (struct ar_push*)opaque;
+    __LA_SSIZE_T len;
+
+    pthread_mutex_lock(&self->lock);
+    while ( NULL == self->input && ! self->eof && ! self->stop ) {
+        ar_push_handoff(self, AR_PUSH_NEED_INPUT);
+    }
+    if ( self->stop ) {
+        pthread_mutex_unlock(&self->lock);
+        archive_set_error(ar, 0, "Cancelled: archive{push} was closed");
+        return -1;
+    }
+    *result = self->input;
+    len = self->input_len;
+    self->input = NULL;
+    self->input_len = 0;
+    pthread_mutex_unlock(&self->lock);
+    return len;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns false if the parser should stop.
+static int ar_push_emit(struct ar_push* self, int event) {
+    int stop;
+    pthread_mutex_lock(&self->lock);
+    self->event = event;
+    ar_push_handoff(self, AR_PUSH_EVENT);
+    stop = self->stop;
+    pthread_mutex_unlock(&self->lock);
+    return ! stop;
+}
+
+//////////////////////////////////////////////////////////////////////
+static void ar_push_fail(struct ar_push* self, const char* fn) {
+    const char* msg = archive_error_string(self->archive);
+    size_t len;
+    if ( NULL == msg ) msg = "unknown error";
+    len = strlen(fn) + strlen(msg) + 3;
+    self->failed = 1;
+    self->error = (char*)malloc(len);
+    if ( NULL != self->error ) snprintf(self->error, len, "%s: %s", fn, msg);
+}
+
+//////////////////////////////////////////////////////////////////////
+static void* ar_push_thread(void* arg) {
+    struct ar_push* self = (struct ar_push*)arg;
+    int result;
+
+    if ( ARCHIVE_OK != archive_read_open(self->archive, self, NULL, &ar_push_read_cb, NULL) ) {
+        ar_push_fail(self, "archive_read_open");
+    } else {
+        for ( ;; ) {
+            result = archive_read_next_header2(self->archive, self->entry);
+            if ( ARCHIVE_EOF == result ) break;
+            if ( result < ARCHIVE_WARN ) {
+                ar_push_fail(self, "archive_read_next_header2");
+                break;
+            }
+            if ( ! ar_push_emit(self, AR_PUSH_HEADER) ) break;
+            for ( ;; ) {
+                result = archive_read_data_block(self->archive,
+                                                 &self->data,
+                                                 &self->data_len,
+                                                 &self->offset);
+                if ( ARCHIVE_EOF == result ) break;
+                if ( result < ARCHIVE_WARN ) {
+                    ar_push_fail(self, "archive_read_data_block");
+                    break;
+                }
+                if ( ! ar_push_emit(self, AR_PUSH_DATA) ) break;
+            }
+            if ( self->failed || self->stop ) break;
+        }
+    }
+
+    pthread_mutex_lock(&self->lock);
+    self->state = AR_PUSH_DONE;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Make the parser thread give up and join it.
+static void ar_push_stop(struct ar_push* self) {
+    if ( ! self->started ) return;
+    pthread_mutex_lock(&self->lock);
+    self->stop = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+    pthread_join(self->thread, NULL);
+    self->started = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Stop and join the parser thread and free everything.
+static void ar_push_free(struct ar_push* self) {
+    ar_push_stop(self);
+    if ( NULL != self->archive ) {
+        archive_read_free(self->archive);
+        self->archive = NULL;
+        pthread_mutex_destroy(&self->lock);
+        pthread_cond_destroy(&self->cond);
+    }
+    if ( NULL != self->entry ) {
+        archive_entry_free(self->entry);
+        self->entry = NULL;
+    }
+    free(self->error);
+    self->error = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Append the event the parser is waiting on to the events table at
+// events_idx.
+static void ar_push_event(lua_State *L, struct ar_push* self, int events_idx) {
+    lua_createtable(L, 0, 3); // {event}
+    if ( AR_PUSH_HEADER == self->event ) {
+        struct archive_entry** entry_ref;
+        lua_pushliteral(L, "header"); // {event}, "header"
+        lua_setfield(L, -2, "type"); // {event}
+        lua_pushcfunction(L, ar_entry); // {event}, ar_entry
+        lua_call(L, 0, 1); // {event}, {entry}
+        entry_ref = ar_entry_check(L, -1);
+        archive_entry_free(*entry_ref);
+        *entry_ref = archive_entry_clone(self->entry);
+        if ( NULL == *entry_ref ) err("OutOfMemory: archive_entry_clone failed");
+        lua_setfield(L, -2, "entry"); // {event}
+    } else {
+        lua_pushliteral(L, "data"); // {event}, "data"
+        lua_setfield(L, -2, "type"); // {event}
+        lua_pushlstring(L, (const char*)self->data, self->data_len); // {event}, data
+        lua_setfield(L, -2, "data"); // {event}
+        lua_pushnumber(L, (double)self->offset); // {event}, offset
+        lua_setfield(L, -2, "offset"); // {event}
+    }
+    lua_rawseti(L, events_idx, lua_objlen(L, events_idx) + 1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Raise the error the parser failed with, if it did.  Every call
+// after a failure raises it again, so it can't be missed.
+static void ar_push_raise(lua_State *L, struct ar_push* self) {
+    if ( ! self->failed ) return;
+    // If ar_push_event() raised the parser is still parked on it:
+    if ( AR_PUSH_DONE != self->state ) ar_push_stop(self);
+    if ( NULL == self->error ) err("OutOfMemory: archive{push} failed");
+    err("%s", self->error);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Let the parser run until it needs more input (or is done), turning
+// everything it finds into events.  Precondition: the input (or eof)
+// has been set.  Returns the events table.
+static int ar_push_run(lua_State *L, struct ar_push* self) {
+    int events_idx;
+    lua_newtable(L); // {events}
+    events_idx = lua_gettop(L);
+
+    pthread_mutex_lock(&self->lock);
+    self->state = AR_PUSH_RUNNING;
+    pthread_cond_broadcast(&self->cond);
+    for ( ;; ) {
+        while ( AR_PUSH_RUNNING == self->state ) {
+            pthread_cond_wait(&self->cond, &self->lock);
+        }
+        if ( AR_PUSH_EVENT != self->state ) break;
+
+        // The parser stays parked while we are in Lua (which might
+        // raise an error, so don't hold the lock).  Until the event is
+        // done we count as failed, so if it raises so do later calls:
+        self->failed = 1;
+        pthread_mutex_unlock(&self->lock);
+        ar_push_event(L, self, events_idx);
+        pthread_mutex_lock(&self->lock);
+        self->failed = 0;
+
+        self->state = AR_PUSH_RUNNING;
+        pthread_cond_broadcast(&self->cond);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    if ( AR_PUSH_DONE == self->state ) {
+        pthread_join(self->thread, NULL);
+        self->started = 0;
+        ar_push_raise(L, self);
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static struct ar_push* ar_push_check(lua_State *L, int narg) {
+    struct ar_push* self = (struct ar_push*)luaL_checkudata(L, narg, AR_PUSH);
+    if ( NULL == self->archive ) err("NULL archive{push}!");
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// events = push:feed(chunk)
+static int ar_push_feed(lua_State *L) {
+    struct ar_push* self = ar_push_check(L, 1);
+    size_t len;
+    const char* chunk = luaL_checklstring(L, 2, &len);
+
+    ar_push_raise(L, self);
+    if ( AR_PUSH_NEED_INPUT != self->state || 0 == len ) {
+        // Input after the end of the archive (such as the padding of
+        // the last block) is ignored, as are empty chunks since an
+        // empty read means EOF to libarchive:
+        lua_newtable(L);
+        return 1;
+    }
+    // The chunk is on the stack, so it outlives the parser's use of it:
+    self->input = chunk;
+    self->input_len = len;
+    return ar_push_run(L, self);
+}
+
+//////////////////////////////////////////////////////////////////////
+// events = push:finish()
+static int ar_push_finish(lua_State *L) {
+    struct ar_push* self = ar_push_check(L, 1);
+
+    ar_push_raise(L, self);
+    if ( AR_PUSH_NEED_INPUT != self->state ) {
+        lua_newtable(L);
+        return 1;
+    }
+    self->eof = 1;
+    ar_push_run(L, self);
+    if ( AR_PUSH_DONE != self->state ) {
+        err("InvalidState: the archive did not end after finish()");
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_push_destroy(lua_State *L) {
+    struct ar_push* self = (struct ar_push*)luaL_checkudata(L, 1, AR_PUSH);
+    ar_push_free(self);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Constructor:
+//
+//   push = archive.reader_push { options = "..." }
+static int ar_push(lua_State *L) {
+    struct ar_push* self;
+
+    lua_settop(L, 1);
+    if ( ! lua_isnil(L, 1) ) luaL_checktype(L, 1, LUA_TTABLE);
+
+    self = (struct ar_push*)lua_newuserdata(L, sizeof(struct ar_push)); // {opts}, {ud}
+    memset(self, 0, sizeof(struct ar_push));
+    luaL_getmetatable(L, AR_PUSH); // {opts}, {ud}, [push]
+    lua_setmetatable(L, -2); // {opts}, {ud}
+
+    self->archive = archive_read_new();
+    if ( NULL == self->archive ) err("OutOfMemory: archive_read_new failed");
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    self->entry = archive_entry_new();
+    if ( NULL == self->entry ) err("OutOfMemory: archive_entry_new failed");
+
+    if ( ARCHIVE_OK != archive_read_support_filter_all(self->archive) ) {
+        err("archive_read_support_filter_all: %s", archive_error_string(self->archive));
+    }
+    if ( ARCHIVE_OK != archive_read_support_format_all(self->archive) ) {
+        err("archive_read_support_format_all: %s", archive_error_string(self->archive));
+    }
+    if ( lua_istable(L, 1) ) {
+        lua_getfield(L, 1, "options");
+        if ( ! lua_isnil(L, -1) &&
+             ARCHIVE_OK != archive_read_set_options(self->archive, lua_tostring(L, -1)) )
+        {
+            err("archive_read_set_options: %s", archive_error_string(self->archive));
+        }
+        lua_pop(L, 1);
+    }
+
+    // Start the parser, it runs until the open needs its first chunk:
+    self->state = AR_PUSH_RUNNING;
+    if ( 0 != pthread_create(&self->thread, NULL, ar_push_thread, self) ) {
+        err("pthread_create: unable to start the parser thread");
+    }
+    self->started = 1;
+    pthread_mutex_lock(&self->lock);
+    while ( AR_PUSH_RUNNING == self->state ) {
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return 1;
+}
+
+#else
+
+//////////////////////////////////////////////////////////////////////
+static int ar_push(lua_State *L) {
+    return err("NotSupported: archive.reader_push() is not supported on this platform");
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: top of the stack contains a table for which we will
+// append our "static" methods.
+//
+// Postcondition: 'reader_push' method is registered in the table at
+// the top of the stack, and the archive{push} metatable is
+// registered.
+//////////////////////////////////////////////////////////////////////
+int ar_push_init(lua_State *L) {
+    static luaL_reg fns[] = {
+        { "reader_push", ar_push },
+        { NULL, NULL }
+    };
+#ifndef _WIN32
+    static luaL_reg m_fns[] = {
+        { "feed",    ar_push_feed },
+        { "finish",  ar_push_finish },
+        { "close",   ar_push_destroy },
+        { "__gc",    ar_push_destroy },
+        { NULL, NULL }
+    };
+#endif
+
+    luaL_checktype(L, -1, LUA_TTABLE); // {class}
+    luaL_register(L, NULL, fns); // {class}
+
+#ifndef _WIN32
+    luaL_newmetatable(L, AR_PUSH); // {class}, {meta}
+    lua_pushvalue(L, -1); // {class}, {meta}, {meta}
+    lua_setfield(L, -2, "__index"); // {class}, {meta}
+    luaL_register(L, NULL, m_fns); // {class}, {meta}
+    lua_pop(L, 1); // {class}
+#endif
+    return 0;
+}
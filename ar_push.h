@@ -0,0 +1,5 @@
+// This is a private header subject to change.
+
+#define AR_PUSH "archive{push}"
+
+int ar_push_init(lua_State *L);
@@ -5,21 +5,52 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <ctype.h>
+#include <errno.h>
 #include <lauxlib.h>
 #include <lua.h>
+#include <lualib.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "ar_read.h"
+#include "ar_buffer.h"
 #include "ar_entry.h"
+#include "ar_extract.h"
+#include "ar_filter.h"
+#include "ar_index.h"
 #include "ar_registry.h"
+#include "ar_util.h"
 
 #define err(...) (luaL_error(L, __VA_ARGS__))
 #define rel_idx(relative, idx) ((idx) < 0 ? (idx) + (relative) : (idx))
 
+// Private type used to hold a memory mapped archive file:
+#define AR_MMAP "archive{mmap}"
+
+struct ar_mmap {
+    void*  addr;
+    size_t len;
+};
+
 static __LA_SSIZE_T ar_read_cb(struct archive * ar,
                                void *opaque,
                                const void **buff);
+static la_int64_t ar_read_skip_cb(struct archive * ar,
+                                  void *opaque,
+                                  la_int64_t request);
+static la_int64_t ar_read_seek_cb(struct archive * ar,
+                                  void *opaque,
+                                  la_int64_t offset,
+                                  int whence);
+
+static int ar_read_open(lua_State *L, int self_idx);
 
 static int __ref_count = 0;
 
@@ -48,6 +79,7 @@ static int call_setters(lua_State *L,
     size_t name_len=0;
     for ( ; '\0' != *name; name += name_len ) {
         int idx = 0;
+        name_len = 0;
         while ( '\0' != *name && ! isalnum(*name) ) name++;
         while ( isalnum(*(name+name_len)) ) name_len++;
         if ( ! *name ) continue;
@@ -56,7 +88,8 @@ static int call_setters(lua_State *L,
                 lua_pushlstring(L, name, name_len);
                 err("%s*: No such format '%s'", func_prefix, lua_tostring(L, -1));
             }
-            if ( strncmp(name, names[idx].name, name_len) == 0 ) break;
+            if ( strlen(names[idx].name) == name_len &&
+                 strncmp(name, names[idx].name, name_len) == 0 ) break;
         }
         setters_called++;
         if ( ARCHIVE_OK != (names[idx].setter)(self) ) {
@@ -69,7 +102,7 @@ static int call_setters(lua_State *L,
 
 //////////////////////////////////////////////////////////////////////
 // Constructor:
-static int ar_read(lua_State *L) {
+int ar_read(lua_State *L) {
     struct archive** self_ref;
     static named_setter format_names[] = {
         /* Copied from archive.h */
@@ -84,22 +117,36 @@ static int ar_read(lua_State *L) {
         { "zip",       archive_read_support_format_zip },
         { NULL,        NULL }
     };
-    static named_setter compression_names[] = {
-        { "all",      archive_read_support_compression_all },
-        { "bzip2",    archive_read_support_compression_bzip2 },
-        { "compress", archive_read_support_compression_compress },
-        { "gzip",     archive_read_support_compression_gzip },
-        { "lzma",     archive_read_support_compression_lzma },
-        { "none",     archive_read_support_compression_none },
-        { "xz",       archive_read_support_compression_xz },
+    static named_setter filter_names[] = {
+        { "all",      archive_read_support_filter_all },
+        { "bzip2",    archive_read_support_filter_bzip2 },
+        { "compress", archive_read_support_filter_compress },
+        { "gzip",     archive_read_support_filter_gzip },
+        { "lzip",     archive_read_support_filter_lzip },
+        { "lzma",     archive_read_support_filter_lzma },
+        { "none",     archive_read_support_filter_none },
+        { "rpm",      archive_read_support_filter_rpm },
+        { "uu",       archive_read_support_filter_uu },
+        { "xz",       archive_read_support_filter_xz },
+#if ARCHIVE_VERSION_NUMBER >= 3001000
+        { "grzip",    archive_read_support_filter_grzip },
+        { "lrzip",    archive_read_support_filter_lrzip },
+        { "lzop",     archive_read_support_filter_lzop },
+#endif
+#if ARCHIVE_VERSION_NUMBER >= 3002000
+        { "lz4",      archive_read_support_filter_lz4 },
+#endif
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+        { "zstd",     archive_read_support_filter_zstd },
+#endif
         { NULL,       NULL }
     };
 
     luaL_checktype(L, 1, LUA_TTABLE);
 
     self_ref = (struct archive**)
-        lua_newuserdata(L, sizeof(struct archive*)); // {ud}
-    *self_ref = NULL;
+        lua_newuserdata(L, sizeof(struct ar_read)); // {ud}
+    memset(self_ref, 0, sizeof(struct ar_read));
     luaL_getmetatable(L, AR_READ); // {ud}, [read]
     lua_setmetatable(L, -2); // {ud}
     __ref_count++;
@@ -109,20 +156,49 @@ static int ar_read(lua_State *L) {
     ar_registry_set(L, *self_ref);
 
     // Create an environment to store a reference to the callbacks:
-    lua_createtable(L, 1, 0); // {ud}, {fenv}
+    lua_createtable(L, 2, 0); // {ud}, {fenv}
     lua_getfield(L, 1, "reader"); // {ud}, {fenv}, fn
-    if ( ! lua_isfunction(L, -1) ) err("MissingArgument: required parameter 'reader' must be a function");
+    if ( ! lua_isnil(L, -1) && ! lua_isfunction(L, -1) ) {
+        err("InvalidArgument: 'reader' must be a function");
+    }
     lua_setfield(L, -2, "reader"); // {ud}, {fenv}
+
+    lua_getfield(L, 1, "skipper"); // {ud}, {fenv}, fn
+    if ( ! lua_isnil(L, -1) && ! lua_isfunction(L, -1) ) {
+        err("InvalidArgument: 'skipper' must be a function");
+    }
+    lua_setfield(L, -2, "skipper"); // {ud}, {fenv}
+
+    lua_getfield(L, 1, "seeker"); // {ud}, {fenv}, fn
+    if ( ! lua_isnil(L, -1) && ! lua_isfunction(L, -1) ) {
+        err("InvalidArgument: 'seeker' must be a function");
+    }
+    lua_setfield(L, -2, "seeker"); // {ud}, {fenv}
+
+    // Keep the io handle alive for as long as we are reading from it:
+    lua_getfield(L, 1, "file"); // {ud}, {fenv}, file
+    lua_setfield(L, -2, "file"); // {ud}, {fenv}
+
+    // Keep the string (or archive{buffer}) read by data= alive:
+    lua_getfield(L, 1, "data"); // {ud}, {fenv}, data
+    lua_setfield(L, -2, "data"); // {ud}, {fenv}
+
+    // Keep the prefix read before an offset alive:
+    lua_getfield(L, 1, "prefix"); // {ud}, {fenv}, prefix
+    lua_setfield(L, -2, "prefix"); // {ud}, {fenv}
+
+    // Remember where we are reading from (used by read:index()):
+    lua_getfield(L, 1, "path"); // {ud}, {fenv}, path
+    lua_setfield(L, -2, "path"); // {ud}, {fenv}
     lua_setfenv(L, -2); // {ud}
 
     // Do it the easy way for now... perhaps in the future we will
     // have a parameter to support toggling which algorithms are
-    // supported:
-    if ( ARCHIVE_OK != archive_read_support_compression_all(*self_ref) ) {
-        err("archive_read_support_compression_all: %s", archive_error_string(*self_ref));
-    }
-    if ( ARCHIVE_OK != archive_read_support_format_all(*self_ref) ) {
-        err("archive_read_support_format_all: %s", archive_error_string(*self_ref));
+    // supported.  The formats are enabled by the 'format' option
+    // below (which defaults to "all"), registering a format twice
+    // crashes newer versions of libarchive:
+    if ( ARCHIVE_OK != archive_read_support_filter_all(*self_ref) ) {
+        err("archive_read_support_filter_all: %s", archive_error_string(*self_ref));
     }
 
 
@@ -145,6 +221,26 @@ static int ar_read(lua_State *L) {
     }
     lua_pop(L, 1);
 
+    // The filters may be given as a table of names, or a string like
+    // compression="gzip,xz":
+    lua_getfield(L, 1, "filters");
+    if ( lua_istable(L, -1) ) {
+        size_t i, len = lua_objlen(L, -1);
+        for ( i=1; i <= len; i++ ) {
+            lua_rawgeti(L, -1, i);
+            if ( NULL == lua_tostring(L, -1) ) err("InvalidArgument: filter name must be a string");
+            call_setters(L,
+                         *self_ref,
+                         "archive_read_support_filter_",
+                         filter_names,
+                         lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    } else if ( ! lua_isnil(L, -1) ) {
+        err("InvalidArgument: 'filters' must be a table");
+    }
+    lua_pop(L, 1);
+
     lua_getfield(L, 1, "compression");
     if ( NULL == lua_tostring(L, -1) ) {
         lua_pop(L, 1);
@@ -152,8 +248,8 @@ static int ar_read(lua_State *L) {
     }
     call_setters(L, 
                  *self_ref,
-                 "archive_read_support_compression_",
-                 compression_names,
+                 "archive_read_support_filter_",
+                 filter_names,
                  lua_tostring(L, -1));
     lua_pop(L, 1);
 
@@ -166,13 +262,387 @@ static int ar_read(lua_State *L) {
     lua_pop(L, 1);
 
 
-    if ( ARCHIVE_OK != archive_read_open(*self_ref, L, NULL, &ar_read_cb, NULL) ) {
-        err("archive_read_open: %s", archive_error_string(*self_ref));
-    }
+    ar_read_open(L, lua_gettop(L));
 
     return 1;
 }
 
+//////////////////////////////////////////////////////////////////////
+static void ar_mmap_release(struct ar_mmap* self) {
+#ifndef _WIN32
+    if ( NULL != self->addr ) {
+        munmap(self->addr, self->len);
+    }
+#endif
+    self->addr = NULL;
+    self->len  = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_mmap_destroy(lua_State *L) {
+    ar_mmap_release((struct ar_mmap*)luaL_checkudata(L, 1, AR_MMAP));
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Map the file at path into memory and hand the mapping to libarchive
+// so the archive is read with zero copies.  The mapping is stored in
+// the fenv of the archive{read} at self_idx so that it stays alive
+// until ar_read_destroy() releases it.
+static void ar_read_open_mmap(lua_State *L, int self_idx, const char* path) {
+    struct archive* self = *(struct archive**)lua_touserdata(L, self_idx);
+    struct ar_mmap* map;
+#ifndef _WIN32
+    struct stat     sb;
+    int             oflags = O_RDONLY;
+    int             fd;
+#endif
+
+    map = (struct ar_mmap*)lua_newuserdata(L, sizeof(struct ar_mmap)); // {map}
+    map->addr = NULL;
+    map->len  = 0;
+    luaL_getmetatable(L, AR_MMAP); // {map}, {meta}
+    lua_setmetatable(L, -2); // {map}
+    lua_getfenv(L, self_idx); // {map}, {fenv}
+    lua_insert(L, -2); // {fenv}, {map}
+    lua_setfield(L, -2, "mmap"); // {fenv}
+    lua_pop(L, 1); // <nothing>
+
+#ifdef _WIN32
+    err("NotSupported: 'mmap' is not supported on this platform");
+#else
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    fd = open(path, oflags);
+    if ( -1 == fd ) {
+        err("open: %s: %s", path, strerror(errno));
+    }
+    if ( -1 == fstat(fd, &sb) ) {
+        close(fd);
+        err("fstat: %s: %s", path, strerror(errno));
+    }
+    if ( sb.st_size > 0 ) {
+        void* addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( MAP_FAILED == addr ) {
+            close(fd);
+            err("mmap: %s: %s", path, strerror(errno));
+        }
+        map->addr = addr;
+        map->len  = sb.st_size;
+        madvise(map->addr, map->len, MADV_SEQUENTIAL);
+        madvise(map->addr, map->len, MADV_WILLNEED);
+    }
+    // The mapping stays valid after the descriptor is closed:
+    close(fd);
+#endif
+
+    if ( ARCHIVE_OK != archive_read_open_memory(self,
+                                                NULL == map->addr ? "" : map->addr,
+                                                map->len) )
+    {
+        err("archive_read_open_memory: %s", archive_error_string(self));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// A native file source that starts reading at an arbitrary offset of
+// the file, libarchive's own file sources always start at the current
+// position (which we can't set for open_filename).  Freed by the close
+// callback.
+#ifndef _WIN32
+struct ar_file_source {
+    int    fd;
+    off_t  start;
+    size_t block_size;
+
+    // Read before the file (kept alive in the fenv as "prefix"):
+    const char* prefix;
+    size_t      prefix_len;
+
+    char   buffer[1];
+};
+
+static __LA_SSIZE_T ar_file_source_read(struct archive * self,
+                                        void *opaque,
+                                        const void **result)
+{
+    struct ar_file_source* src = (struct ar_file_source*)opaque;
+    ssize_t len;
+    if ( src->prefix_len > 0 ) {
+        *result = src->prefix;
+        len = src->prefix_len;
+        src->prefix_len = 0;
+        return len;
+    }
+    *result = src->buffer;
+    do {
+        len = read(src->fd, src->buffer, src->block_size);
+    } while ( len < 0 && EINTR == errno );
+    if ( len < 0 ) {
+        archive_set_error(self, errno, "read: %s", strerror(errno));
+        return -1;
+    }
+    return len;
+}
+
+static la_int64_t ar_file_source_skip(struct archive * self,
+                                      void *opaque,
+                                      la_int64_t request)
+{
+    struct ar_file_source* src = (struct ar_file_source*)opaque;
+    off_t old_pos = lseek(src->fd, 0, SEEK_CUR);
+    off_t new_pos;
+    (void)self;
+    if ( src->prefix_len > 0 ) return 0;
+    if ( -1 == old_pos ) return 0;
+    new_pos = lseek(src->fd, request, SEEK_CUR);
+    if ( -1 == new_pos ) return 0;
+    return new_pos - old_pos;
+}
+
+static la_int64_t ar_file_source_seek(struct archive * self,
+                                      void *opaque,
+                                      la_int64_t offset,
+                                      int whence)
+{
+    struct ar_file_source* src = (struct ar_file_source*)opaque;
+    off_t pos;
+    // Positions are relative to where the archive starts:
+    if ( SEEK_SET == whence ) offset += src->start;
+    pos = lseek(src->fd, offset, whence);
+    if ( -1 == pos ) {
+        archive_set_error(self, errno, "lseek: %s", strerror(errno));
+        return ARCHIVE_FATAL;
+    }
+    return pos - src->start;
+}
+
+static int ar_file_source_close(struct archive * self, void *opaque) {
+    struct ar_file_source* src = (struct ar_file_source*)opaque;
+    (void)self;
+    close(src->fd);
+    free(src);
+    return ARCHIVE_OK;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////
+static void ar_read_open_file_at(lua_State *L,
+                                 struct archive* self,
+                                 const char* path,
+                                 off_t offset,
+                                 const char* prefix,
+                                 size_t prefix_len,
+                                 size_t block_size)
+{
+#ifdef _WIN32
+    err("NotSupported: 'offset' is not supported on this platform");
+#else
+    struct ar_file_source* src;
+    int oflags = O_RDONLY;
+    int fd;
+
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    fd = open(path, oflags);
+
+    if ( -1 == fd ) {
+        err("open: %s: %s", path, strerror(errno));
+    }
+    if ( offset != lseek(fd, offset, SEEK_SET) ) {
+        close(fd);
+        err("lseek: %s: %s", path, strerror(errno));
+    }
+    src = (struct ar_file_source*)malloc(sizeof(struct ar_file_source) + block_size);
+    if ( NULL == src ) {
+        close(fd);
+        err("OutOfMemory: unable to allocate a %d byte read buffer", (int)block_size);
+    }
+    src->fd         = fd;
+    src->start      = offset;
+    src->block_size = block_size;
+    src->prefix     = prefix;
+    src->prefix_len = NULL == prefix ? 0 : prefix_len;
+
+    archive_read_set_read_callback(self, &ar_file_source_read);
+    archive_read_set_skip_callback(self, &ar_file_source_skip);
+    // Positions don't map onto the file once a prefix is read:
+    if ( 0 == src->prefix_len ) archive_read_set_seek_callback(self, &ar_file_source_seek);
+    archive_read_set_close_callback(self, &ar_file_source_close);
+    archive_read_set_callback_data(self, src);
+
+    // The close callback frees src (even if this fails):
+    if ( ARCHIVE_OK != archive_read_open1(self) ) {
+        err("archive_read_open1: %s", archive_error_string(self));
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{read} is at self_idx.
+//
+// Postcondition: the mapping created by ar_read_open_mmap() (if any)
+// is unmapped.
+static void ar_read_release_mmap(lua_State *L, int self_idx) {
+    lua_getfenv(L, self_idx); // {fenv}
+    lua_getfield(L, -1, "mmap"); // {fenv}, {map}
+    if ( ! lua_isnil(L, -1) ) {
+        ar_mmap_release((struct ar_mmap*)luaL_checkudata(L, -1, AR_MMAP));
+    }
+    lua_pop(L, 2); // <nothing>
+}
+
+//////////////////////////////////////////////////////////////////////
+// Unpin the archive{buffer} read by data= (if any).
+static void ar_read_release_data(struct ar_read* self) {
+    if ( NULL == self->data_buffer ) return;
+    self->data_buffer->borrowed--;
+    self->data_buffer = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Open the archive from whichever source was given in the constructor
+// table (which must be at index 1).  The native path, fd and file
+// sources are read by libarchive directly without ever calling back
+// into Lua.
+static int ar_read_open(lua_State *L, int self_idx) {
+    struct archive* self = *(struct archive**)lua_touserdata(L, self_idx);
+    struct ar_read* self_ref;
+    size_t block_size = 10240;
+    int    result;
+
+    lua_getfield(L, 1, "block_size");
+    if ( ! lua_isnil(L, -1) ) {
+        if ( lua_tointeger(L, -1) <= 0 ) {
+            err("InvalidArgument: 'block_size' must be a positive number");
+        }
+        block_size = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "path");
+    if ( ! lua_isnil(L, -1) ) {
+        const char* path = lua_tostring(L, -1);
+        if ( NULL == path ) err("InvalidArgument: 'path' must be a string");
+        lua_getfield(L, 1, "mmap");
+        result = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "offset");
+        if ( lua_isnil(L, -1) ) {
+            if ( result ) {
+                ar_read_open_mmap(L, self_idx, path);
+            } else if ( ARCHIVE_OK != archive_read_open_filename(self, path, block_size) ) {
+                err("archive_read_open_filename: %s", archive_error_string(self));
+            }
+        } else {
+            const char* prefix;
+            size_t prefix_len = 0;
+            if ( result ) err("InvalidArgument: 'offset' can not be used with 'mmap'");
+            lua_getfield(L, 1, "prefix"); // path, offset, prefix
+            prefix = lua_tolstring(L, -1, &prefix_len);
+            if ( NULL == prefix && ! lua_isnil(L, -1) ) {
+                err("InvalidArgument: 'prefix' must be a string");
+            }
+            lua_pop(L, 1); // path, offset
+            ar_read_open_file_at(L, self, path, (off_t)lua_tonumber(L, -1),
+                                 prefix, prefix_len, block_size);
+        }
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    // Read straight out of the string, it is kept in the fenv:
+    lua_getfield(L, 1, "data");
+    if ( ! lua_isnil(L, -1) ) {
+        size_t len;
+        const char* data;
+        if ( LUA_TNUMBER == lua_type(L, -1) ||
+             NULL == (data = ar_buffer_tolstring(L, -1, &len)) )
+        {
+            err("InvalidArgument: 'data' must be a string or archive{buffer}");
+        }
+        // Changing a buffer would free the memory libarchive reads:
+        self_ref = (struct ar_read*)lua_touserdata(L, self_idx);
+        self_ref->data_buffer = ar_buffer_test(L, -1);
+        if ( NULL != self_ref->data_buffer ) self_ref->data_buffer->borrowed++;
+        if ( ARCHIVE_OK != archive_read_open_memory(self, (void*)data, len) ) {
+            err("archive_read_open_memory: %s", archive_error_string(self));
+        }
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "fd");
+    if ( ! lua_isnil(L, -1) ) {
+        if ( ! lua_isnumber(L, -1) ) err("InvalidArgument: 'fd' must be a number");
+        if ( ARCHIVE_OK != archive_read_open_fd(self, lua_tointeger(L, -1), block_size) ) {
+            err("archive_read_open_fd: %s", archive_error_string(self));
+        }
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "file");
+    if ( ! lua_isnil(L, -1) ) {
+        FILE** file = (FILE**)luaL_checkudata(L, -1, LUA_FILEHANDLE);
+        if ( NULL == *file ) err("InvalidArgument: 'file' is a closed file handle");
+        if ( ARCHIVE_OK != archive_read_open_FILE(self, *file) ) {
+            err("archive_read_open_FILE: %s", archive_error_string(self));
+        }
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "reader");
+    result = lua_isfunction(L, -1);
+    lua_pop(L, 1);
+    if ( ! result ) {
+        err("MissingArgument: required parameter 'reader' must be a function"
+            " (or specify one of 'path', 'fd', 'file' or 'data')");
+    }
+
+    // Create the ring of buffers that are passed to the reader:
+    lua_getfield(L, 1, "reader_buffers");
+    if ( ! lua_isnil(L, -1) ) {
+        int count = lua_tointeger(L, -1);
+        int idx;
+        if ( count <= 0 ) err("InvalidArgument: 'reader_buffers' must be a positive number");
+        lua_getfenv(L, self_idx); // n, {fenv}
+        lua_createtable(L, count, 0); // n, {fenv}, {ring}
+        for ( idx=1; idx <= count; idx++ ) {
+            lua_pushcfunction(L, ar_buffer); // n, {fenv}, {ring}, ar_buffer
+            lua_pushinteger(L, block_size); // n, {fenv}, {ring}, ar_buffer, size
+            lua_call(L, 1, 1); // n, {fenv}, {ring}, {buf}
+            lua_rawseti(L, -2, idx); // n, {fenv}, {ring}
+        }
+        lua_setfield(L, -2, "reader_buffers"); // n, {fenv}
+        lua_pop(L, 1); // n
+    }
+    lua_pop(L, 1);
+
+    archive_read_set_read_callback(self, &ar_read_cb);
+    archive_read_set_callback_data(self, L);
+
+    lua_getfield(L, 1, "skipper");
+    if ( ! lua_isnil(L, -1) ) archive_read_set_skip_callback(self, &ar_read_skip_cb);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "seeker");
+    if ( ! lua_isnil(L, -1) ) archive_read_set_seek_callback(self, &ar_read_seek_cb);
+    lua_pop(L, 1);
+
+    if ( ARCHIVE_OK != archive_read_open1(self) ) {
+        err("archive_read_open1: %s", archive_error_string(self));
+    }
+    return 0;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Precondition: archive{read} is at the top of the stack, and idx is
 // the index to the argument for which to pass to reader exists.  If
@@ -185,9 +655,22 @@ static void ar_read_get_reader(lua_State *L, int self_idx) {
     lua_pop(L, 1);                  // reader
 }
 
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{read} is at self_idx.
+//
+// Postcondition: the callback stored in the fenv under name is at the
+// top of the stack.
+static void ar_read_get_callback(lua_State *L, int self_idx, const char* name) {
+    lua_getfenv(L, self_idx);        // {env}
+    lua_pushstring(L, name);         // {env}, name
+    lua_rawget(L, -2);               // {env}, fn
+    lua_remove(L, -2);               // fn
+}
+
 //////////////////////////////////////////////////////////////////////
 static int ar_read_destroy(lua_State *L) {
-    struct archive** self_ref = ar_read_check(L, 1);
+    struct archive** self_ref = &ar_read_check(L, 1)->archive;
+    int result;
     if ( NULL == *self_ref ) return 0;
 
     // If called in destructor, we were already removed from the weak
@@ -195,11 +678,15 @@ static int ar_read_destroy(lua_State *L) {
     // will work.
     ar_registry_set(L, *self_ref);
 
-    if ( ARCHIVE_OK != archive_read_close(*self_ref) ) {
+    result = archive_read_close(*self_ref);
+    // Nothing reads the data= buffer once closed:
+    ar_read_release_data((struct ar_read*)self_ref);
+    if ( ARCHIVE_OK != result ) {
         lua_pushfstring(L, "archive_read_close: %s", archive_error_string(*self_ref));
         archive_read_finish(*self_ref);
         __ref_count--;
         *self_ref = NULL;
+        ar_read_release_mmap(L, 1);
         lua_error(L);
     }
 
@@ -215,6 +702,7 @@ static int ar_read_destroy(lua_State *L) {
     }
     __ref_count--;
     *self_ref = NULL;
+    ar_read_release_mmap(L, 1);
 
     return 0;
 }
@@ -225,7 +713,9 @@ static __LA_SSIZE_T ar_read_cb(struct archive * self,
                                const void **result)
 {
     lua_State* L = (lua_State*)opaque;
+    struct ar_buffer* buf = NULL;
     size_t result_len;
+    int nargs;
     *result = NULL;
 
     // We are missing!?
@@ -238,13 +728,46 @@ static __LA_SSIZE_T ar_read_cb(struct archive * self,
     ar_read_get_reader(L, -1); // {ud}, reader
     lua_pushvalue(L, -2); // {ud}, reader, {ud}
 
-    if ( 0 != lua_pcall(L, 1, 1, 0) ) { // {ud}, "err"
+    // Pass the next buffer in the ring (if any) to the reader:
+    lua_getfenv(L, -1); // {ud}, reader, {ud}, {fenv}
+    lua_pushliteral(L, "reader_buffers"); // {ud}, reader, {ud}, {fenv}, "reader_buffers"
+    lua_rawget(L, -2); // {ud}, reader, {ud}, {fenv}, {ring}
+    lua_remove(L, -2); // {ud}, reader, {ud}, {ring}
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1); // {ud}, reader, {ud}
+        nargs = 1;
+    } else {
+        struct ar_read* self_ref = (struct ar_read*)lua_touserdata(L, -4);
+        self_ref->reader_buffer_idx =
+            self_ref->reader_buffer_idx % lua_objlen(L, -1) + 1;
+        lua_rawgeti(L, -1, self_ref->reader_buffer_idx); // {ud}, reader, {ud}, {ring}, {buf}
+        lua_remove(L, -2); // {ud}, reader, {ud}, {buf}
+        buf = (struct ar_buffer*)lua_touserdata(L, -1);
+        buf->len = 0;
+        nargs = 2;
+    }
+
+    if ( 0 != lua_pcall(L, nargs, 1, 0) ) { // {ud}, "err"
         archive_set_error(self, 0, "%s", lua_tostring(L, -1));
         lua_pop(L, 2); // <nothing>
         return -1;
     }
 
-    *result = lua_tolstring(L, -1, &result_len); // {ud}, result
+    if ( NULL != buf && LUA_TNUMBER == lua_type(L, -1) ) {
+        // The reader filled in the buffer we passed it:
+        result_len = lua_tointeger(L, -1);
+        lua_pop(L, 2); // <nothing>
+        if ( result_len > buf->len ) {
+            archive_set_error(self, 0,
+                              "InvalidResult: reader returned %d, but only %d bytes are in the buffer",
+                              (int)result_len, (int)buf->len);
+            return -1;
+        }
+        *result = buf->data;
+        return result_len;
+    }
+
+    *result = ar_buffer_tolstring(L, -1, &result_len); // {ud}, result
 
     // We directly return the raw internal buffer, so we need to keep
     // a reference around:
@@ -259,56 +782,585 @@ static __LA_SSIZE_T ar_read_cb(struct archive * self,
 }
 
 //////////////////////////////////////////////////////////////////////
-static int ar_read_next_header(lua_State *L) {
+static la_int64_t ar_read_skip_cb(struct archive * self,
+                                  void *opaque,
+                                  la_int64_t request)
+{
+    lua_State* L = (lua_State*)opaque;
+    la_int64_t result;
+
+    // We are missing!?
+    if ( ! ar_registry_get(L, self) ) {
+        archive_set_error(self, 0,
+                          "InternalError: skip callback called on archive that should already have been garbage collected!");
+        return -1;
+    }
+
+    ar_read_get_callback(L, -1, "skipper"); // {ud}, skipper
+    lua_pushvalue(L, -2); // {ud}, skipper, {ud}
+    lua_pushnumber(L, request); // {ud}, skipper, {ud}, request
+
+    if ( 0 != lua_pcall(L, 2, 1, 0) ) { // {ud}, "err"
+        archive_set_error(self, 0, "%s", lua_tostring(L, -1));
+        lua_pop(L, 2); // <nothing>
+        return -1;
+    }
+    result = (la_int64_t)lua_tonumber(L, -1); // {ud}, result
+    lua_pop(L, 2); // <nothing>
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+static la_int64_t ar_read_seek_cb(struct archive * self,
+                                  void *opaque,
+                                  la_int64_t offset,
+                                  int whence)
+{
+    lua_State* L = (lua_State*)opaque;
+    la_int64_t result;
+
+    // We are missing!?
+    if ( ! ar_registry_get(L, self) ) {
+        archive_set_error(self, 0,
+                          "InternalError: seek callback called on archive that should already have been garbage collected!");
+        return ARCHIVE_FATAL;
+    }
+
+    ar_read_get_callback(L, -1, "seeker"); // {ud}, seeker
+    lua_pushvalue(L, -2); // {ud}, seeker, {ud}
+    lua_pushnumber(L, offset); // {ud}, seeker, {ud}, offset
+    // Use the same names as the Lua file:seek() method:
+    switch ( whence ) {
+    case SEEK_SET: lua_pushliteral(L, "set"); break;
+    case SEEK_CUR: lua_pushliteral(L, "cur"); break;
+    default:       lua_pushliteral(L, "end"); break;
+    } // {ud}, seeker, {ud}, offset, whence
+
+    if ( 0 != lua_pcall(L, 3, 1, 0) ) { // {ud}, "err"
+        archive_set_error(self, 0, "%s", lua_tostring(L, -1));
+        lua_pop(L, 2); // <nothing>
+        return ARCHIVE_FATAL;
+    }
+    if ( ! lua_isnumber(L, -1) ) {
+        lua_pop(L, 2); // <nothing>
+        archive_set_error(self, 0, "InvalidResult: seeker must return the new position");
+        return ARCHIVE_FATAL;
+    }
+    result = (la_int64_t)lua_tonumber(L, -1); // {ud}, result
+    lua_pop(L, 2); // <nothing>
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read the next header whose pathname passes filter (which may be
+// NULL), recycling the entry at index 2 if one was given.  Rejected
+// headers reuse the same archive_entry so they never reach Lua.
+static int ar_read_next_header_with(lua_State *L, struct ar_filter* filter) {
+    struct ar_read* self_ref;
     struct archive_entry* entry;
-    struct archive* self = *ar_read_check(L, 1); // {ud}
+    struct archive* self = ar_read_check(L, 1)->archive; // {ud}
     int result;
     if ( NULL == self ) err("NULL archive{read}!");
 
-    lua_pushcfunction(L, ar_entry); // {ud}, ar_entry
-    lua_call(L, 0, 1); // {ud}, header
-
-    entry = *ar_entry_check(L, -1);
-    result = archive_read_next_header2(self, entry);
-    if ( ARCHIVE_EOF == result ) {
-        lua_pop(L, 1); // {ud}
-        lua_pushnil(L); // {ud}, nil
-    } else if ( ARCHIVE_OK != result ) {
-        err("archive_read_next_header2: %s", archive_error_string(self));
+    if ( lua_isnoneornil(L, 2) ) {
+        lua_settop(L, 1); // {ud}
+        lua_pushcfunction(L, ar_entry); // {ud}, ar_entry
+        lua_call(L, 0, 1); // {ud}, header
+        entry = *ar_entry_check(L, -1);
+    } else {
+        // Recycle the entry we were given:
+        lua_settop(L, 2); // {ud}, header
+        entry = *ar_entry_check(L, 2);
+        if ( NULL == entry ) err("NULL archive{entry}!");
+        archive_entry_clear(entry);
     }
+    self_ref = ar_read_check(L, 1);
+    self_ref->pending_len = 0;
+    for ( ;; ) {
+        result = archive_read_next_header2(self, entry);
+        if ( ARCHIVE_EOF == result ) {
+            lua_pop(L, 1); // {ud}
+            lua_pushnil(L); // {ud}, nil
+            break;
+        } else if ( ARCHIVE_OK != result ) {
+            err("archive_read_next_header2: %s", archive_error_string(self));
+        }
+        if ( ar_filter_match(filter, archive_entry_pathname(entry)) ) break;
+        archive_entry_clear(entry);
+    }
+    self_ref->data_offset = 0;
+    self_ref->data_size = ( ARCHIVE_EOF != result && archive_entry_size_is_set(entry) ) ?
+        archive_entry_size(entry) : -1;
     return 1;
 }
 
+//////////////////////////////////////////////////////////////////////
+static int ar_read_next_header(lua_State *L) {
+    return ar_read_next_header_with(L, NULL);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Iterator used by read:headers().  The generic for passes the last
+// entry back in, which we must ignore so a new entry is created.
+static int ar_read_next_header_iter(lua_State *L) {
+    lua_settop(L, 1);
+    return ar_read_next_header(L);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Iterator used by read:headers() when filtering.  Upvalues are the
+// archive{filter} and the reuse flag.
+static int ar_read_next_header_filter_iter(lua_State *L) {
+    struct ar_filter* filter = (struct ar_filter*)
+        luaL_checkudata(L, lua_upvalueindex(1), AR_FILTER);
+    lua_settop(L, lua_toboolean(L, lua_upvalueindex(2)) ? 2 : 1);
+    return ar_read_next_header_with(L, filter);
+}
+
 //////////////////////////////////////////////////////////////////////
 static int ar_read_headers(lua_State *L) {
+    struct ar_filter* filter;
+    int reuse = 0;
     ar_read_check(L, 1); // {ud}
-    lua_pushcfunction(L, ar_read_next_header);
+    lua_settop(L, 2); // {ud}, {opts}
+    if ( lua_istable(L, 2) ) {
+        lua_getfield(L, 2, "reuse");
+        reuse = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    filter = ar_filter_new(L, 2); // {ud}, {opts}, {filter}
+    if ( NULL != filter ) {
+        lua_pushboolean(L, reuse); // {ud}, {opts}, {filter}, reuse
+        lua_pushcclosure(L, ar_read_next_header_filter_iter, 2); // {ud}, {opts}, fn
+    } else if ( reuse ) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, ar_read_next_header);
+    } else {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, ar_read_next_header_iter);
+    }
     lua_pushvalue(L, 1);
-    lua_pushnil(L);
+    if ( reuse ) {
+        // The entry we start with is refilled by every iteration:
+        lua_pushcfunction(L, ar_entry);
+        lua_call(L, 0, 1);
+    } else {
+        lua_pushnil(L);
+    }
     return 3;
 }
 
 //////////////////////////////////////////////////////////////////////
-static int ar_read_data(lua_State *L) {
-    struct archive* self = *ar_read_check(L, 1);
-    const void* buff;
-    size_t buff_len;
-    off_t offset;
+// The fields that read:list() knows how to collect:
+static void ar_list_pathname(lua_State *L, struct archive_entry* entry) {
+    lua_pushstring(L, archive_entry_pathname(entry));
+}
+static void ar_list_size(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_size(entry));
+}
+static void ar_list_mode(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_mode(entry));
+}
+static void ar_list_mtime(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_mtime(entry));
+}
+static void ar_list_atime(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_atime(entry));
+}
+static void ar_list_ctime(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_ctime(entry));
+}
+static void ar_list_uid(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_uid(entry));
+}
+static void ar_list_gid(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_gid(entry));
+}
+static void ar_list_uname(lua_State *L, struct archive_entry* entry) {
+    lua_pushstring(L, archive_entry_uname(entry));
+}
+static void ar_list_gname(lua_State *L, struct archive_entry* entry) {
+    lua_pushstring(L, archive_entry_gname(entry));
+}
+static void ar_list_symlink(lua_State *L, struct archive_entry* entry) {
+    lua_pushstring(L, archive_entry_symlink(entry));
+}
+static void ar_list_hardlink(lua_State *L, struct archive_entry* entry) {
+    lua_pushstring(L, archive_entry_hardlink(entry));
+}
+static void ar_list_dev(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_dev(entry));
+}
+static void ar_list_ino(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_ino(entry));
+}
+static void ar_list_nlink(lua_State *L, struct archive_entry* entry) {
+    lua_pushnumber(L, archive_entry_nlink(entry));
+}
+
+static struct {
+    const char *name;
+    void (*push)(lua_State *L, struct archive_entry* entry);
+} list_fields[] = {
+    { "pathname",  ar_list_pathname },
+    { "size",      ar_list_size },
+    { "mode",      ar_list_mode },
+    { "mtime",     ar_list_mtime },
+    { "atime",     ar_list_atime },
+    { "ctime",     ar_list_ctime },
+    { "uid",       ar_list_uid },
+    { "gid",       ar_list_gid },
+    { "uname",     ar_list_uname },
+    { "gname",     ar_list_gname },
+    { "symlink",   ar_list_symlink },
+    { "hardlink",  ar_list_hardlink },
+    { "dev",       ar_list_dev },
+    { "ino",       ar_list_ino },
+    { "nlink",     ar_list_nlink },
+    { NULL,        NULL }
+};
+
+#define AR_LIST_MAX_FIELDS (sizeof(list_fields)/sizeof(list_fields[0]) - 1)
+
+//////////////////////////////////////////////////////////////////////
+// Walk the rest of the archive in C, skipping the data, and return a
+// table with one array per requested field plus 'n', the number of
+// entries.  A single archive_entry is reused for every header.
+static int ar_read_list(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    struct archive* self = self_ref->archive;
+    struct archive_entry* entry;
+    struct ar_filter* filter;
+    int fields[AR_LIST_MAX_FIELDS];
+    int nfields = 0;
+    int size_hint = 0;
+    int count = 0;
+    int columns;
     int result;
+    int i;
 
     if ( NULL == self ) err("NULL archive{read}!");
+    lua_settop(L, 2); // {self}, {opts}
+    if ( ! lua_isnil(L, 2) ) luaL_checktype(L, 2, LUA_TTABLE);
+
+    if ( ! lua_isnil(L, 2) ) {
+        lua_getfield(L, 2, "size_hint");
+        size_hint = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "fields"); // {self}, {opts}, {fields}
+        if ( lua_istable(L, -1) ) {
+            int len = lua_objlen(L, -1);
+            if ( len > (int)AR_LIST_MAX_FIELDS ) {
+                err("InvalidArgument: at most %d fields may be listed", (int)AR_LIST_MAX_FIELDS);
+            }
+            for ( i=1; i <= len; i++ ) {
+                const char* name;
+                int idx;
+                lua_rawgeti(L, -1, i);
+                name = lua_tostring(L, -1);
+                for ( idx=0; ; idx++ ) {
+                    if ( NULL == list_fields[idx].name ) {
+                        err("InvalidArgument: '%s' is not a valid field", name ? name : "?");
+                    }
+                    if ( NULL != name && 0 == strcmp(name, list_fields[idx].name) ) break;
+                }
+                fields[nfields++] = idx;
+                lua_pop(L, 1);
+            }
+        } else if ( ! lua_isnil(L, -1) ) {
+            err("InvalidArgument: 'fields' must be a table");
+        }
+        lua_pop(L, 1); // {self}, {opts}
+    }
+    if ( 0 == nfields ) {
+        // Default to pathname, size, mode and mtime:
+        for ( ; nfields < 4; nfields++ ) fields[nfields] = nfields;
+    }
+    if ( size_hint < 0 ) size_hint = 0;
+
+    filter = ar_filter_new(L, 2); // {self}, {opts}, {filter}
+    lua_pushcfunction(L, ar_entry); // {self}, {opts}, {filter}, ar_entry
+    lua_call(L, 0, 1); // {self}, {opts}, {filter}, {entry}
+    entry = *ar_entry_check(L, 4);
+
+    lua_createtable(L, 0, nfields + 1); // {self}, {opts}, {filter}, {entry}, {result}
+    columns = lua_gettop(L) + 1;
+    luaL_checkstack(L, nfields, "too many fields");
+    for ( i=0; i < nfields; i++ ) {
+        lua_createtable(L, size_hint, 0); // ..., {result}, ..., {column}
+        lua_pushvalue(L, -1); // ..., {result}, ..., {column}, {column}
+        lua_setfield(L, columns - 1, list_fields[fields[i]].name);
+    } // {self}, {opts}, {filter}, {entry}, {result}, {column1}, ..., {columnN}
 
-    result = archive_read_data_block(self, &buff, &buff_len, &offset);
+    for ( ;; ) {
+        self_ref->pending_len = 0;
+        result = archive_read_next_header2(self, entry);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( ARCHIVE_OK != result ) {
+            err("archive_read_next_header2: %s", archive_error_string(self));
+        }
+        if ( ! ar_filter_match(filter, archive_entry_pathname(entry)) ) continue;
+        count++;
+        for ( i=0; i < nfields; i++ ) {
+            list_fields[fields[i]].push(L, entry);
+            lua_rawseti(L, columns + i, count);
+        }
+    }
+
+    lua_settop(L, columns - 1); // {self}, {opts}, {filter}, {entry}, {result}
+    lua_pushnumber(L, count);
+    lua_setfield(L, -2, "n");
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Skip the rest of the data for the current entry.  If the source can
+// skip (all native sources can, or if a skipper was given) then the
+// data is never read.
+static int ar_read_skip(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    struct archive* self = self_ref->archive;
+
+    if ( NULL == self ) err("NULL archive{read}!");
+
+    self_ref->pending_len = 0;
+    if ( ARCHIVE_OK != archive_read_data_skip(self) ) {
+        err("archive_read_data_skip: %s", archive_error_string(self));
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Get the next block of data for the current entry, returning the
+// remainder left behind by read:data_into() first.  Returns the
+// ARCHIVE_* result, so the caller can clean up before raising errors.
+static int ar_read_next_block_result(struct ar_read* self_ref,
+                                     const void** buff,
+                                     size_t* buff_len,
+                                     off_t* offset)
+{
+    la_int64_t block_offset;
+    int result;
+
+    if ( self_ref->pending_len > 0 ) {
+        *buff     = self_ref->pending;
+        *buff_len = self_ref->pending_len;
+        *offset   = self_ref->pending_offset;
+        self_ref->pending_len = 0;
+        return ARCHIVE_OK;
+    }
+
+    result = archive_read_data_block(self_ref->archive, buff, buff_len, &block_offset);
+    if ( ARCHIVE_OK == result ) {
+        *offset = block_offset;
+        self_ref->data_offset = block_offset + *buff_len;
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns false once there is no more data for the current entry.
+static int ar_read_next_block(lua_State *L,
+                              struct ar_read* self_ref,
+                              const void** buff,
+                              size_t* buff_len,
+                              off_t* offset)
+{
+    int result;
+
+    if ( NULL == self_ref->archive ) err("NULL archive{read}!");
+
+    result = ar_read_next_block_result(self_ref, buff, buff_len, offset);
     if ( ARCHIVE_EOF == result ) {
         return 0;
     } else if ( ARCHIVE_OK != result ) {
-        err("archive_read_data_block: %s", archive_error_string(self));
+        err("archive_read_data_block: %s", archive_error_string(self_ref->archive));
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_read_data(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    const void* buff;
+    size_t buff_len;
+    off_t offset;
+
+    if ( ! ar_read_next_block(L, self_ref, &buff, &buff_len, &offset) ) {
+        return 0;
     }
     lua_pushlstring(L, buff, buff_len);
     lua_pushnumber(L, offset);
     return 2;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Copy the next block of data into an archive{buffer}.  A buffer with
+// no capacity is grown to fit the block, otherwise at most
+// buffer:size() bytes are copied and the rest of the block is
+// returned by the next call.
+static int ar_read_data_into(lua_State *L) {
+    struct ar_read*   self_ref = ar_read_check(L, 1);
+    struct ar_buffer* buf      = ar_buffer_check_mutable(L, 2);
+    const void* buff;
+    size_t buff_len;
+    size_t len;
+    off_t offset;
+
+    if ( ! ar_read_next_block(L, self_ref, &buff, &buff_len, &offset) ) {
+        buf->len = 0;
+        return 0;
+    }
+    if ( 0 == buf->size && ! ar_buffer_grow(buf, buff_len) ) {
+        // Keep the block for the next call rather than losing it:
+        buf->len = 0;
+        self_ref->pending        = buff;
+        self_ref->pending_len    = buff_len;
+        self_ref->pending_offset = offset;
+        err("OutOfMemory: unable to grow buffer to %d bytes", (int)buff_len);
+    }
+
+    len = buff_len < buf->size ? buff_len : buf->size;
+    if ( len > 0 ) memcpy(buf->data, buff, len);
+    buf->len = len;
+
+    if ( len < buff_len ) {
+        self_ref->pending        = (const char*)buff + len;
+        self_ref->pending_len    = buff_len - len;
+        self_ref->pending_offset = offset + len;
+    }
+
+    lua_pushnumber(L, len);
+    lua_pushnumber(L, offset);
+    return 2;
+}
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Account for a hole of len bytes in a sparse entry, by seeking over
+// it if fd is a regular file and writing zeros otherwise.
+static int ar_read_write_hole(int fd, int seekable, off_t len) {
+    static const char zeros[16384];
+    if ( seekable ) return lseek(fd, len, SEEK_CUR) >= 0;
+    while ( len > 0 ) {
+        size_t chunk = len < (off_t)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if ( ! ar_util_write_all(fd, zeros, chunk) ) return 0;
+        len -= chunk;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the rest of the data of the current entry to fd.  Returns
+// NULL on success, otherwise the name of the function that failed
+// (with errno set, or the archive error set for
+// "archive_read_data_block").
+static const char* ar_read_data_to(struct ar_read* self_ref, int fd, double* total) {
+    struct stat st;
+    const void* buff;
+    size_t buff_len;
+    off_t  offset;
+    off_t  pos = self_ref->pending_len > 0 ?
+        self_ref->pending_offset : self_ref->data_offset;
+    int    seekable = 0 == fstat(fd, &st) && S_ISREG(st.st_mode);
+    int    in_hole = 0;
+    int    result;
+
+    *total = 0;
+    for ( ;; ) {
+        result = ar_read_next_block_result(self_ref, &buff, &buff_len, &offset);
+        if ( ARCHIVE_EOF == result ) break;
+        if ( ARCHIVE_OK != result ) return "archive_read_data_block";
+        if ( offset > pos ) {
+            if ( ! ar_read_write_hole(fd, seekable, offset - pos) ) {
+                return seekable ? "lseek" : "write";
+            }
+            in_hole = 1;
+        }
+        if ( buff_len > 0 ) {
+            if ( ! ar_util_write_all(fd, buff, buff_len) ) return "write";
+            in_hole = 0;
+        }
+        pos = offset + buff_len;
+        *total += buff_len;
+    }
+
+    // A hole at the end of the entry:
+    if ( self_ref->data_size > pos ) {
+        if ( ! ar_read_write_hole(fd, seekable, self_ref->data_size - pos) ) {
+            return seekable ? "lseek" : "write";
+        }
+        in_hole = 1;
+    }
+    // Seeking past the end does not change the size of the file:
+    if ( in_hole && seekable && 0 != ftruncate(fd, lseek(fd, 0, SEEK_CUR)) ) {
+        return "ftruncate";
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// bytes, seconds = read:data_to_fd(fd)
+static int ar_read_data_to_fd(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    int fd = ar_util_tofd(L, 2);
+    double start = ar_util_now();
+    double total;
+    const char* failed;
+
+    if ( NULL == self_ref->archive ) err("NULL archive{read}!");
+    failed = ar_read_data_to(self_ref, fd, &total);
+    if ( NULL != failed ) {
+        if ( 0 == strcmp(failed, "archive_read_data_block") ) {
+            err("%s: %s", failed, archive_error_string(self_ref->archive));
+        }
+        err("%s: %s", failed, strerror(errno));
+    }
+    lua_pushnumber(L, total);
+    lua_pushnumber(L, ar_util_now() - start);
+    return 2;
+}
+
+//////////////////////////////////////////////////////////////////////
+// bytes, seconds = read:data_to_file(path)
+static int ar_read_data_to_file(lua_State *L) {
+    struct ar_read* self_ref = ar_read_check(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    double start = ar_util_now();
+    double total;
+    const char* failed;
+    int oflags = O_WRONLY | O_CREAT | O_TRUNC;
+    int err_num;
+    int fd;
+
+    if ( NULL == self_ref->archive ) err("NULL archive{read}!");
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    fd = open(path, oflags, 0666);
+    if ( fd < 0 ) err("open: %s: %s", path, strerror(errno));
+
+    failed = ar_read_data_to(self_ref, fd, &total);
+    err_num = errno;
+    if ( 0 != close(fd) && NULL == failed ) {
+        failed = "close";
+        err_num = errno;
+    }
+    if ( NULL != failed ) {
+        if ( 0 == strcmp(failed, "archive_read_data_block") ) {
+            err("%s: %s", failed, archive_error_string(self_ref->archive));
+        }
+        err("%s: %s: %s", failed, path, strerror(err_num));
+    }
+    lua_pushnumber(L, total);
+    lua_pushnumber(L, ar_util_now() - start);
+    return 2;
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////
 // Precondition: top of the stack contains a table for which we will
 // append our "static" methods.
@@ -325,7 +1377,16 @@ int ar_read_init(lua_State *L) {
     static luaL_reg m_fns[] = {
         { "next_header",  ar_read_next_header },
         { "headers",      ar_read_headers },
+        { "list",         ar_read_list },
         { "data",         ar_read_data },
+        { "data_into",    ar_read_data_into },
+#ifndef _WIN32
+        { "data_to_fd",   ar_read_data_to_fd },
+        { "data_to_file", ar_read_data_to_file },
+#endif
+        { "skip",         ar_read_skip },
+        { "index",        ar_read_index },
+        { "extract",      ar_read_extract },
         { "close",        ar_read_destroy },
         { "__gc",         ar_read_destroy },
         { NULL, NULL }
@@ -344,5 +1405,10 @@ int ar_read_init(lua_State *L) {
 
     lua_pop(L, 1); // {class}
 
+    luaL_newmetatable(L, AR_MMAP); // {class}, {meta}
+    lua_pushcfunction(L, ar_mmap_destroy); // {class}, {meta}, fn
+    lua_setfield(L, -2, "__gc"); // {class}, {meta}
+    lua_pop(L, 1); // {class}
+
     return 0;
 }
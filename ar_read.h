@@ -2,7 +2,33 @@
 
 #define AR_READ "archive{read}"
 
+// The archive must be the first member, the registry and the
+// callbacks treat the userdata as a struct archive**.
+struct ar_read {
+    struct archive* archive;
+
+    // What is left of the last data block that did not fit into the
+    // archive{buffer} passed to read:data_into():
+    const void*     pending;
+    size_t          pending_len;
+    off_t           pending_offset;
+
+    // End of the last data block returned and the size of the current
+    // entry (or -1 if unknown), used to find holes in sparse entries:
+    off_t           data_offset;
+    off_t           data_size;
+
+    // Index of the last buffer in the reader_buffers ring that was
+    // passed to the reader:
+    int             reader_buffer_idx;
+
+    // The archive{buffer} read straight out of by data= (if any),
+    // pinned until the archive is closed:
+    struct ar_buffer* data_buffer;
+};
+
 #define ar_read_check(L, narg) \
-    ((struct archive**)luaL_checkudata((L), (narg), AR_READ))
+    ((struct ar_read*)luaL_checkudata((L), (narg), AR_READ))
 
 int ar_read_init(lua_State *L);
+int ar_read(lua_State *L);
@@ -0,0 +1,615 @@
+//////////////////////////////////////////////////////////////////////
+// Implement write:add_tree(), which walks a directory tree in C and
+// appends every file in it to the archive.
+//
+// The tree is walked first (names are sorted so the archive does not
+// depend on readdir() order).  Then a small pool of prefetch threads
+// runs ahead of the calling thread doing the stat(), open() and
+// read() of each file, so on a cold cache these latencies overlap
+// with each other and with the compression done by the calling
+// thread.  Entries are always written in the order they were walked.
+//////////////////////////////////////////////////////////////////////
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "ar_tree.h"
+#include "ar_write.h"
+#include "ar_filter.h"
+#include "ar_util.h"
+
+#define err(...) (luaL_error(L, __VA_ARGS__))
+
+#ifndef _WIN32
+
+// Regular files up to this size are read into memory by the prefetch
+// threads, larger ones are left open and streamed by the caller:
+#define AR_TREE_MAX_FILE   (1024*1024)
+
+// How far the prefetch threads may get ahead of the caller:
+#define AR_TREE_MAX_AHEAD  256
+#define AR_TREE_MAX_BYTES  (32*1024*1024)
+
+#define AR_TREE_DEFAULT_THREADS 4
+
+// A file found while walking the tree.
+struct ar_item {
+    char*       path;     // path on disk
+    char*       name;     // pathname in the archive
+    struct stat st;
+    int         fd;       // open file that is too big to prefetch
+    char*       data;     // prefetched contents
+    size_t      data_len;
+    const char* failed;   // function that failed while prefetching
+    int         err_num;
+    int         ready;
+};
+
+// Kept in a userdata so the threads are joined and open files closed
+// even if we raise an error part way through.
+struct ar_tree {
+    struct ar_item* items;
+    size_t          len;
+    size_t          size;
+    int             follow;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;    // broadcast when an item is prefetched
+    pthread_cond_t  wanted;   // broadcast when an item is written
+    size_t          next;     // next item to prefetch
+    size_t          consumed; // items written so far
+    size_t          ahead;    // bytes of prefetched data not yet written
+    int             idle;     // prefetch threads waiting for room
+    int             waiting;  // the caller is waiting for an item
+    int             done;
+    pthread_t*      threads;
+    int             nthreads;
+    int             locks_init;
+};
+
+// Used to detect symlink loops when following symlinks.
+struct ar_walk_dir {
+    dev_t               dev;
+    ino_t               ino;
+    struct ar_walk_dir* parent;
+};
+
+// The counters in the table returned by write:add_tree():
+static const char* stats_fields[] = {
+    "entries", "files", "directories", "symlinks", "others",
+    "bytes", "skipped", "failed", NULL
+};
+
+//////////////////////////////////////////////////////////////////////
+static void ar_tree_stop(struct ar_tree* self) {
+    int i;
+    if ( NULL == self->threads ) return;
+
+    pthread_mutex_lock(&self->lock);
+    self->done = 1;
+    pthread_cond_broadcast(&self->wanted);
+    pthread_mutex_unlock(&self->lock);
+    for ( i=0; i < self->nthreads; i++ ) pthread_join(self->threads[i], NULL);
+    free(self->threads);
+    self->threads = NULL;
+    self->nthreads = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+static void ar_item_free(struct ar_item* item) {
+    if ( item->fd >= 0 ) close(item->fd);
+    item->fd = -1;
+    free(item->data);
+    item->data = NULL;
+    free(item->path);
+    item->path = NULL;
+    free(item->name);
+    item->name = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_tree_destroy(lua_State *L) {
+    struct ar_tree* self = (struct ar_tree*)luaL_checkudata(L, 1, AR_TREE);
+    size_t i;
+
+    ar_tree_stop(self);
+    for ( i=0; i < self->len; i++ ) ar_item_free(&self->items[i]);
+    free(self->items);
+    self->items = NULL;
+    self->len = self->size = 0;
+    if ( self->locks_init ) {
+        pthread_mutex_destroy(&self->lock);
+        pthread_cond_destroy(&self->ready);
+        pthread_cond_destroy(&self->wanted);
+        self->locks_init = 0;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Record a per file failure in the errors array of the stats table.
+static void ar_tree_error(lua_State *L,
+                          int stats_idx,
+                          const char* path,
+                          const char* failed,
+                          const char* msg)
+{
+    ar_util_count(L, stats_idx, "failed", 1);
+    lua_getfield(L, stats_idx, "errors"); // {errors}
+    lua_pushfstring(L, "%s: %s: %s", failed, path, msg); // {errors}, msg
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1); // {errors}
+    lua_pop(L, 1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns prefix .. "/" .. name (or just name if prefix is empty).
+static char* ar_tree_join(lua_State *L, const char* prefix, const char* name) {
+    size_t prefix_len = strlen(prefix);
+    size_t name_len = strlen(name);
+    char* result = (char*)malloc(prefix_len + name_len + 2);
+    if ( NULL == result ) err("OutOfMemory: unable to allocate path");
+    if ( 0 == prefix_len ) {
+        memcpy(result, name, name_len + 1);
+    } else {
+        memcpy(result, prefix, prefix_len);
+        result[prefix_len] = '/';
+        memcpy(result + prefix_len + 1, name, name_len + 1);
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Takes ownership of path and name.
+static void ar_tree_add(lua_State *L, struct ar_tree* self, char* path, char* name) {
+    struct ar_item* item;
+    if ( self->len == self->size ) {
+        size_t size = self->size ? self->size * 2 : 256;
+        struct ar_item* items = (struct ar_item*)realloc(self->items, size * sizeof(struct ar_item));
+        if ( NULL == items ) {
+            free(path);
+            free(name);
+            err("OutOfMemory: unable to allocate %d items", (int)size);
+        }
+        self->items = items;
+        self->size = size;
+    }
+    item = &self->items[self->len++];
+    memset(item, 0, sizeof(struct ar_item));
+    item->fd = -1;
+    item->path = path;
+    item->name = name;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_tree_cmp(const void* a, const void* b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: the stats table is at stats_idx.
+//
+// Add the contents of the directory at path (named name in the
+// archive) to the tree, recursively.  The names of each directory are
+// held in a Lua table while sorting so they are released if we raise.
+static void ar_tree_walk(lua_State *L,
+                         struct ar_tree* self,
+                         struct ar_filter* filter,
+                         const char* path,
+                         const char* name,
+                         struct ar_walk_dir* dir,
+                         int one_file_system,
+                         int stats_idx)
+{
+    DIR* dp = opendir(path);
+    struct dirent* de;
+    const char** names;
+    char buf[sizeof(de->d_name) + 2];
+    size_t name_len;
+    size_t len = 0;
+    size_t i;
+    int names_idx;
+
+    if ( NULL == dp ) {
+        ar_tree_error(L, stats_idx, path, "opendir", strerror(errno));
+        return;
+    }
+    luaL_checkstack(L, 4, "directory tree is too deep");
+    lua_newtable(L); // {names}
+    names_idx = lua_gettop(L);
+    while ( NULL != (de = readdir(dp)) ) {
+        if ( 0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, "..") ) continue;
+        // The d_type is stored after the terminating NUL:
+        name_len = strlen(de->d_name);
+        if ( name_len + 2 > sizeof(buf) ) continue;
+        memcpy(buf, de->d_name, name_len + 1);
+#ifdef DT_DIR
+        buf[name_len + 1] = (char)de->d_type;
+#else
+        buf[name_len + 1] = 0;
+#endif
+        lua_pushlstring(L, buf, name_len + 2);
+        lua_rawseti(L, names_idx, ++len);
+    }
+    closedir(dp);
+
+    names = (const char**)lua_newuserdata(L, (len ? len : 1) * sizeof(const char*)); // {names}, ud
+    for ( i=0; i < len; i++ ) {
+        lua_rawgeti(L, names_idx, i+1);
+        names[i] = lua_tostring(L, -1);
+        lua_pop(L, 1); // still referenced by {names}
+    }
+    qsort(names, len, sizeof(const char*), ar_tree_cmp);
+
+    for ( i=0; i < len; i++ ) {
+        char* child_path = ar_tree_join(L, path, names[i]);
+        char* child_name = ar_tree_join(L, name, names[i]);
+        struct ar_walk_dir child;
+        struct ar_walk_dir* ancestor;
+        struct stat st;
+#ifdef DT_DIR
+        unsigned char type = (unsigned char)names[i][strlen(names[i]) + 1];
+#endif
+        int rc;
+
+        // Only directories need a stat() here, the rest is left to
+        // the prefetch threads:
+        st.st_mode = 0;
+        rc = -1;
+#ifdef DT_DIR
+        if ( DT_DIR == type || DT_UNKNOWN == type ||
+             ( self->follow && DT_LNK == type ) )
+#endif
+        {
+            rc = self->follow ? stat(child_path, &st) : lstat(child_path, &st);
+        }
+        // On failure let the prefetch report the error:
+        if ( 0 != rc ) st.st_mode = 0;
+        if ( ! S_ISDIR(st.st_mode) ) {
+            if ( ! ar_filter_match(filter, child_name) ) {
+                ar_util_count(L, stats_idx, "skipped", 1);
+                free(child_path);
+                free(child_name);
+                continue;
+            }
+            ar_tree_add(L, self, child_path, child_name);
+            continue;
+        }
+
+        if ( ar_filter_excluded(filter, child_name) ) {
+            ar_util_count(L, stats_idx, "skipped", 1);
+            free(child_path);
+            free(child_name);
+            continue;
+        }
+        for ( ancestor = dir; NULL != ancestor; ancestor = ancestor->parent ) {
+            if ( ancestor->dev == st.st_dev && ancestor->ino == st.st_ino ) break;
+        }
+        if ( NULL != ancestor ) {
+            ar_tree_error(L, stats_idx, child_path, "walk", "symlink loop");
+            free(child_path);
+            free(child_name);
+            continue;
+        }
+        // Directories are added even when only matching files are
+        // wanted so they keep their permissions and times:
+        ar_tree_add(L, self, child_path, child_name);
+        if ( one_file_system && NULL != dir && st.st_dev != dir->dev ) continue;
+
+        child.dev = st.st_dev;
+        child.ino = st.st_ino;
+        child.parent = dir;
+        ar_tree_walk(L, self, filter, child_path, child_name, &child,
+                     one_file_system, stats_idx);
+    }
+    lua_pop(L, 2); // <nothing>
+}
+
+//////////////////////////////////////////////////////////////////////
+// Stat and read the file of an item, done by the prefetch threads.
+// Errors are recorded in the item and reported by the caller.
+static void ar_tree_prefetch(struct ar_tree* self, struct ar_item* item) {
+    int flags = O_RDONLY;
+    size_t size;
+    int fd;
+
+    if ( 0 != (self->follow ? stat(item->path, &item->st) : lstat(item->path, &item->st)) ) {
+        item->failed = self->follow ? "stat" : "lstat";
+        item->err_num = errno;
+        return;
+    }
+    if ( ! S_ISREG(item->st.st_mode) || 0 == item->st.st_size ) return;
+
+#ifdef O_NOFOLLOW
+    if ( ! self->follow ) flags |= O_NOFOLLOW;
+#endif
+#ifdef O_CLOEXEC
+    flags |= O_CLOEXEC;
+#endif
+    fd = open(item->path, flags);
+    if ( fd < 0 ) {
+        item->failed = "open";
+        item->err_num = errno;
+        return;
+    }
+    if ( item->st.st_size > AR_TREE_MAX_FILE ) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, AR_TREE_MAX_FILE, POSIX_FADV_WILLNEED);
+#endif
+        item->fd = fd;
+        return;
+    }
+
+    size = (size_t)item->st.st_size;
+    item->data = (char*)malloc(size);
+    if ( NULL == item->data ) {
+        item->failed = "malloc";
+        item->err_num = ENOMEM;
+        close(fd);
+        return;
+    }
+    while ( item->data_len < size ) {
+        ssize_t got = read(fd, item->data + item->data_len, size - item->data_len);
+        if ( got < 0 ) {
+            if ( EINTR == errno ) continue;
+            item->failed = "read";
+            item->err_num = errno;
+            break;
+        }
+        // Truncated since the stat, libarchive pads the rest:
+        if ( 0 == got ) break;
+        item->data_len += got;
+    }
+    close(fd);
+}
+
+//////////////////////////////////////////////////////////////////////
+static void* ar_tree_thread(void* arg) {
+    struct ar_tree* self = (struct ar_tree*)arg;
+
+    pthread_mutex_lock(&self->lock);
+    while ( ! self->done && self->next < self->len ) {
+        struct ar_item* item;
+        if ( self->next >= self->consumed + AR_TREE_MAX_AHEAD ||
+             self->ahead >= AR_TREE_MAX_BYTES )
+        {
+            self->idle++;
+            pthread_cond_wait(&self->wanted, &self->lock);
+            self->idle--;
+            continue;
+        }
+        item = &self->items[self->next++];
+        pthread_mutex_unlock(&self->lock);
+
+        ar_tree_prefetch(self, item);
+
+        pthread_mutex_lock(&self->lock);
+        item->ready = 1;
+        self->ahead += item->data_len;
+        if ( self->waiting ) pthread_cond_broadcast(&self->ready);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write a prefetched item to the archive.
+static void ar_tree_write(lua_State *L,
+                          struct ar_write* write,
+                          struct ar_item* item,
+                          int stats_idx)
+{
+    struct archive* ar = write->archive;
+    struct archive_entry* entry = write->disk_entry;
+    const char* failed;
+    double total = 0;
+    int result;
+
+    if ( NULL != item->failed ) {
+        ar_tree_error(L, stats_idx, item->path, item->failed, strerror(item->err_num));
+        if ( NULL == item->data ) return;
+    }
+
+    archive_entry_clear(entry);
+    archive_entry_copy_pathname(entry, item->name);
+    archive_entry_copy_sourcepath(entry, item->path);
+    if ( archive_read_disk_entry_from_file(write->disk, entry, item->fd, &item->st) < ARCHIVE_WARN ) {
+        ar_tree_error(L, stats_idx, item->path, "archive_read_disk_entry_from_file",
+                      archive_error_string(write->disk));
+        return;
+    }
+    result = ar_write_entry_header(L, 1, entry, AR_WRITE_AUTO);
+    if ( ARCHIVE_FATAL == result ) {
+        err("archive_write_header: %s", archive_error_string(ar));
+    } else if ( result < ARCHIVE_WARN ) {
+        ar_tree_error(L, stats_idx, item->path, "archive_write_header", archive_error_string(ar));
+        return;
+    }
+
+    if ( NULL != item->data ) {
+        if ( ar_write_entry_data(write, item->data, item->data_len) < 0 ) {
+            err("archive_write_data: %s", archive_error_string(ar));
+        }
+        total = item->data_len;
+    } else if ( item->fd >= 0 ) {
+        failed = ar_write_data_from(write, item->fd, archive_entry_size(entry), &total);
+        if ( NULL != failed ) {
+            if ( 0 == strcmp(failed, "archive_write_data") ) {
+                err("%s: %s", failed, archive_error_string(ar));
+            }
+            ar_tree_error(L, stats_idx, item->path, failed, strerror(errno));
+        }
+    }
+
+    ar_util_count(L, stats_idx, "entries", 1);
+    ar_util_count(L, stats_idx, "bytes", total);
+    switch ( item->st.st_mode & S_IFMT ) {
+    case S_IFREG: ar_util_count(L, stats_idx, "files", 1);       break;
+    case S_IFDIR: ar_util_count(L, stats_idx, "directories", 1); break;
+    case S_IFLNK: ar_util_count(L, stats_idx, "symlinks", 1);    break;
+    default:      ar_util_count(L, stats_idx, "others", 1);      break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// stats = write:add_tree(dir [, options])
+int ar_write_add_tree(lua_State *L) {
+    struct ar_write* write = (struct ar_write*)ar_write_check(L, 1);
+    const char* dir = luaL_checkstring(L, 2);
+    const char* prefix;
+    struct ar_filter* filter;
+    struct ar_tree* self;
+    struct ar_walk_dir root;
+    struct stat st;
+    double start = ar_util_now();
+    int threads = AR_TREE_DEFAULT_THREADS;
+    int one_file_system;
+    int stats_idx;
+    size_t i;
+
+    if ( NULL == write->archive ) err("NULL archive{write}!");
+    lua_settop(L, 3); // {self}, dir, {opts}
+    if ( lua_isnil(L, 3) ) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    luaL_checktype(L, 3, LUA_TTABLE);
+    ar_write_disk_open(L, write, 3);
+
+    lua_getfield(L, 3, "threads");
+    if ( ! lua_isnil(L, -1) ) {
+        threads = lua_tointeger(L, -1);
+        if ( threads < 0 ) err("InvalidArgument: 'threads' must not be negative");
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 3, "one_file_system");
+    one_file_system = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    // The archive pathnames start with prefix, which defaults to dir
+    // without trailing slashes:
+    lua_getfield(L, 3, "prefix"); // {self}, dir, {opts}, prefix
+    if ( lua_isnil(L, -1) ) {
+        size_t len = strlen(dir);
+        while ( len > 1 && '/' == dir[len-1] ) len--;
+        lua_pop(L, 1);
+        lua_pushlstring(L, dir, len);
+    } else if ( ! lua_isstring(L, -1) ) {
+        err("InvalidArgument: 'prefix' must be a string");
+    }
+    prefix = lua_tostring(L, -1);
+
+    filter = ar_filter_new(L, 3); // {self}, dir, {opts}, prefix, {filter}
+
+    self = (struct ar_tree*)lua_newuserdata(L, sizeof(struct ar_tree)); // ..., {tree}
+    memset(self, 0, sizeof(struct ar_tree));
+    luaL_getmetatable(L, AR_TREE);
+    lua_setmetatable(L, -2);
+    lua_getfield(L, 3, "follow_symlinks");
+    self->follow = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 10); // ..., {tree}, {stats}
+    for ( i=0; NULL != stats_fields[i]; i++ ) {
+        lua_pushnumber(L, 0);
+        lua_setfield(L, -2, stats_fields[i]);
+    }
+    lua_newtable(L);
+    lua_setfield(L, -2, "errors");
+    stats_idx = lua_gettop(L);
+
+    if ( 0 != stat(dir, &st) ) err("stat: %s: %s", dir, strerror(errno));
+    if ( ! S_ISDIR(st.st_mode) ) err("InvalidArgument: '%s' is not a directory", dir);
+    if ( '\0' != *prefix ) {
+        ar_tree_add(L, self, ar_tree_join(L, "", dir), ar_tree_join(L, "", prefix));
+    }
+    root.dev = st.st_dev;
+    root.ino = st.st_ino;
+    root.parent = NULL;
+    ar_tree_walk(L, self, filter, dir, prefix, &root, one_file_system, stats_idx);
+
+    if ( threads > 0 && self->len > 0 ) {
+        if ( 0 != pthread_mutex_init(&self->lock, NULL) ) err("pthread_mutex_init failed");
+        pthread_cond_init(&self->ready, NULL);
+        pthread_cond_init(&self->wanted, NULL);
+        self->locks_init = 1;
+        self->threads = (pthread_t*)malloc(threads * sizeof(pthread_t));
+        if ( NULL == self->threads ) err("OutOfMemory: unable to start %d threads", threads);
+        for ( ; self->nthreads < threads; self->nthreads++ ) {
+            if ( 0 != pthread_create(&self->threads[self->nthreads], NULL, ar_tree_thread, self) ) {
+                break;
+            }
+        }
+        if ( 0 == self->nthreads ) {
+            free(self->threads);
+            self->threads = NULL;
+        }
+    }
+
+    for ( i=0; i < self->len; i++ ) {
+        struct ar_item* item = &self->items[i];
+
+        if ( NULL == self->threads ) {
+            ar_tree_prefetch(self, item);
+        } else {
+            pthread_mutex_lock(&self->lock);
+            while ( ! item->ready ) {
+                self->waiting = 1;
+                pthread_cond_wait(&self->ready, &self->lock);
+            }
+            self->waiting = 0;
+            pthread_mutex_unlock(&self->lock);
+        }
+
+        ar_tree_write(L, write, item, stats_idx);
+
+        if ( NULL != self->threads ) {
+            pthread_mutex_lock(&self->lock);
+            self->consumed++;
+            self->ahead -= item->data_len;
+            // Wake the prefetch threads once there is room for a
+            // batch of items, rather than for every item:
+            if ( self->idle &&
+                 self->next < self->consumed + AR_TREE_MAX_AHEAD / 2 &&
+                 self->ahead < AR_TREE_MAX_BYTES / 2 )
+            {
+                pthread_cond_broadcast(&self->wanted);
+            }
+            pthread_mutex_unlock(&self->lock);
+        }
+        ar_item_free(item);
+    }
+    ar_tree_stop(self);
+
+    lua_pushnumber(L, ar_util_now() - start);
+    lua_setfield(L, stats_idx, "seconds");
+    return 1;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Postcondition: the archive{tree} metatable is registered.
+//////////////////////////////////////////////////////////////////////
+int ar_tree_init(lua_State *L) {
+#ifndef _WIN32
+    luaL_newmetatable(L, AR_TREE); // {meta}
+    lua_pushcfunction(L, ar_tree_destroy); // {meta}, fn
+    lua_setfield(L, -2, "__gc"); // {meta}
+    lua_pop(L, 1);
+#endif
+    return 0;
+}
@@ -0,0 +1,6 @@
+// This is a private header subject to change.
+
+#define AR_TREE "archive{tree}"
+
+int ar_tree_init(lua_State *L);
+int ar_write_add_tree(lua_State *L);
@@ -0,0 +1,88 @@
+//////////////////////////////////////////////////////////////////////
+// Small helpers shared by the other modules.
+//////////////////////////////////////////////////////////////////////
+
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "ar_util.h"
+
+//////////////////////////////////////////////////////////////////////
+// Returns a monotonic wall clock time in seconds, used for the
+// timings reported in stats tables.
+double ar_util_now(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if ( 0 == clock_gettime(CLOCK_MONOTONIC, &ts) ) {
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+#endif
+#ifndef _WIN32
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the file descriptor for the argument at narg, which may be
+// a number or an io file handle (which is flushed so our writes do
+// not get reordered with its buffered writes).
+int ar_util_tofd(lua_State *L, int narg) {
+    FILE** file;
+    if ( LUA_TNUMBER == lua_type(L, narg) ) return lua_tointeger(L, narg);
+    file = (FILE**)luaL_checkudata(L, narg, LUA_FILEHANDLE);
+    if ( NULL == *file ) luaL_argerror(L, narg, "attempt to use a closed file");
+    fflush(*file);
+    return fileno(*file);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Increment the numeric field of the stats table at idx.
+void ar_util_count(lua_State *L, int idx, const char* field, double amount) {
+    lua_getfield(L, idx, field);
+    lua_pushnumber(L, lua_tonumber(L, -1) + amount);
+    lua_setfield(L, idx, field);
+    lua_pop(L, 1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Record a per entry failure in the errors array of the stats table.
+void ar_util_error(lua_State *L, int stats_idx, const char* pathname, const char* msg) {
+    ar_util_count(L, stats_idx, "failed", 1);
+    lua_getfield(L, stats_idx, "errors"); // {errors}
+    lua_pushfstring(L, "%s: %s", pathname, msg); // {errors}, msg
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1); // {errors}
+    lua_pop(L, 1);
+}
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Write all of buff to fd, retrying short writes.  Returns false
+// (with errno set) on error.
+int ar_util_write_all(int fd, const void* buff, size_t len) {
+    const char* ptr = (const char*)buff;
+    while ( len > 0 ) {
+        ssize_t wrote = write(fd, ptr, len);
+        if ( wrote < 0 ) {
+            if ( EINTR == errno ) continue;
+            return 0;
+        }
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 1;
+}
+#endif
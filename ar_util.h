@@ -0,0 +1,7 @@
+// This is a private header subject to change.
+
+double ar_util_now(void);
+int ar_util_tofd(lua_State *L, int narg);
+void ar_util_count(lua_State *L, int idx, const char* field, double amount);
+void ar_util_error(lua_State *L, int stats_idx, const char* pathname, const char* msg);
+int ar_util_write_all(int fd, const void* buff, size_t len);
@@ -2,17 +2,34 @@
 // Implement the archive{write} object.
 //////////////////////////////////////////////////////////////////////
 
+#ifdef __linux__
+#define _GNU_SOURCE // for O_DIRECT
+#endif
+
 #include <archive.h>
 #include <archive_entry.h>
 #include <ctype.h>
+#include <errno.h>
 #include <lauxlib.h>
 #include <lua.h>
+#include <lualib.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "ar_write.h"
+#include "ar_buffer.h"
 #include "ar_entry.h"
+#include "ar_gzip.h"
 #include "ar_registry.h"
+#include "ar_tree.h"
+#include "ar_util.h"
+#include "ar_zip.h"
 
 #define err(...) (luaL_error(L, __VA_ARGS__))
 #define rel_idx(relative, idx) ((idx) < 0 ? (idx) + (relative) : (idx))
@@ -20,6 +37,36 @@
 static __LA_SSIZE_T ar_write_cb(struct archive * ar,
                                 void *opaque,
                                 const void *buff, size_t len);
+static int ar_write_close_cb(struct archive * ar, void *opaque);
+static void ar_write_open(lua_State *L, int self_idx, int gzip_threads, int level);
+#ifdef AR_HAVE_ZLIB
+static int ar_write_gzip_emit(void* ctx, const void *buff, size_t len);
+#endif
+static void ar_write_get_writer(lua_State *L, int self_idx);
+static void ar_write_zip_policy(lua_State *L, int self_idx);
+static int ar_write_flush_header(struct ar_write* self, const void* buff, size_t len);
+static int ar_write_finish_entries(struct ar_write* self);
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+static void ar_write_zip_open(lua_State *L, struct ar_write* self, int threads, int level);
+#endif
+
+// Initial size of the buffer used by memory=true, doubled as needed:
+#define AR_WRITE_MEMORY_SIZE (64*1024)
+
+// Bytes of the first block of an entry looked at by store_probe:
+#define AR_WRITE_PROBE_SIZE (64*1024)
+
+// Default store_probe threshold, already compressed data is close to
+// 8 bits/byte while text and most binaries are well below 7:
+#define AR_WRITE_PROBE_BITS 7.5
+
+// Size of the reads done by write:data_from_fd():
+#define AR_WRITE_READ_SIZE (1024*1024)
+
+// O_DIRECT requires the buffer, length and file offset of each write
+// to be aligned, so output is staged in a buffer of this size:
+#define AR_WRITE_DIRECT_ALIGN 4096
+#define AR_WRITE_DIRECT_SIZE  (1024*1024)
 
 static int __ref_count = 0;
 
@@ -30,6 +77,247 @@ static int ar_ref_count(lua_State *L) {
     return 1;
 }
 
+//////////////////////////////////////////////////////////////////////
+static void ar_write_filter_option(lua_State *L,
+                                   struct archive* ar,
+                                   const char* name,
+                                   const char* key,
+                                   const char* value)
+{
+    if ( ARCHIVE_OK != archive_write_set_filter_option(ar, name, key, value) ) {
+        err("archive_write_set_filter_option: %s", archive_error_string(ar));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns true if name is in the NULL terminated list of filters.
+static int ar_write_filter_in(const char* name, const char** filters) {
+    for ( ; NULL != *filters; filters++ ) {
+        if ( 0 == strcmp(name, *filters) ) return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Add the filter at spec_idx to the chain.  It is either a name or a
+// table like { "zstd", level = 19, threads = 4 } whose other fields
+// are passed to libarchive as options of the filter (with '_' changed
+// to '-').  The threads and level default to those given to
+// archive.write(), which only apply to the filters that take them
+// (so filters = { "zstd", "uuencode" }, level = 9 works).  Returns
+// false for the "none" filter, which leaves the output as it is.
+static int ar_write_add_filter(lua_State *L,
+                                struct archive* ar,
+                                int spec_idx,
+                                size_t chain_len,
+                                int threads,
+                                int level,
+                                int* gzip_threads,
+                                int* gzip_level)
+{
+    static const char* level_filters[] = {
+        "bzip2", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz", "zstd", NULL
+    };
+    static const char* threads_filters[] = { "xz", "zstd", NULL };
+    const char* name;
+    char num[32];
+    int is_table = lua_istable(L, spec_idx);
+    int own_threads = 0;
+    int own_level = 0;
+    int compresses;
+
+    if ( is_table ) {
+        lua_rawgeti(L, spec_idx, 1); // name
+        lua_getfield(L, spec_idx, "threads");
+        own_threads = ! lua_isnil(L, -1);
+        if ( own_threads ) threads = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, spec_idx, "level");
+        own_level = ! lua_isnil(L, -1);
+        if ( own_level ) level = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    } else {
+        lua_pushvalue(L, spec_idx); // name
+    }
+    name = lua_tostring(L, -1);
+    if ( NULL == name ) err("InvalidArgument: filter name must be a string");
+    compresses = 0 != strcmp(name, "none");
+
+    // Only the filter's own threads ask for ar_gzip in a chain:
+    if ( threads > 1 && 0 == strcmp(name, "gzip") && ( own_threads || 1 == chain_len ) ) {
+        // Compressed by ar_gzip rather than libarchive:
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+        if ( chain_len > 1 ) {
+            err("NotSupported: gzip with 'threads' can't be combined with other filters");
+        }
+        *gzip_threads = threads;
+        *gzip_level = level;
+        lua_pop(L, 1);
+        return compresses;
+#else
+        (void)gzip_threads;
+        (void)gzip_level;
+        err("NotSupported: 'threads' requires zlib for gzip compression");
+#endif
+    }
+
+    // There is archive_write_add_filter_none(), but no "none" name:
+    if ( ! compresses ) {
+        if ( ARCHIVE_OK != archive_write_add_filter_none(ar) ) {
+            err("archive_write_add_filter_none: %s", archive_error_string(ar));
+        }
+    } else if ( ARCHIVE_OK != archive_write_add_filter_by_name(ar, name) ) {
+        err("archive_write_add_filter_by_name: %s", archive_error_string(ar));
+    }
+    if ( threads > 1 && ( own_threads || ar_write_filter_in(name, threads_filters) ) ) {
+        snprintf(num, sizeof(num), "%d", threads);
+        ar_write_filter_option(L, ar, name, "threads", num);
+    }
+    if ( level >= 0 && ( own_level || ar_write_filter_in(name, level_filters) ) ) {
+        snprintf(num, sizeof(num), "%d", level);
+        ar_write_filter_option(L, ar, name, "compression-level", num);
+    }
+    if ( ! is_table ) {
+        lua_pop(L, 1);
+        return compresses;
+    }
+
+    lua_pushnil(L); // name, nil
+    while ( lua_next(L, spec_idx) ) { // name, key, value
+        char key[64];
+        size_t k;
+        if ( LUA_TSTRING != lua_type(L, -2) ||
+             0 == strcmp(lua_tostring(L, -2), "threads") ||
+             0 == strcmp(lua_tostring(L, -2), "level") )
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+        strncpy(key, lua_tostring(L, -2), sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
+        for ( k=0; key[k]; k++ ) if ( '_' == key[k] ) key[k] = '-';
+        if ( LUA_TBOOLEAN == lua_type(L, -1) ) {
+            ar_write_filter_option(L, ar, name, key, lua_toboolean(L, -1) ? "1" : NULL);
+        } else {
+            const char* value = lua_tostring(L, -1);
+            if ( NULL == value ) err("InvalidArgument: filter option '%s' must be a string", key);
+            ar_write_filter_option(L, ar, name, key, value);
+        }
+        lua_pop(L, 1); // name, key
+    }
+    lua_pop(L, 1);
+    return compresses;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read the store_extensions, store and store_probe options which
+// choose between storing and deflating each zip entry.  The set of
+// extensions (lower case, without the dot) and the store function are
+// kept in the fenv.
+static void ar_write_zip_policy(lua_State *L, int self_idx) {
+    static const char* default_extensions[] = {
+        "7z", "apk", "avi", "bz2", "docx", "flac", "gif", "gz", "heic",
+        "jar", "jpeg", "jpg", "lz4", "lzma", "m4a", "mkv", "mov", "mp3",
+        "mp4", "odt", "ogg", "png", "pptx", "rar", "tgz", "txz", "webm",
+        "webp", "woff2", "xlsx", "xz", "zip", "zst", NULL
+    };
+    struct ar_write* self = (struct ar_write*)lua_touserdata(L, self_idx);
+    int i;
+
+    lua_getfenv(L, self_idx); // {fenv}
+
+    lua_getfield(L, 1, "store_extensions"); // {fenv}, exts
+    if ( ! lua_isnil(L, -1) ) {
+        int exts_idx = lua_gettop(L);
+        if ( ! self->is_zip ) err("NotSupported: 'store_extensions' requires format='zip'");
+        lua_newtable(L); // {fenv}, exts, {set}
+        if ( LUA_TBOOLEAN == lua_type(L, exts_idx) ) {
+            for ( i=0; lua_toboolean(L, exts_idx) && default_extensions[i]; i++ ) {
+                lua_pushboolean(L, 1);
+                lua_setfield(L, -2, default_extensions[i]);
+            }
+        } else if ( lua_istable(L, exts_idx) ) {
+            size_t len = lua_objlen(L, exts_idx);
+            for ( i=1; i <= (int)len; i++ ) {
+                char ext[16];
+                const char* str;
+                size_t k;
+                lua_rawgeti(L, exts_idx, i); // {fenv}, exts, {set}, ext
+                str = lua_tostring(L, -1);
+                if ( NULL == str ) err("InvalidArgument: 'store_extensions' must be an array of strings");
+                if ( '.' == *str ) str++;
+                for ( k=0; str[k] && k < sizeof(ext) - 1; k++ ) {
+                    ext[k] = tolower((unsigned char)str[k]);
+                }
+                ext[k] = '\0';
+                lua_pop(L, 1); // {fenv}, exts, {set}
+                lua_pushboolean(L, 1);
+                lua_setfield(L, -2, ext);
+            }
+        } else {
+            err("InvalidArgument: 'store_extensions' must be a table or true");
+        }
+        lua_setfield(L, -3, "store_extensions"); // {fenv}, exts
+    }
+    lua_pop(L, 1); // {fenv}
+
+    lua_getfield(L, 1, "store"); // {fenv}, fn
+    if ( ! lua_isnil(L, -1) ) {
+        if ( ! self->is_zip ) err("NotSupported: 'store' requires format='zip'");
+        if ( ! lua_isfunction(L, -1) ) err("InvalidArgument: 'store' must be a function");
+    }
+    lua_setfield(L, -2, "store"); // {fenv}
+    lua_pop(L, 1); // <nothing>
+
+    lua_getfield(L, 1, "store_probe");
+    if ( lua_toboolean(L, -1) ) {
+        if ( ! self->is_zip ) err("NotSupported: 'store_probe' requires format='zip'");
+        self->probe = AR_WRITE_PROBE_BITS;
+        if ( lua_isnumber(L, -1) ) {
+            self->probe = lua_tonumber(L, -1);
+            if ( self->probe <= 0 || self->probe > 8 ) {
+                err("InvalidArgument: 'store_probe' must be true or bits per byte between 0 and 8");
+            }
+        }
+    }
+    lua_pop(L, 1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the zip compression asked for by a libarchive options string
+// ("compression=store" or "zip:compression=store"), the last one wins.
+// Returns AR_WRITE_DEFLATE, libarchive's default, if there is none.
+static int ar_write_zip_default(const char* options) {
+    int method = AR_WRITE_DEFLATE;
+    const char* p;
+    const char* end;
+
+    for ( p = options; NULL != p && '\0' != *p; p = NULL == end ? NULL : end + 1 ) {
+        const char* colon;
+        size_t len;
+
+        end = strchr(p, ',');
+        len = NULL == end ? strlen(p) : (size_t)(end - p);
+        colon = (const char*)memchr(p, ':', len);
+        if ( NULL != colon ) {
+            // Options for other modules don't apply:
+            if ( colon - p != 3 || 0 != strncmp(p, "zip", 3) ) continue;
+            len -= colon + 1 - p;
+            p = colon + 1;
+        }
+        if ( len == sizeof("compression=store") - 1 &&
+             0 == strncmp(p, "compression=store", len) )
+        {
+            method = AR_WRITE_STORE;
+        } else if ( len == sizeof("compression=deflate") - 1 &&
+                    0 == strncmp(p, "compression=deflate", len) )
+        {
+            method = AR_WRITE_DEFLATE;
+        }
+    }
+    return method;
+}
+
 //////////////////////////////////////////////////////////////////////
 // Constructor:
 static int ar_write(lua_State *L) {
@@ -53,6 +341,7 @@ static int ar_write(lua_State *L) {
         { "shar",       archive_write_set_format_shar },
         { "shardump",   archive_write_set_format_shar_dump },
         { "ustar",      archive_write_set_format_ustar },
+        { "zip",        archive_write_set_format_zip },
         /* New ones to more closely match the C API */
         { "ar_bsd",     archive_write_set_format_ar_bsd },
         { "ar_svr4",    archive_write_set_format_ar_svr4 },
@@ -63,10 +352,19 @@ static int ar_write(lua_State *L) {
     };
     int idx = 0;
     const char* name;
+    int threads = 1;
+    int gzip_threads = 0;
+    int gzip_level = -1;
+    int level = -1;
+    int compressed = 0;
+    size_t filters_len, i;
 
     luaL_checktype(L, 1, LUA_TTABLE);
     self_ref = (struct archive**)
-        lua_newuserdata(L, sizeof(struct archive*)); // {ud}
+        lua_newuserdata(L, sizeof(struct ar_write)); // {ud}
+    memset(self_ref, 0, sizeof(struct ar_write));
+    ((struct ar_write*)self_ref)->fd = -1;
+    ((struct ar_write*)self_ref)->fd_flags = -1;
     luaL_getmetatable(L, AR_WRITE); // {ud}, [write]
     lua_setmetatable(L, -2); // {ud}
     __ref_count++;
@@ -79,10 +377,20 @@ static int ar_write(lua_State *L) {
     lua_createtable(L, 1, 0); // {ud}, {}
     lua_pushliteral(L, "writer"); // {ud}, {}, "writer"
     lua_rawget(L, 1); // {ud}, {}, fn
-    if ( ! lua_isfunction(L, -1) ) {
-        err("MissingArgument: required parameter 'writer' must be a function");
+    if ( ! lua_isnil(L, -1) && ! lua_isfunction(L, -1) ) {
+        err("InvalidArgument: 'writer' must be a function");
     }
     lua_setfield(L, -2, "writer");
+
+    // Keep the io handle alive for as long as we are writing to it:
+    lua_getfield(L, 1, "file"); // {ud}, {}, file
+    lua_setfield(L, -2, "file");
+
+    // Optionally pass this archive{buffer} to the writer rather than
+    // a new string for every block:
+    lua_getfield(L, 1, "writer_buffer"); // {ud}, {}, buf
+    if ( ! lua_isnil(L, -1) ) ar_buffer_check(L, -1);
+    lua_setfield(L, -2, "writer_buffer");
     lua_setfenv(L, -2); // {ud}
 
     // Extract various fields and prepare the archive:
@@ -128,6 +436,9 @@ static int ar_write(lua_State *L) {
         if ( ARCHIVE_OK != archive_write_set_skip_file(*self_ref, dev, ino) ) {
             err("archive_write_set_skip_file: %s", archive_error_string(*self_ref));
         }
+        ((struct ar_write*)self_ref)->skip_set = 1;
+        ((struct ar_write*)self_ref)->skip_dev = dev;
+        ((struct ar_write*)self_ref)->skip_ino = ino;
     }
     lua_pop(L, 1);
 
@@ -147,32 +458,66 @@ static int ar_write(lua_State *L) {
         err("archive_write_set_format_%s: %s", name, archive_error_string(*self_ref));
     }
     lua_pop(L, 1);
+    ((struct ar_write*)self_ref)->is_zip = ( names[idx].setter == archive_write_set_format_zip );
+    ar_write_zip_policy(L, lua_gettop(L));
 
-    lua_getfield(L, 1, "compression");
+    lua_getfield(L, 1, "threads");
     if ( ! lua_isnil(L, -1) ) {
-        static struct {
-            const char *name;
-            int (*setter)(struct archive *);
-        } names[] = {
-            { "bzip2",    archive_write_set_compression_bzip2 },
-            { "compress", archive_write_set_compression_compress },
-            { "gzip",     archive_write_set_compression_gzip },
-            { "lzma",     archive_write_set_compression_lzma },
-            { "xz",       archive_write_set_compression_xz },
-            { NULL,       NULL }
-        };
-        int idx = 0;
-        const char* name = lua_tostring(L, -1);
-        for ( ;; idx++ ) {
-            if ( names[idx].name == NULL ) {
-                err("archive_write_set_compression_*: No such compression '%s'", name);
-            }
-            if ( strcmp(name, names[idx].name) == 0 ) break;
+        threads = lua_tointeger(L, -1);
+        if ( threads <= 0 ) err("InvalidArgument: 'threads' must be a positive number");
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "level");
+    if ( ! lua_isnil(L, -1) ) level = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    // With threads, zip entries are compressed by ar_zip which passes
+    // the finished zip to libarchive as the data of a raw entry:
+    if ( ((struct ar_write*)self_ref)->is_zip && threads > 1 ) {
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+        if ( ARCHIVE_OK != archive_write_set_format_raw(*self_ref) ) {
+            err("archive_write_set_format_raw: %s", archive_error_string(*self_ref));
         }
-        if ( ARCHIVE_OK != (names[idx].setter)(*self_ref) ) {
-            err("archive_write_set_compression_%s: %s", name, archive_error_string(*self_ref));
+#else
+        err("NotSupported: 'threads' requires zlib for zip");
+#endif
+    } else if ( ((struct ar_write*)self_ref)->is_zip && level >= 0 ) {
+        char num[32];
+        snprintf(num, sizeof(num), "%d", level);
+        if ( ARCHIVE_OK != archive_write_set_format_option(*self_ref, "zip", "compression-level", num) ) {
+            err("archive_write_set_format_option: %s", archive_error_string(*self_ref));
         }
     }
+
+    // The filter chain, compression="xz" is short for filters={"xz"}:
+    lua_getfield(L, 1, "filters"); // {ud}, filters
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_createtable(L, 1, 0); // {ud}, {filters}
+        lua_getfield(L, 1, "compression"); // {ud}, {filters}, compression
+        lua_rawseti(L, -2, 1); // {ud}, {filters}
+    } else if ( ! lua_istable(L, -1) ) {
+        err("InvalidArgument: 'filters' must be a table");
+    }
+    filters_len = lua_objlen(L, -1);
+    for ( i=1; i <= filters_len; i++ ) {
+        lua_rawgeti(L, -1, i); // {ud}, {filters}, filter
+        compressed += ar_write_add_filter(L, *self_ref, lua_gettop(L), filters_len,
+                                          threads, level, &gzip_threads, &gzip_level);
+        lua_pop(L, 1); // {ud}, {filters}
+    }
+    lua_pop(L, 1); // {ud}
+
+    // Like bsdtar, don't pad compressed output or zip files (the zstd
+    // reader for one rejects the trailing zeros), compression="none"
+    // is still padded:
+    lua_getfield(L, 1, "bytes_in_last_block");
+    if ( lua_isnil(L, -1) &&
+         ( compressed > 0 || gzip_threads > 0 || ((struct ar_write*)self_ref)->is_zip ) &&
+         ARCHIVE_OK != archive_write_set_bytes_in_last_block(*self_ref, 1) )
+    {
+        err("archive_write_set_bytes_in_last_block: %s", archive_error_string(*self_ref));
+    }
     lua_pop(L, 1);
 
     lua_getfield(L, 1, "options");
@@ -181,16 +526,448 @@ static int ar_write(lua_State *L) {
     {
         err("archive_write_set_options: %s",  archive_error_string(*self_ref));
     }
+    ((struct ar_write*)self_ref)->zip_default = ar_write_zip_default(lua_tostring(L, -1));
     lua_pop(L, 1);
 
 
-    if ( ARCHIVE_OK != archive_write_open(*self_ref, L, NULL, &ar_write_cb, NULL) ) {
-        err("archive_write_open: %s", archive_error_string(*self_ref));
+    lua_getfield(L, 1, "output_buffer");
+    if ( ! lua_isnil(L, -1) ) {
+        struct ar_write* self = (struct ar_write*)self_ref;
+        if ( ! lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0 ) {
+            err("InvalidArgument: 'output_buffer' must be a positive number");
+        }
+        self->output_size = (size_t)lua_tonumber(L, -1);
+        if ( self->output_size > 0 ) {
+            self->output = (char*)malloc(self->output_size);
+            if ( NULL == self->output ) {
+                err("OutOfMemory: unable to allocate %d byte output_buffer",
+                    (int)self->output_size);
+            }
+        }
+    }
+    lua_pop(L, 1);
+
+    ((struct ar_write*)self_ref)->started = ar_util_now();
+    ar_write_open(L, lua_gettop(L), gzip_threads, gzip_level);
+    ((struct ar_write*)self_ref)->opened = 1;
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    if ( ((struct ar_write*)self_ref)->is_zip && threads > 1 ) {
+        ar_write_zip_open(L, (struct ar_write*)self_ref, threads, level);
+    }
+#endif
+
+    return 1;
+}
+
+#ifdef AR_HAVE_ZLIB
+//////////////////////////////////////////////////////////////////////
+// Set the archive error after ar_gzip or ar_zip (named what) failed,
+// unless the failure was in writing its output (which already set
+// it).
+static void ar_write_failed(struct ar_write* self, const char* what, const char* error) {
+    if ( NULL == archive_error_string(self->archive) ) {
+        archive_set_error(self->archive, 0, "%s: %s", what, error);
+    }
+}
+#endif
+
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+
+//////////////////////////////////////////////////////////////////////
+// Sink for ar_zip, the zip is the data of the raw entry.
+static int ar_write_zip_emit(void* ctx, const void *buff, size_t len) {
+    struct ar_write* self = (struct ar_write*)ctx;
+    return archive_write_data(self->archive, buff, len) == (__LA_SSIZE_T)len;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Start ar_zip for format="zip" with threads=N and write the header
+// of the raw entry it writes to.
+static void ar_write_zip_open(lua_State *L, struct ar_write* self, int threads, int level) {
+    struct archive_entry* entry = archive_entry_new();
+    int result;
+
+    if ( NULL == entry ) err("OutOfMemory: archive_entry_new");
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_copy_pathname(entry, "zip");
+    result = archive_write_header(self->archive, entry);
+    archive_entry_free(entry);
+    if ( ARCHIVE_OK != result ) {
+        err("archive_write_header: %s", archive_error_string(self->archive));
+    }
+
+    self->zip = ar_zip_new(threads, level, &ar_write_zip_emit, self);
+    if ( NULL == self->zip ) err("OutOfMemory: unable to start %d threads", threads);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Add an entry to ar_zip, checking what libarchive's zip writer would.
+static int ar_write_zip_add(struct ar_write* self,
+                            struct archive_entry* entry,
+                            int method)
+{
+    int type = archive_entry_filetype(entry);
+    const char* skip = NULL;
+
+    if ( self->skip_set &&
+         archive_entry_dev_is_set(entry) && archive_entry_ino_is_set(entry) &&
+         archive_entry_dev(entry) == self->skip_dev &&
+         (ino_t)archive_entry_ino64(entry) == self->skip_ino )
+    {
+        skip = "Can't add archive to itself";
+    } else if ( AE_IFREG != type && AE_IFDIR != type && AE_IFLNK != type ) {
+        skip = "Filetype not supported";
+    }
+    if ( NULL != skip ) {
+        // Data written for this entry must not end up in the last one:
+        if ( ! ar_zip_end_entry(self->zip) ) {
+            ar_write_failed(self, "zip", ar_zip_error(self->zip));
+            return ARCHIVE_FATAL;
+        }
+        archive_set_error(self->archive, 0, "%s", skip);
+        return ARCHIVE_FAILED;
+    }
+    if ( ! ar_zip_header(self->zip, entry, AR_WRITE_DEFLATE != method) ) {
+        ar_write_failed(self, "zip", ar_zip_error(self->zip));
+        return ARCHIVE_FATAL;
+    }
+    return ARCHIVE_OK;
+}
+#endif
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Write to the native sink, returns false (with errno set) on error.
+// If the O_DIRECT write is refused (for example because the file
+// system does not support it or fd was not at an aligned offset) we
+// fall back to normal writes.
+static int ar_write_sink(struct ar_write* self, const void* buff, size_t len) {
+    if ( ar_util_write_all(self->fd, buff, len) ) return 1;
+#ifdef O_DIRECT
+    if ( EINVAL == errno && NULL != self->direct ) {
+        int flags = fcntl(self->fd, F_GETFL);
+        if ( flags >= 0 && 0 == fcntl(self->fd, F_SETFL, flags & ~O_DIRECT) ) {
+            return ar_util_write_all(self->fd, buff, len);
+        }
+        errno = EINVAL;
+    }
+#endif
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the staged O_DIRECT output.  The final partial block can't be
+// written with O_DIRECT, so it is turned off first.
+static int ar_write_flush_direct(struct ar_write* self, int is_final) {
+    if ( 0 == self->direct_len ) return 1;
+#ifdef O_DIRECT
+    if ( is_final && 0 != self->direct_len % AR_WRITE_DIRECT_ALIGN ) {
+        int flags = fcntl(self->fd, F_GETFL);
+        if ( flags >= 0 ) fcntl(self->fd, F_SETFL, flags & ~O_DIRECT);
+    }
+#endif
+    if ( ! ar_write_sink(self, self->direct, self->direct_len) ) return 0;
+    self->direct_len = 0;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write (compressed) output to fd, staging it when using O_DIRECT.
+// Returns false (and sets the archive error) on failure.
+static int ar_write_fd_emit(void* ctx, const void *buff, size_t len) {
+    struct ar_write* self = (struct ar_write*)ctx;
+    const char* ptr = (const char*)buff;
+    size_t left = len;
+
+    self->bytes += len;
+
+    if ( NULL == self->direct ) {
+        if ( ! ar_write_sink(self, buff, len) ) {
+            archive_set_error(self->archive, errno, "write: %s", strerror(errno));
+            return 0;
+        }
+        return 1;
+    }
+
+    while ( left > 0 ) {
+        size_t chunk = AR_WRITE_DIRECT_SIZE - self->direct_len;
+        if ( chunk > left ) chunk = left;
+        memcpy(self->direct + self->direct_len, ptr, chunk);
+        self->direct_len += chunk;
+        ptr  += chunk;
+        left -= chunk;
+        if ( AR_WRITE_DIRECT_SIZE == self->direct_len && ! ar_write_flush_direct(self, 0) ) {
+            archive_set_error(self->archive, errno, "write: %s", strerror(errno));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static __LA_SSIZE_T ar_write_fd_cb(struct archive * ar,
+                                   void *opaque,
+                                   const void *buff, size_t len)
+{
+    struct ar_write* self = (struct ar_write*)opaque;
+
+    (void)ar;
+    self->blocks++;
+#ifdef AR_HAVE_ZLIB
+    if ( NULL != self->gzip ) {
+        if ( ! ar_gzip_write(self->gzip, buff, len) ) {
+            ar_write_failed(self, "gzip", ar_gzip_error(self->gzip));
+            return -1;
+        }
+        return len;
+    }
+#endif
+    return ar_write_fd_emit(self, buff, len) ? (__LA_SSIZE_T)len : -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_write_fd_close_cb(struct archive * ar, void *opaque) {
+    struct ar_write* self = (struct ar_write*)opaque;
+    int result = ARCHIVE_OK;
+
+#ifdef AR_HAVE_ZLIB
+    if ( NULL != self->gzip && ! ar_gzip_finish(self->gzip) ) {
+        ar_write_failed(self, "gzip", ar_gzip_error(self->gzip));
+        result = ARCHIVE_FATAL;
     }
+#endif
+    if ( NULL != self->direct ) {
+        if ( ! ar_write_flush_direct(self, 1) ) {
+            archive_set_error(ar, errno, "write: %s", strerror(errno));
+            result = ARCHIVE_FATAL;
+        }
+        free(self->direct);
+        self->direct = NULL;
+    }
+    if ( self->do_fsync && ARCHIVE_OK == result && 0 != fsync(self->fd) ) {
+        archive_set_error(ar, errno, "fsync: %s", strerror(errno));
+        result = ARCHIVE_FATAL;
+    }
+    if ( self->close_fd && 0 != close(self->fd) && ARCHIVE_OK == result ) {
+        archive_set_error(ar, errno, "close: %s", strerror(errno));
+        result = ARCHIVE_FATAL;
+    }
+    // Leave the caller's fd as we found it (without O_DIRECT):
+    if ( ! self->close_fd && self->fd_flags >= 0 ) {
+        fcntl(self->fd, F_SETFL, self->fd_flags);
+        self->fd_flags = -1;
+    }
+    self->fd = -1;
+    return result;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Append output to the memory buffer, doubling it as needed.  Returns
+// false (and sets the archive error) if it can't grow.
+static int ar_write_memory_emit(void* ctx, const void *buff, size_t len) {
+    struct ar_write* self = (struct ar_write*)ctx;
+    struct ar_buffer* mem = self->memory;
 
+    if ( mem->len + len > mem->size ) {
+        size_t size = mem->size < AR_WRITE_MEMORY_SIZE ? AR_WRITE_MEMORY_SIZE : mem->size;
+        char*  data;
+        while ( size < mem->len + len ) size *= 2;
+        data = (char*)realloc(mem->data, size);
+        if ( NULL == data ) {
+            archive_set_error(self->archive, ENOMEM,
+                              "OutOfMemory: unable to grow buffer to %lu bytes",
+                              (unsigned long)size);
+            return 0;
+        }
+        mem->data = data;
+        mem->size = size;
+    }
+    memcpy(mem->data + mem->len, buff, len);
+    mem->len    += len;
+    self->bytes += len;
     return 1;
 }
 
+//////////////////////////////////////////////////////////////////////
+static __LA_SSIZE_T ar_write_memory_cb(struct archive * ar,
+                                       void *opaque,
+                                       const void *buff, size_t len)
+{
+    struct ar_write* self = (struct ar_write*)opaque;
+
+    (void)ar;
+    self->blocks++;
+#ifdef AR_HAVE_ZLIB
+    if ( NULL != self->gzip ) {
+        if ( ! ar_gzip_write(self->gzip, buff, len) ) {
+            ar_write_failed(self, "gzip", ar_gzip_error(self->gzip));
+            return -1;
+        }
+        return len;
+    }
+#endif
+    return ar_write_memory_emit(self, buff, len) ? (__LA_SSIZE_T)len : -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_write_memory_close_cb(struct archive * ar, void *opaque) {
+    struct ar_write* self = (struct ar_write*)opaque;
+
+    (void)ar;
+#ifdef AR_HAVE_ZLIB
+    if ( NULL != self->gzip && ! ar_gzip_finish(self->gzip) ) {
+        ar_write_failed(self, "gzip", ar_gzip_error(self->gzip));
+        return ARCHIVE_FATAL;
+    }
+#else
+    (void)self;
+#endif
+    return ARCHIVE_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Open the archive on the sink given in the options table at index 1:
+// a path, fd or file (written to directly from C), memory, otherwise
+// the Lua writer.
+static void ar_write_open(lua_State *L, int self_idx, int gzip_threads, int level) {
+    struct ar_write* self = (struct ar_write*)lua_touserdata(L, self_idx);
+#ifndef _WIN32
+    int oflags = O_WRONLY | O_CREAT | O_TRUNC;
+#endif
+    int direct;
+
+    // Only used with zlib:
+    (void)gzip_threads;
+    (void)level;
+
+    lua_getfield(L, 1, "direct");
+    direct = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "fsync");
+    self->do_fsync = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "path");
+    if ( ! lua_isnil(L, -1) ) {
+        const char* path = lua_tostring(L, -1);
+        if ( NULL == path ) err("InvalidArgument: 'path' must be a string");
+#ifdef _WIN32
+        if ( direct || self->do_fsync ) {
+            err("NotSupported: 'direct' and 'fsync' are not supported on this platform");
+        }
+        if ( ARCHIVE_OK != archive_write_open_filename(self->archive, path) ) {
+            err("archive_write_open_filename: %s", archive_error_string(self->archive));
+        }
+        lua_pop(L, 1);
+        return;
+#else
+#ifdef O_CLOEXEC
+        oflags |= O_CLOEXEC;
+#endif
+        self->fd = open(path, oflags, 0666);
+        if ( self->fd < 0 ) err("open: %s: %s", path, strerror(errno));
+        self->close_fd = 1;
+
+        // Never add the archive to itself (with write:add_tree()):
+        lua_getfield(L, 1, "skip_file");
+        if ( lua_isnil(L, -1) ) {
+            struct stat st;
+            if ( 0 == fstat(self->fd, &st) ) {
+                archive_write_set_skip_file(self->archive, st.st_dev, st.st_ino);
+                self->skip_set = 1;
+                self->skip_dev = st.st_dev;
+                self->skip_ino = st.st_ino;
+            }
+        }
+        lua_pop(L, 1);
+#endif
+    }
+    lua_pop(L, 1);
+
+#ifndef _WIN32
+    if ( self->fd < 0 ) {
+        lua_getfield(L, 1, "fd");
+        if ( lua_isnil(L, -1) ) {
+            lua_pop(L, 1);
+            lua_getfield(L, 1, "file");
+        }
+        if ( ! lua_isnil(L, -1) ) self->fd = ar_util_tofd(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if ( self->fd >= 0 ) {
+        if ( direct ) {
+#ifdef O_DIRECT
+            int flags = fcntl(self->fd, F_GETFL);
+            void* buff = NULL;
+            if ( 0 != posix_memalign(&buff, AR_WRITE_DIRECT_ALIGN, AR_WRITE_DIRECT_SIZE) ) {
+                err("OutOfMemory: unable to allocate the O_DIRECT buffer");
+            }
+            self->direct = (char*)buff;
+            // Not all file systems support it, in which case we just
+            // write normally:
+            if ( flags >= 0 && 0 == fcntl(self->fd, F_SETFL, flags | O_DIRECT) ) {
+                self->fd_flags = flags;
+            }
+#endif
+        }
+#ifdef AR_HAVE_ZLIB
+        if ( gzip_threads > 1 ) {
+            self->gzip = ar_gzip_new(gzip_threads, level, &ar_write_fd_emit, self);
+            if ( NULL == self->gzip ) err("OutOfMemory: unable to start %d threads", gzip_threads);
+        }
+#endif
+        if ( ARCHIVE_OK != archive_write_open(self->archive, self, NULL,
+                                              &ar_write_fd_cb, &ar_write_fd_close_cb) )
+        {
+            err("archive_write_open: %s", archive_error_string(self->archive));
+        }
+        return;
+    }
+#endif
+
+    lua_getfield(L, 1, "memory");
+    if ( lua_toboolean(L, -1) ) {
+        lua_getfenv(L, self_idx); // true, {fenv}
+        lua_pushcfunction(L, ar_buffer); // true, {fenv}, ar_buffer
+        lua_call(L, 0, 1); // true, {fenv}, {buf}
+        self->memory = (struct ar_buffer*)lua_touserdata(L, -1);
+        lua_setfield(L, -2, "memory"); // true, {fenv}
+        lua_pop(L, 2);
+#ifdef AR_HAVE_ZLIB
+        if ( gzip_threads > 1 ) {
+            self->gzip = ar_gzip_new(gzip_threads, level, &ar_write_memory_emit, self);
+            if ( NULL == self->gzip ) err("OutOfMemory: unable to start %d threads", gzip_threads);
+        }
+#endif
+        if ( ARCHIVE_OK != archive_write_open(self->archive, self, NULL,
+                                              &ar_write_memory_cb, &ar_write_memory_close_cb) )
+        {
+            err("archive_write_open: %s", archive_error_string(self->archive));
+        }
+        return;
+    }
+    lua_pop(L, 1);
+
+    ar_write_get_writer(L, self_idx); // writer
+    if ( ! lua_isfunction(L, -1) ) {
+        err("MissingArgument: required parameter 'writer' must be a function (or specify one of 'path', 'fd', 'file' or 'memory')");
+    }
+    lua_pop(L, 1);
+#ifdef AR_HAVE_ZLIB
+    if ( gzip_threads > 1 ) {
+        self->gzip = ar_gzip_new(gzip_threads, level, &ar_write_gzip_emit, self);
+        if ( NULL == self->gzip ) err("OutOfMemory: unable to start %d threads", gzip_threads);
+    }
+#endif
+    if ( ARCHIVE_OK != archive_write_open(self->archive, L, NULL,
+                                          &ar_write_cb, &ar_write_close_cb) )
+    {
+        err("archive_write_open: %s", archive_error_string(self->archive));
+    }
+}
+
 //////////////////////////////////////////////////////////////////////
 // Precondition: archive{write} is at the top of the stack, and idx is
 // the index to the argument for which to pass to writer exists.  If
@@ -203,6 +980,35 @@ static void ar_write_get_writer(lua_State *L, int self_idx) {
     lua_pop(L, 1);                  // writer
 }
 
+//////////////////////////////////////////////////////////////////////
+// Free everything allocated on behalf of the archive.
+static void ar_write_free_buffers(struct ar_write* self) {
+#ifdef AR_HAVE_ZLIB
+    ar_gzip_free(self->gzip);
+    self->gzip = NULL;
+#endif
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    ar_zip_free(self->zip);
+    self->zip = NULL;
+#endif
+    free(self->output);
+    self->output = NULL;
+    free(self->read_buf);
+    self->read_buf = NULL;
+    if ( NULL != self->pending ) {
+        archive_entry_free(self->pending);
+        self->pending = NULL;
+    }
+    if ( NULL != self->disk ) {
+        archive_read_free(self->disk);
+        self->disk = NULL;
+    }
+    if ( NULL != self->disk_entry ) {
+        archive_entry_free(self->disk_entry);
+        self->disk_entry = NULL;
+    }
+}
+
 //////////////////////////////////////////////////////////////////////
 static int ar_write_destroy(lua_State *L) {
     struct archive** self_ref = ar_write_check(L, 1);
@@ -213,14 +1019,23 @@ static int ar_write_destroy(lua_State *L) {
     // will work.
     ar_registry_set(L, *self_ref);
 
-    if ( ARCHIVE_OK != archive_write_close(*self_ref) ) {
+    // libarchive can crash closing an archive whose setup failed, so
+    // one that was never opened is only freed:
+    if ( ((struct ar_write*)self_ref)->opened &&
+         ( ar_write_finish_entries((struct ar_write*)self_ref) < ARCHIVE_WARN ||
+           ARCHIVE_OK != archive_write_close(*self_ref) ) )
+    {
+        ((struct ar_write*)self_ref)->seconds = ar_util_now() - ((struct ar_write*)self_ref)->started;
         lua_pushfstring(L, "archive_write_close: %s", archive_error_string(*self_ref));
         archive_write_finish(*self_ref);
         __ref_count--;
         *self_ref = NULL;
+        ar_write_free_buffers((struct ar_write*)self_ref);
         lua_error(L);
     }
 
+    ((struct ar_write*)self_ref)->seconds = ar_util_now() - ((struct ar_write*)self_ref)->started;
+
     ar_write_get_writer(L, 1); // {self}, writer
     if ( ! lua_isnil(L, -1) ) {
         lua_pushvalue(L, 1); // {self}, writer, {self}
@@ -228,6 +1043,8 @@ static int ar_write_destroy(lua_State *L) {
         lua_call(L, 2, 1); // {self}, result
     }
 
+    ar_write_free_buffers((struct ar_write*)self_ref);
+
     if ( ARCHIVE_OK != archive_write_finish(*self_ref) ) {
         luaL_error(L, "archive_write_finish: %s", archive_error_string(*self_ref));
     }
@@ -237,12 +1054,142 @@ static int ar_write_destroy(lua_State *L) {
     return 0;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{write} is at the top of the stack.  Calls the
+// Lua writer with buff, returns the result or -1 (and sets the
+// archive error) on failure.
+static __LA_SSIZE_T ar_write_call(lua_State *L, struct archive * self,
+                                  const void *buff, size_t len)
+{
+    __LA_SSIZE_T result;
+
+    ((struct ar_write*)lua_touserdata(L, -1))->writer_calls++;
+
+    ar_write_get_writer(L, -1); // {ud}, writer
+    lua_pushvalue(L, -2); // {ud}, writer, {ud}
+    lua_getfenv(L, -1); // {ud}, writer, {ud}, {fenv}
+    lua_pushliteral(L, "writer_buffer"); // {ud}, writer, {ud}, {fenv}, "writer_buffer"
+    lua_rawget(L, -2); // {ud}, writer, {ud}, {fenv}, buf
+    lua_remove(L, -2); // {ud}, writer, {ud}, buf
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1); // {ud}, writer, {ud}
+        lua_pushlstring(L, (const char *)buff, len); // {ud}, writer, {ud}, str
+    } else {
+        struct ar_buffer* buf = (struct ar_buffer*)lua_touserdata(L, -1);
+        // Raising an error here would longjmp over libarchive:
+        if ( buf->borrowed > 0 ) {
+            lua_pop(L, 3); // {ud}
+            archive_set_error(self, 0,
+                              "InvalidState: writer_buffer can't be changed while archive.read { data = buffer } reads from it");
+            return -1;
+        }
+        if ( ! ar_buffer_grow(buf, len) ) {
+            lua_pop(L, 3); // {ud}
+            archive_set_error(self, ENOMEM,
+                              "OutOfMemory: unable to grow writer_buffer to %lu bytes",
+                              (unsigned long)len);
+            return -1;
+        }
+        memcpy(buf->data, buff, len);
+        buf->len = len;
+    }
+
+    if ( 0 != lua_pcall(L, 2, 1, 0) ) { // {ud}, "err"
+        archive_set_error(self, 0, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1); // {ud}
+        return -1;
+    }
+    result = lua_tointeger(L, -1); // {ud}, result
+    lua_pop(L, 1); // {ud}
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{write} is at the top of the stack.  Pass all
+// the coalesced output to the Lua writer, returns false on error.
+static int ar_write_flush(lua_State *L, struct archive * self) {
+    struct ar_write* write = (struct ar_write*)lua_touserdata(L, -1);
+    size_t off = 0;
+
+    while ( off < write->output_len ) {
+        __LA_SSIZE_T wrote =
+            ar_write_call(L, self, write->output + off, write->output_len - off);
+        if ( wrote <= 0 ) {
+            if ( 0 == wrote ) {
+                archive_set_error(self, 0, "writer returned %d", (int)wrote);
+            }
+            return 0;
+        }
+        off += wrote;
+    }
+    write->output_len = 0;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{write} is at the top of the stack.  Pass the
+// output to the Lua writer (coalesced if output_buffer was given),
+// returns the number of bytes consumed or -1.
+static __LA_SSIZE_T ar_write_emit(lua_State *L, struct archive * self,
+                                  const void *buff, size_t len)
+{
+    __LA_SSIZE_T result;
+    struct ar_write* write = (struct ar_write*)lua_touserdata(L, -1);
+
+    if ( NULL == write->output ) {
+        result = ar_write_call(L, self, buff, len);
+        if ( result > 0 ) write->bytes += result;
+        return result;
+    }
+
+    // Coalesce blocks until output_size bytes are pending:
+    if ( write->output_len + len > write->output_size &&
+         ! ar_write_flush(L, self) )
+    {
+        return -1;
+    }
+    if ( len >= write->output_size ) {
+        result = ar_write_call(L, self, buff, len);
+    } else {
+        memcpy(write->output + write->output_len, buff, len);
+        write->output_len += len;
+        result = len;
+    }
+    if ( result > 0 ) write->bytes += result;
+    return result;
+}
+
+#ifdef AR_HAVE_ZLIB
+//////////////////////////////////////////////////////////////////////
+// Precondition: archive{write} is at the top of the stack.  Sink for
+// ar_gzip, all of the output must be consumed.
+static int ar_write_gzip_emit(void* ctx, const void *buff, size_t len) {
+    struct ar_write* write = (struct ar_write*)ctx;
+    const char* ptr = (const char*)buff;
+
+    while ( len > 0 ) {
+        __LA_SSIZE_T wrote = ar_write_emit(write->L, write->archive, ptr, len);
+        if ( wrote <= 0 ) {
+            if ( 0 == wrote ) {
+                archive_set_error(write->archive, 0, "writer returned %d", (int)wrote);
+            }
+            return 0;
+        }
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 1;
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////
 static __LA_SSIZE_T ar_write_cb(struct archive * self,
                                 void *opaque,
                                 const void *buff, size_t len)
 {
-    size_t result;
+    __LA_SSIZE_T result;
+    struct ar_write* write;
     lua_State* L = (lua_State*)opaque;
 
     // We are missing!?
@@ -251,27 +1198,350 @@ static __LA_SSIZE_T ar_write_cb(struct archive * self,
                           "InternalError: write callback called on archive that should already have been garbage collected!");
         return -1;
     }
+    write = (struct ar_write*)lua_touserdata(L, -1); // {ud}
+    write->blocks++;
 
-    ar_write_get_writer(L, -1); // {ud}, writer
-    lua_pushvalue(L, -2); // {ud}, writer, {ud}
-    lua_pushlstring(L, (const char *)buff, len); // {ud}, writer, {ud}, str
+#ifdef AR_HAVE_ZLIB
+    if ( NULL != write->gzip ) {
+        write->L = L;
+        result = len;
+        if ( ! ar_gzip_write(write->gzip, buff, len) ) {
+            ar_write_failed(write, "gzip", ar_gzip_error(write->gzip));
+            result = -1;
+        }
+        lua_pop(L, 1); // <nothing>
+        return result;
+    }
+#endif
+    result = ar_write_emit(L, self, buff, len);
+    lua_pop(L, 1); // <nothing>
 
-    if ( 0 != lua_pcall(L, 2, 1, 0) ) { // {ud}, "err"
-        archive_set_error(self, 0, "%s", lua_tostring(L, -1));
-        lua_pop(L, 2); // <nothing>
-        return -1;
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Called by archive_write_close() before the writer is called with
+// nil, so the last coalesced output is written.
+static int ar_write_close_cb(struct archive * self, void *opaque) {
+    int result = ARCHIVE_OK;
+    lua_State* L = (lua_State*)opaque;
+
+    if ( ! ar_registry_get(L, self) ) return ARCHIVE_OK;
+#ifdef AR_HAVE_ZLIB
+    {
+        struct ar_write* write = (struct ar_write*)lua_touserdata(L, -1); // {ud}
+        write->L = L;
+        if ( NULL != write->gzip && ! ar_gzip_finish(write->gzip) ) {
+            ar_write_failed(write, "gzip", ar_gzip_error(write->gzip));
+            result = ARCHIVE_FATAL;
+        }
+    }
+#endif
+    if ( ARCHIVE_OK == result && ! ar_write_flush(L, self) ) result = ARCHIVE_FATAL;
+    lua_pop(L, 1); // <nothing>
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns a table with the number of blocks produced by libarchive,
+// the number of calls made into the Lua writer and the difference
+// (callbacks_saved), bytes written, seconds the archive was open and
+// the number of zip entries stored and deflated.
+static int ar_write_stats(lua_State *L) {
+    struct ar_write* self = (struct ar_write*)ar_write_check(L, 1);
+
+    lua_createtable(L, 0, 7); // {stats}
+    lua_pushnumber(L, self->blocks);
+    lua_setfield(L, -2, "blocks");
+    lua_pushnumber(L, self->writer_calls);
+    lua_setfield(L, -2, "writer_calls");
+    lua_pushnumber(L, self->blocks - self->writer_calls);
+    lua_setfield(L, -2, "callbacks_saved");
+    lua_pushnumber(L, self->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, NULL == self->archive ? self->seconds : ar_util_now() - self->started);
+    lua_setfield(L, -2, "seconds");
+    lua_pushnumber(L, self->stored);
+    lua_setfield(L, -2, "stored");
+    lua_pushnumber(L, self->deflated);
+    lua_setfield(L, -2, "deflated");
+
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// result = write:result([as_buffer])
+//
+// Closes the archive (if it is still open) and returns what was
+// written with memory=true as a string, or as the archive{buffer}
+// holding it (without a copy) if as_buffer is true.
+static int ar_write_result(lua_State *L) {
+    struct ar_buffer* mem;
+
+    ar_write_check(L, 1);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1); // {self}, as_buffer, {fenv}
+    lua_getfield(L, -1, "memory"); // {self}, as_buffer, {fenv}, {buf}
+    if ( lua_isnil(L, -1) ) {
+        err("NotSupported: write:result() requires memory=true");
+    }
+    mem = (struct ar_buffer*)lua_touserdata(L, -1);
+
+    lua_pushcfunction(L, ar_write_destroy); // ..., {buf}, close
+    lua_pushvalue(L, 1); // ..., {buf}, close, {self}
+    lua_call(L, 1, 0); // ..., {buf}
+
+    if ( ! lua_toboolean(L, 2) ) {
+        lua_pushlstring(L, NULL == mem->data ? "" : mem->data, mem->len);
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the Shannon entropy in bits per byte of (the start of)
+// buff.
+static double ar_write_entropy(const void* buff, size_t len) {
+    const unsigned char* ptr = (const unsigned char*)buff;
+    size_t counts[256];
+    double bits = 0;
+    size_t i;
+
+    if ( len > AR_WRITE_PROBE_SIZE ) len = AR_WRITE_PROBE_SIZE;
+    if ( 0 == len ) return 0;
+    memset(counts, 0, sizeof(counts));
+    for ( i=0; i < len; i++ ) counts[ptr[i]]++;
+    for ( i=0; i < 256; i++ ) {
+        double p;
+        if ( 0 == counts[i] ) continue;
+        p = (double)counts[i] / len;
+        bits -= p * log(p);
+    }
+    return bits / log(2.0);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the extension of the last component of pathname in lower
+// case (without the dot), or NULL if it has none or it is too long.
+static const char* ar_write_extension(const char* pathname, char* ext, size_t size) {
+    const char* dot = strrchr(pathname, '.');
+    size_t k;
+
+    if ( NULL == dot || NULL != strchr(dot, '/') ) return NULL;
+    dot++;
+    for ( k=0; dot[k]; k++ ) {
+        if ( k == size - 1 ) return NULL;
+        ext[k] = tolower((unsigned char)dot[k]);
+    }
+    ext[k] = '\0';
+    return k > 0 ? ext : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Apply the store_extensions and store options to a zip entry,
+// returns AR_WRITE_AUTO if neither decided.  The store function is
+// called with the pathname and size and returns true to store, false
+// to deflate or nil to let store_probe decide.
+static int ar_write_method(lua_State *L, int self_idx, struct archive_entry* entry) {
+    const char* pathname = archive_entry_pathname(entry);
+    int method = AR_WRITE_AUTO;
+    char ext[16];
+
+    if ( NULL == pathname ) return method;
+
+    lua_getfenv(L, self_idx); // {fenv}
+    lua_getfield(L, -1, "store_extensions"); // {fenv}, {set}
+    if ( lua_istable(L, -1) && NULL != ar_write_extension(pathname, ext, sizeof(ext)) ) {
+        lua_getfield(L, -1, ext); // {fenv}, {set}, bool
+        if ( lua_toboolean(L, -1) ) method = AR_WRITE_STORE;
+        lua_pop(L, 1); // {fenv}, {set}
+    }
+    lua_pop(L, 1); // {fenv}
+
+    lua_getfield(L, -1, "store"); // {fenv}, fn
+    if ( AR_WRITE_AUTO == method && lua_isfunction(L, -1) ) {
+        lua_pushstring(L, pathname); // {fenv}, fn, pathname
+        if ( archive_entry_size_is_set(entry) ) {
+            lua_pushnumber(L, archive_entry_size(entry));
+        } else {
+            lua_pushnil(L);
+        } // {fenv}, fn, pathname, size
+        lua_call(L, 2, 1); // {fenv}, result
+        if ( ! lua_isnil(L, -1) ) {
+            method = lua_toboolean(L, -1) ? AR_WRITE_STORE : AR_WRITE_DEFLATE;
+        }
     }
-    result = lua_tointeger(L, -1); // {ud}, result
     lua_pop(L, 2); // <nothing>
 
+    return method;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the header of a zip entry compressed with method, or
+// AR_WRITE_AUTO for entries without data.
+static int ar_write_zip_header(struct ar_write* self,
+                               struct archive_entry* entry,
+                               int method)
+{
+    int result;
+
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    if ( NULL != self->zip ) {
+        result = ar_write_zip_add(self, entry, method);
+    } else
+#endif
+    {
+        // These only fail if called in the wrong state, or when
+        // libarchive was built without zlib so everything is stored:
+        if ( AR_WRITE_STORE == method ) {
+            archive_write_zip_set_compression_store(self->archive);
+        } else if ( AR_WRITE_DEFLATE == method ) {
+            archive_write_zip_set_compression_deflate(self->archive);
+        }
+        result = archive_write_header(self->archive, entry);
+    }
+    if ( result >= ARCHIVE_WARN ) {
+        if ( AR_WRITE_STORE == method ) self->stored++;
+        if ( AR_WRITE_DEFLATE == method ) self->deflated++;
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the pending header, stored if the first block of data (buff)
+// looks incompressible.
+static int ar_write_flush_header(struct ar_write* self, const void* buff, size_t len) {
+    struct archive_entry* entry = self->pending;
+    int result;
+
+    if ( NULL == entry ) return ARCHIVE_OK;
+    self->pending = NULL;
+    result = ar_write_zip_header(self, entry,
+                                 ar_write_entropy(buff, len) > self->probe ?
+                                 AR_WRITE_STORE : AR_WRITE_DEFLATE);
+    archive_entry_free(entry);
     return result;
 }
 
 //////////////////////////////////////////////////////////////////////
+// Write the header of an entry, used instead of archive_write_header()
+// so the zip compression policy is applied.  The method is
+// AR_WRITE_AUTO unless overridden for this entry.  Returns an
+// ARCHIVE_* status like archive_write_header().
+int ar_write_entry_header(lua_State *L, int self_idx,
+                          struct archive_entry* entry, int method)
+{
+    struct ar_write* self = (struct ar_write*)lua_touserdata(L, self_idx);
+    int result;
+
+    if ( ! self->is_zip ) return archive_write_header(self->archive, entry);
+
+    // The previous entry had no data:
+    result = ar_write_flush_header(self, NULL, 0);
+    if ( result < ARCHIVE_WARN ) return result;
+
+    // Only regular files with data are compressed:
+    if ( AE_IFREG != archive_entry_filetype(entry) ||
+         ( archive_entry_size_is_set(entry) && 0 == archive_entry_size(entry) ) )
+    {
+        return ar_write_zip_header(self, entry, AR_WRITE_AUTO);
+    }
+
+    if ( AR_WRITE_AUTO == method ) method = ar_write_method(L, self_idx, entry);
+    if ( AR_WRITE_AUTO == method && self->probe > 0 ) {
+        self->pending = archive_entry_clone(entry);
+        if ( NULL == self->pending ) {
+            archive_set_error(self->archive, ENOMEM, "Can't allocate entry");
+            return ARCHIVE_FATAL;
+        }
+        return ARCHIVE_OK;
+    }
+    // Otherwise use what the options ask for:
+    return ar_write_zip_header(self, entry,
+                               AR_WRITE_AUTO == method ? self->zip_default : method);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write data to the current entry, used instead of
+// archive_write_data() so a pending header is written first.
+__LA_SSIZE_T ar_write_entry_data(struct ar_write* self,
+                                 const void* buff, size_t len)
+{
+    if ( NULL != self->pending &&
+         ar_write_flush_header(self, buff, len) < ARCHIVE_WARN )
+    {
+        return -1;
+    }
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    if ( NULL != self->zip ) {
+        size_t accepted;
+        if ( ! ar_zip_data(self->zip, buff, len, &accepted) ) {
+            ar_write_failed(self, "zip", ar_zip_error(self->zip));
+            return -1;
+        }
+        return accepted;
+    }
+#endif
+    return archive_write_data(self->archive, buff, len);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Finish the current entry, used instead of archive_write_finish_entry()
+// since with threads a zip entry ends at the next header (libarchive
+// only has the one raw entry ar_zip writes to).
+int ar_write_entry_finish(struct ar_write* self) {
+    // The entry had no data:
+    int result = ar_write_flush_header(self, NULL, 0);
+    if ( result < ARCHIVE_WARN ) return result;
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    if ( NULL != self->zip ) return ARCHIVE_OK;
+#endif
+    return archive_write_finish_entry(self->archive);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write out what is held back before the archive is closed: a header
+// waiting for data to probe and the output of ar_zip.
+static int ar_write_finish_entries(struct ar_write* self) {
+    int result = ar_write_flush_header(self, NULL, 0);
+    if ( result < ARCHIVE_WARN ) return result;
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+    if ( NULL != self->zip && ! ar_zip_finish(self->zip) ) {
+        ar_write_failed(self, "zip", ar_zip_error(self->zip));
+        return ARCHIVE_FATAL;
+    }
+#endif
+    return ARCHIVE_OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the AR_WRITE_* method named at idx: "store", "deflate" or
+// AR_WRITE_AUTO if it is nil.  Only zip lets an entry choose.
+static int ar_write_tomethod(lua_State *L, int self_idx, int idx) {
+    static const char* methods[] = { "auto", "store", "deflate", NULL };
+    const char* name;
+    int method;
+    if ( lua_isnoneornil(L, idx) ) return AR_WRITE_AUTO;
+    name = lua_tostring(L, idx);
+    for ( method=0; NULL != methods[method]; method++ ) {
+        if ( NULL != name && 0 == strcmp(name, methods[method]) ) break;
+    }
+    if ( NULL == methods[method] ) {
+        err("InvalidArgument: compression must be 'auto', 'store' or 'deflate'");
+    }
+    if ( AR_WRITE_AUTO != method && ! ((struct ar_write*)lua_touserdata(L, self_idx))->is_zip ) {
+        err("NotSupported: choosing the compression of an entry requires format='zip'");
+    }
+    return method;
+}
+
+//////////////////////////////////////////////////////////////////////
+// write:header(entry [, "store" | "deflate"])
 static int ar_write_header(lua_State *L) {
     struct archive* self;
     struct archive_entry* entry;
     const char* pathname;
+    int method;
     self = *ar_write_check(L, 1);
     if ( NULL == self ) err("NULL archive{write}!");
 
@@ -284,7 +1554,9 @@ static int ar_write_header(lua_State *L) {
         err("InvalidEntry: 'pathname' field must be set");
     }
 
-    if ( ARCHIVE_OK != archive_write_header(self, entry) ) {
+    method = ar_write_tomethod(L, 1, 3);
+
+    if ( ARCHIVE_OK != ar_write_entry_header(L, 1, entry, method) ) {
         err("archive_write_header: %s", archive_error_string(self));
     }
 
@@ -293,24 +1565,367 @@ static int ar_write_header(lua_State *L) {
 
 //////////////////////////////////////////////////////////////////////
 static int ar_write_data(lua_State *L) {
-    struct archive* self;
+    struct ar_write* self;
     const char* data;
     size_t len;
-    size_t wrote;
+    __LA_SSIZE_T wrote;
 
-    self = *ar_write_check(L, 1);
-    if ( NULL == self ) err("NULL archive{write}!");
+    self = (struct ar_write*)ar_write_check(L, 1);
+    if ( NULL == self->archive ) err("NULL archive{write}!");
 
-    data = lua_tolstring(L, 2, &len);
+    data = ar_buffer_tolstring(L, 2, &len);
+    if ( NULL == data ) err("InvalidArgument: expected a string or archive{buffer}");
 
-    archive_write_data(self, data, len);
-    if ( -1 == wrote ) {
-        err("archive_write_data: %s", archive_error_string(self));
+    wrote = ar_write_entry_data(self, data, len);
+    if ( wrote < 0 ) {
+        err("archive_write_data: %s", archive_error_string(self->archive));
     }
 
     return 0;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Returns the total length of the data at idx of write:entries(): nil,
+// a string/archive{buffer} or an array of them.  Raises an error
+// naming entries[n] if any chunk is something else.
+static double ar_write_entries_len(lua_State *L, int idx, int n) {
+    double total = 0;
+    size_t len;
+    int i;
+    if ( lua_isnil(L, idx) ) return 0;
+    if ( ! lua_istable(L, idx) ) {
+        if ( NULL == ar_buffer_tolstring(L, idx, &len) ) {
+            err("InvalidArgument: entries[%d][2] must be a string, archive{buffer} or array of them", n);
+        }
+        return len;
+    }
+    for ( i=1; ; i++ ) {
+        lua_rawgeti(L, idx, i); // ..., chunk
+        if ( lua_isnil(L, -1) ) break;
+        if ( NULL == ar_buffer_tolstring(L, -1, &len) ) {
+            err("InvalidArgument: entries[%d][2][%d] must be a string or archive{buffer}", n, i);
+        }
+        total += len;
+        lua_pop(L, 1); // ...
+    }
+    lua_pop(L, 1); // ...
+    return total;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write a chunk of the data of entries[n], all of it must be taken.
+static void ar_write_entries_chunk(lua_State *L, struct ar_write* self,
+                                   const char* data, size_t len, int n)
+{
+    __LA_SSIZE_T wrote = ar_write_entry_data(self, data, len);
+    if ( wrote < 0 ) {
+        err("archive_write_data: %s", archive_error_string(self->archive));
+    }
+    if ( (size_t)wrote < len ) {
+        err("InvalidArgument: entries[%d] data exceeds the entry size", n);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the data at idx (checked by ar_write_entries_len()) into the
+// current entry, each chunk is handed to libarchive as is.
+static void ar_write_entries_data(lua_State *L, struct ar_write* self, int idx, int n) {
+    const char* data;
+    size_t len;
+    int i;
+    if ( lua_isnil(L, idx) ) return;
+    if ( ! lua_istable(L, idx) ) {
+        data = ar_buffer_tolstring(L, idx, &len);
+        ar_write_entries_chunk(L, self, data, len, n);
+        return;
+    }
+    for ( i=1; ; i++ ) {
+        lua_rawgeti(L, idx, i); // ..., chunk
+        if ( lua_isnil(L, -1) ) break;
+        data = ar_buffer_tolstring(L, -1, &len);
+        if ( len > 0 ) ar_write_entries_chunk(L, self, data, len, n);
+        lua_pop(L, 1); // ...
+    }
+    lua_pop(L, 1); // ...
+}
+
+//////////////////////////////////////////////////////////////////////
+// count = write:entries { { entry, data [, "store" | "deflate"] }, ... }
+//
+// Write a batch of entries in one call.  An entry is an archive{entry}
+// or a table of its fields (copied into a single archive{entry} that
+// is reused for the batch), the data is nil, a string, an
+// archive{buffer} or an array of them written one after the other.
+// If a table entry of a regular file does not give the size, the
+// length of the data is used.
+static int ar_write_entries(lua_State *L) {
+    struct ar_write* self;
+    struct archive_entry* scratch;
+    struct archive_entry* entry;
+    const char* pathname;
+    double len;
+    int n, count, method;
+
+    self = (struct ar_write*)ar_write_check(L, 1);
+    if ( NULL == self->archive ) err("NULL archive{write}!");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    lua_pushcfunction(L, ar_entry);
+    lua_call(L, 0, 1); // {self}, {list}, {scratch}
+    scratch = *ar_entry_check(L, 3);
+
+    count = (int)lua_objlen(L, 2);
+    for ( n=1; n <= count; n++ ) {
+        lua_rawgeti(L, 2, n); // {self}, {list}, {scratch}, {item}
+        if ( ! lua_istable(L, 4) ) {
+            err("InvalidArgument: entries[%d] must be a table", n);
+        }
+        lua_rawgeti(L, 4, 1); // ..., {item}, entry
+        lua_rawgeti(L, 4, 2); // ..., {item}, entry, data
+        lua_rawgeti(L, 4, 3); // ..., {item}, entry, data, method
+
+        method = ar_write_tomethod(L, 1, 7);
+        len = ar_write_entries_len(L, 6, n);
+
+        if ( lua_istable(L, 5) ) {
+            entry = scratch;
+            archive_entry_clear(entry);
+            ar_entry_set_fields(L, 3, 5);
+            if ( ! archive_entry_size_is_set(entry) &&
+                 AE_IFREG == archive_entry_filetype(entry) )
+            {
+                archive_entry_set_size(entry, len);
+            }
+        } else {
+            entry = *ar_entry_check(L, 5);
+            if ( NULL == entry ) err("NULL archive{entry}!");
+        }
+
+        pathname = archive_entry_pathname(entry);
+        if ( NULL == pathname || '\0' == *pathname ) {
+            err("InvalidEntry: entries[%d] 'pathname' field must be set", n);
+        }
+
+        // A warning (such as a name that can't be converted) still
+        // writes the header, like write:add_file() and archive.copy():
+        if ( ar_write_entry_header(L, 1, entry, method) < ARCHIVE_WARN ) {
+            err("archive_write_header: %s (entries[%d])",
+                archive_error_string(self->archive), n);
+        }
+        ar_write_entries_data(L, self, 6, n);
+
+        lua_settop(L, 3); // {self}, {list}, {scratch}
+    }
+
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+#ifndef _WIN32
+//////////////////////////////////////////////////////////////////////
+// Copy up to len bytes (or until EOF if len is negative) from fd into
+// the current entry.  Reads are done in AR_WRITE_READ_SIZE chunks
+// into a buffer that is reused across calls, so no Lua strings are
+// created.  mmap() is not used since a file truncated while we are
+// archiving it would raise SIGBUS.  Returns the name of the function
+// that failed or NULL, the bytes copied are stored in total.
+const char* ar_write_data_from(struct ar_write* self, int fd,
+                               double len, double* total)
+{
+    *total = 0;
+    if ( NULL == self->read_buf ) {
+        self->read_buf = (char*)malloc(AR_WRITE_READ_SIZE);
+        if ( NULL == self->read_buf ) {
+            errno = ENOMEM;
+            return "malloc";
+        }
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    while ( len < 0 || *total < len ) {
+        size_t want = AR_WRITE_READ_SIZE;
+        __LA_SSIZE_T wrote;
+        ssize_t got;
+
+        if ( len >= 0 && len - *total < want ) want = (size_t)(len - *total);
+        got = read(fd, self->read_buf, want);
+        if ( got < 0 ) {
+            if ( EINTR == errno ) continue;
+            return "read";
+        }
+        if ( 0 == got ) break;
+
+        wrote = ar_write_entry_data(self, self->read_buf, got);
+        if ( wrote < 0 ) return "archive_write_data";
+        *total += wrote;
+        // The entry is full:
+        if ( wrote < got ) break;
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+// bytes, seconds = write:data_from_fd(fd [, len])
+static int ar_write_data_from_fd(lua_State *L) {
+    struct ar_write* self = (struct ar_write*)ar_write_check(L, 1);
+    int fd = ar_util_tofd(L, 2);
+    double len = luaL_optnumber(L, 3, -1);
+    double start = ar_util_now();
+    double total;
+    const char* failed;
+
+    if ( NULL == self->archive ) err("NULL archive{write}!");
+    failed = ar_write_data_from(self, fd, len, &total);
+    if ( NULL != failed ) {
+        if ( 0 == strcmp(failed, "archive_write_data") ) {
+            err("%s: %s", failed, archive_error_string(self->archive));
+        }
+        err("%s: %s", failed, strerror(errno));
+    }
+    lua_pushnumber(L, total);
+    lua_pushnumber(L, ar_util_now() - start);
+    return 2;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Prepare the archive{read_disk} used to fill in entries from disk
+// by write:add_file() and write:add_tree().  The table at opts_idx
+// (may be none or nil) enables xattrs, acls, fflags and sparse.
+void ar_write_disk_open(lua_State *L, struct ar_write* self, int opts_idx) {
+    int behavior = 0;
+
+    if ( ! lua_isnoneornil(L, opts_idx) ) luaL_checktype(L, opts_idx, LUA_TTABLE);
+
+#ifdef ARCHIVE_READDISK_NO_XATTR
+    behavior = ARCHIVE_READDISK_NO_XATTR | ARCHIVE_READDISK_NO_ACL |
+        ARCHIVE_READDISK_NO_FFLAGS | ARCHIVE_READDISK_NO_SPARSE;
+    if ( lua_istable(L, opts_idx) ) {
+        static struct {
+            const char* name;
+            int         flag;
+        } opts[] = {
+            { "xattrs", ARCHIVE_READDISK_NO_XATTR },
+            { "acls",   ARCHIVE_READDISK_NO_ACL },
+            { "fflags", ARCHIVE_READDISK_NO_FFLAGS },
+            { "sparse", ARCHIVE_READDISK_NO_SPARSE },
+            { NULL,     0 }
+        };
+        int i;
+        for ( i=0; opts[i].name; i++ ) {
+            lua_getfield(L, opts_idx, opts[i].name);
+            if ( lua_toboolean(L, -1) ) behavior &= ~opts[i].flag;
+            lua_pop(L, 1);
+        }
+    }
+#endif
+
+    if ( NULL == self->disk ) {
+        self->disk = archive_read_disk_new();
+        if ( NULL == self->disk ) err("OutOfMemory: archive_read_disk_new");
+        if ( ARCHIVE_OK != archive_read_disk_set_standard_lookup(self->disk) ) {
+            err("archive_read_disk_set_standard_lookup: %s",
+                archive_error_string(self->disk));
+        }
+        self->disk_entry = archive_entry_new();
+        if ( NULL == self->disk_entry ) err("OutOfMemory: archive_entry_new");
+    }
+    if ( ARCHIVE_OK != archive_read_disk_set_behavior(self->disk, behavior) ) {
+        err("archive_read_disk_set_behavior: %s", archive_error_string(self->disk));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// bytes = write:add_file(path [, name [, {xattrs=, acls=, fflags=, sparse=}]])
+//
+// The entry is filled in by archive_read_disk so user and group names
+// are looked up through its cache and symlink targets are read.  The
+// archive{read_disk} and entry are reused for every call.
+static int ar_write_add_file(lua_State *L) {
+    struct ar_write* self = (struct ar_write*)ar_write_check(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    const char* name = luaL_optstring(L, 3, path);
+    struct stat st;
+    double total = 0;
+    const char* failed = NULL;
+    int oflags = O_RDONLY;
+    int err_num = 0;
+    int fd = -1;
+
+    if ( NULL == self->archive ) err("NULL archive{write}!");
+    ar_write_disk_open(L, self, 4);
+
+    if ( 0 != lstat(path, &st) ) err("lstat: %s: %s", path, strerror(errno));
+    if ( S_ISREG(st.st_mode) ) {
+#ifdef O_CLOEXEC
+        oflags |= O_CLOEXEC;
+#endif
+        fd = open(path, oflags);
+        if ( fd < 0 ) err("open: %s: %s", path, strerror(errno));
+    }
+
+    archive_entry_clear(self->disk_entry);
+    archive_entry_copy_pathname(self->disk_entry, name);
+    archive_entry_copy_sourcepath(self->disk_entry, path);
+    if ( archive_read_disk_entry_from_file(self->disk, self->disk_entry, fd, &st) < ARCHIVE_WARN ) {
+        failed = "archive_read_disk_entry_from_file";
+    } else if ( ar_write_entry_header(L, 1, self->disk_entry, AR_WRITE_AUTO) < ARCHIVE_WARN ) {
+        failed = "archive_write_header";
+    } else if ( fd >= 0 && archive_entry_size(self->disk_entry) > 0 ) {
+        failed = ar_write_data_from(self, fd, archive_entry_size(self->disk_entry), &total);
+        err_num = errno;
+    }
+    if ( fd >= 0 ) close(fd);
+
+    if ( NULL != failed ) {
+        if ( 0 == strcmp(failed, "archive_read_disk_entry_from_file") ) {
+            err("%s: %s: %s", failed, path, archive_error_string(self->disk));
+        }
+        if ( 0 == strncmp(failed, "archive_write_", 14) ) {
+            err("%s: %s", failed, archive_error_string(self->archive));
+        }
+        err("%s: %s: %s", failed, path, strerror(err_num));
+    }
+    lua_pushnumber(L, total);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// bytes, seconds = write:data_from_file(path)
+static int ar_write_data_from_file(lua_State *L) {
+    struct ar_write* self = (struct ar_write*)ar_write_check(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    double start = ar_util_now();
+    double total;
+    const char* failed;
+    int oflags = O_RDONLY;
+    int err_num;
+    int fd;
+
+    if ( NULL == self->archive ) err("NULL archive{write}!");
+#ifdef O_CLOEXEC
+    oflags |= O_CLOEXEC;
+#endif
+    fd = open(path, oflags);
+    if ( fd < 0 ) err("open: %s: %s", path, strerror(errno));
+
+    failed = ar_write_data_from(self, fd, -1, &total);
+    err_num = errno;
+    close(fd);
+    if ( NULL != failed ) {
+        if ( 0 == strcmp(failed, "archive_write_data") ) {
+            err("%s: %s", failed, archive_error_string(self->archive));
+        }
+        err("%s: %s: %s", failed, path, strerror(err_num));
+    }
+    lua_pushnumber(L, total);
+    lua_pushnumber(L, ar_util_now() - start);
+    return 2;
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////
 // Precondition: top of the stack contains a table for which we will
 // append our "static" methods.
@@ -327,6 +1942,15 @@ int ar_write_init(lua_State *L) {
     static luaL_reg m_fns[] = {
         { "header",  ar_write_header },
         { "data",    ar_write_data },
+        { "entries", ar_write_entries },
+        { "stats",   ar_write_stats },
+        { "result",  ar_write_result },
+#ifndef _WIN32
+        { "data_from_fd",   ar_write_data_from_fd },
+        { "data_from_file", ar_write_data_from_file },
+        { "add_file",       ar_write_add_file },
+        { "add_tree",       ar_write_add_tree },
+#endif
         { "close",   ar_write_destroy },
         { "__gc",    ar_write_destroy },
         { NULL, NULL }
@@ -2,7 +2,91 @@
 
 #define AR_WRITE "archive{write}"
 
+// How a zip entry is compressed, AR_WRITE_AUTO lets the policy given
+// to archive.write() decide:
+#define AR_WRITE_AUTO    0
+#define AR_WRITE_STORE   1
+#define AR_WRITE_DEFLATE 2
+
+// The archive must be the first member so ar_write_check() can be
+// dereferenced to get at the struct archive*.
+struct ar_write {
+    struct archive* archive;
+    int             opened;     // archive_write_open() succeeded
+
+    // Native sink (path, fd or file), fd is -1 when writing to the
+    // Lua writer:
+    int             fd;
+    int             close_fd;   // we opened fd, so we close it
+    int             fd_flags;   // flags of a caller's fd to restore, or -1
+    int             do_fsync;   // fsync(fd) when closing
+
+    // Aligned staging buffer used when writing with O_DIRECT:
+    char*           direct;
+    size_t          direct_len;
+
+    // Blocks are coalesced into this buffer until output_size bytes
+    // are pending, then the Lua writer is called (output_buffer=N):
+    char*           output;
+    size_t          output_len;
+    size_t          output_size;
+
+    // The archive{buffer} (also kept in the fenv) the output is
+    // appended to with memory=true:
+    struct ar_buffer* memory;
+
+    // Buffer used by write:data_from_fd() and data_from_file():
+    char*           read_buf;
+
+    // Used by write:add_file() to fill in entries from disk:
+    struct archive*       disk;
+    struct archive_entry* disk_entry;
+
+    // Parallel gzip compression (compression="gzip" with threads=N),
+    // L is the state to call the Lua writer with:
+    struct ar_gzip* gzip;
+    lua_State*      L;
+
+    // Zip compression policy (format="zip").  When store_probe is
+    // given the header of an entry is held in pending until its first
+    // block of data can be probed:
+    int                   is_zip;
+    double                probe;   // entropy threshold in bits/byte, 0 if off
+    struct archive_entry* pending;
+
+    // The method for entries no policy decides, from options (libarchive
+    // keeps the last method set, so this is set rather than left to it):
+    int                   zip_default;
+
+    // Parallel zip writer (format="zip" with threads=N), its output
+    // goes through libarchive's raw format.  It checks skip_file
+    // itself since libarchive never sees the entries:
+    struct ar_zip*        zip;
+    int                   skip_set;
+    dev_t                 skip_dev;
+    ino_t                 skip_ino;
+
+    // Statistics returned by write:stats():
+    lua_Number      blocks;       // blocks produced by libarchive
+    lua_Number      writer_calls; // calls into the Lua writer
+    lua_Number      bytes;        // bytes written
+    lua_Number      stored;       // zip entries stored
+    lua_Number      deflated;     // zip entries deflated
+    double          started;      // when the archive was opened
+    double          seconds;      // time until it was closed
+};
+
 #define ar_write_check(L, narg) \
     ((struct archive**)luaL_checkudata((L), (narg), AR_WRITE))
 
 int ar_write_init(lua_State *L);
+int ar_write_entry_header(lua_State *L, int self_idx,
+                          struct archive_entry* entry, int method);
+__LA_SSIZE_T ar_write_entry_data(struct ar_write* self,
+                                 const void* buff, size_t len);
+int ar_write_entry_finish(struct ar_write* self);
+#ifndef _WIN32
+void ar_write_disk_open(lua_State *L, struct ar_write* self, int opts_idx);
+const char* ar_write_data_from(struct ar_write* self, int fd,
+                               double len, double* total);
+#endif
@@ -0,0 +1,509 @@
+//////////////////////////////////////////////////////////////////////
+// Parallel zip writer used by archive.write { format = "zip",
+// threads = N }.
+//
+// Zip entries are compressed independently, so the data of every
+// entry is cut into AR_ZIP_BLOCK sized blocks which are deflated (or
+// only checksummed when stored) by ar_deflate.  Like ar_gzip, the
+// blocks of an entry after the first are primed with the last 32K
+// before them, so a small file is a single job while a large one
+// still compresses in parallel.  The local
+// headers, data, data descriptors and central directory are written
+// by the calling thread in the order the entries were added, with
+// ZIP64 records where the sizes, offsets or number of entries need
+// them.
+//////////////////////////////////////////////////////////////////////
+
+#if defined(AR_HAVE_ZLIB) && ! defined(_WIN32)
+
+#include <archive_entry.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "ar_deflate.h"
+#include "ar_zip.h"
+
+#define AR_ZIP_BLOCK (128*1024)
+
+// Buffer size for the first block of an entry whose size is not set:
+#define AR_ZIP_UNKNOWN_SIZE (16*1024)
+
+// Entries with more data than this (or no size) that don't fit in a
+// single block get ZIP64 data descriptors, the margin is for deflate
+// expanding incompressible data:
+#define AR_ZIP_LARGE 0xff000000u
+
+#define AR_ZIP_MAX32 0xffffffffu
+
+// What is needed for the central directory:
+struct ar_zip_file {
+    char*    name;
+    size_t   name_len;
+    uint32_t dos_time;
+    uint32_t mtime;
+    uint32_t attr;       // external attributes
+    int      method;     // 0 (stored) or 8 (deflated)
+    int      flags;      // general purpose bits
+    int      zip64;      // the local header has a ZIP64 extra field
+    int      size_set;
+    uint64_t declared;   // size given by the entry
+    uLong    crc;
+    uint64_t size;
+    uint64_t csize;
+    uint64_t offset;     // of the local header
+};
+
+struct ar_zip {
+    ar_zip_sink            sink;
+    void*                  ctx;
+    const char*            error;
+    struct ar_deflate*     pool;
+    uint64_t               offset;   // bytes written so far
+    int                    finished;
+
+    struct ar_zip_file*    files;
+    size_t                 files_len;
+    size_t                 files_size;
+
+    // The block being filled by the caller, and how much more data
+    // the entry takes if its size is set:
+    struct ar_deflate_job* current;
+    uint64_t               remaining;
+};
+
+//////////////////////////////////////////////////////////////////////
+static unsigned char* ar_zip_put16(unsigned char* p, uint32_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    return p + 2;
+}
+
+//////////////////////////////////////////////////////////////////////
+static unsigned char* ar_zip_put32(unsigned char* p, uint32_t value) {
+    p = ar_zip_put16(p, value & 0xffff);
+    return ar_zip_put16(p, value >> 16);
+}
+
+//////////////////////////////////////////////////////////////////////
+static unsigned char* ar_zip_put64(unsigned char* p, uint64_t value) {
+    p = ar_zip_put32(p, (uint32_t)value);
+    return ar_zip_put32(p, (uint32_t)(value >> 32));
+}
+
+//////////////////////////////////////////////////////////////////////
+// The extended timestamp extra field (the same in the local and
+// central headers).
+static unsigned char* ar_zip_put_mtime(unsigned char* p, struct ar_zip_file* file) {
+    p = ar_zip_put16(p, 0x5455);
+    p = ar_zip_put16(p, 5);
+    *p++ = 1; // mtime only
+    return ar_zip_put32(p, file->mtime);
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_zip_emit(struct ar_zip* self, const void* buff, size_t len) {
+    if ( 0 == len ) return 1;
+    if ( ! self->sink(self->ctx, buff, len) ) {
+        self->error = "write failed";
+        return 0;
+    }
+    self->offset += len;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the local header of file.  The crc and sizes are only known
+// if the entry is a single block, otherwise they follow the data in a
+// data descriptor.
+static int ar_zip_local_header(struct ar_zip* self, struct ar_zip_file* file, int descriptor) {
+    unsigned char buf[30 + 9 + 20];
+    unsigned char* p = buf;
+
+    if ( descriptor ) {
+        file->flags |= 8;
+        file->zip64 = ! file->size_set || file->declared >= AR_ZIP_LARGE;
+    }
+    file->offset = self->offset;
+
+    p = ar_zip_put32(p, 0x04034b50);
+    p = ar_zip_put16(p, file->zip64 ? 45 : 20);
+    p = ar_zip_put16(p, file->flags);
+    p = ar_zip_put16(p, file->method);
+    p = ar_zip_put32(p, file->dos_time);
+    p = ar_zip_put32(p, descriptor ? 0 : file->crc);
+    p = ar_zip_put32(p, file->zip64 ? AR_ZIP_MAX32 : descriptor ? 0 : (uint32_t)file->csize);
+    p = ar_zip_put32(p, file->zip64 ? AR_ZIP_MAX32 : descriptor ? 0 : (uint32_t)file->size);
+    p = ar_zip_put16(p, file->name_len);
+    p = ar_zip_put16(p, file->zip64 ? 9 + 20 : 9);
+    if ( ! ar_zip_emit(self, buf, p - buf) ||
+         ! ar_zip_emit(self, file->name, file->name_len) )
+    {
+        return 0;
+    }
+
+    p = ar_zip_put_mtime(buf, file);
+    if ( file->zip64 ) {
+        // The sizes are in the data descriptor:
+        p = ar_zip_put16(p, 0x0001);
+        p = ar_zip_put16(p, 16);
+        p = ar_zip_put64(p, 0);
+        p = ar_zip_put64(p, 0);
+    }
+    return ar_zip_emit(self, buf, p - buf);
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_zip_descriptor(struct ar_zip* self, struct ar_zip_file* file) {
+    unsigned char buf[24];
+    unsigned char* p = buf;
+
+    p = ar_zip_put32(p, 0x08074b50);
+    p = ar_zip_put32(p, file->crc);
+    if ( file->zip64 ) {
+        p = ar_zip_put64(p, file->csize);
+        p = ar_zip_put64(p, file->size);
+    } else {
+        p = ar_zip_put32(p, (uint32_t)file->csize);
+        p = ar_zip_put32(p, (uint32_t)file->size);
+    }
+    return ar_zip_emit(self, buf, p - buf);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit callback of the pool, writes the local header before the first
+// block of an entry and the data descriptor after its last.
+static int ar_zip_block(void* ctx, struct ar_deflate_job* job) {
+    struct ar_zip* self = (struct ar_zip*)ctx;
+    struct ar_zip_file* file = &self->files[job->file];
+    const unsigned char* out;
+    size_t out_len;
+
+    if ( job->store ) {
+        out = job->in + job->dict_len;
+        out_len = job->in_len;
+    } else {
+        out = job->out;
+        out_len = job->out_len;
+    }
+    file->crc = crc32_combine(file->crc, job->crc, job->in_len);
+    file->size += job->in_len;
+    file->csize += out_len;
+
+    return ( ! job->first || ar_zip_local_header(self, file, ! job->last) ) &&
+        ar_zip_emit(self, out, out_len) &&
+        ( ! job->last || ! ( file->flags & 8 ) || ar_zip_descriptor(self, file) );
+}
+
+//////////////////////////////////////////////////////////////////////
+struct ar_zip* ar_zip_new(int threads, int level, ar_zip_sink sink, void* ctx) {
+    struct ar_zip* self = (struct ar_zip*)calloc(1, sizeof(struct ar_zip));
+    if ( NULL == self ) return NULL;
+
+    self->sink = sink;
+    self->ctx  = ctx;
+    self->pool = ar_deflate_new(threads, level, ar_zip_block, self, &self->error);
+    if ( NULL == self->pool ) {
+        ar_zip_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Room for the next block of an entry with size bytes left (the
+// buffer is grown as needed for the rest).
+static size_t ar_zip_block_size(uint64_t size) {
+    return size > AR_ZIP_BLOCK ? AR_ZIP_BLOCK : (size_t)size;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Hand the current block to the pool, and unless it is the last of
+// the entry start the next one.
+static int ar_zip_submit(struct ar_zip* self, int last) {
+    struct ar_deflate_job* job = self->current;
+
+    self->current = NULL;
+    if ( ! last ) {
+        struct ar_zip_file* file = &self->files[job->file];
+        self->current = ar_deflate_job_next(job, file->size_set ?
+                                            ar_zip_block_size(self->remaining) : AR_ZIP_BLOCK);
+        if ( NULL == self->current ) {
+            self->error = "out of memory";
+            ar_deflate_job_free(job);
+            return 0;
+        }
+    }
+    job->last = last;
+    return ar_deflate_submit(self->pool, job);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Append to the current entry.  A full block is only submitted once
+// there is more data, so the last block of an entry is known to be the
+// last when it is compressed.
+static int ar_zip_append(struct ar_zip* self, const unsigned char* ptr, size_t len) {
+    while ( len > 0 ) {
+        struct ar_deflate_job* job = self->current;
+        size_t chunk, need;
+
+        if ( AR_ZIP_BLOCK == job->in_len ) {
+            if ( ! ar_zip_submit(self, 0) ) return 0;
+            job = self->current;
+        }
+        chunk = AR_ZIP_BLOCK - job->in_len;
+        if ( chunk > len ) chunk = len;
+
+        need = job->dict_len + job->in_len + chunk;
+        if ( need > job->in_size ) {
+            size_t size = job->in_size * 2;
+            unsigned char* in;
+            if ( size < need ) size = need;
+            if ( size > job->dict_len + AR_ZIP_BLOCK ) size = job->dict_len + AR_ZIP_BLOCK;
+            in = (unsigned char*)realloc(job->in, size);
+            if ( NULL == in ) {
+                self->error = "out of memory";
+                return 0;
+            }
+            job->in = in;
+            job->in_size = size;
+        }
+        memcpy(job->in + job->dict_len + job->in_len, ptr, chunk);
+        job->in_len += chunk;
+        ptr += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Start a new entry (finishing the previous one).  Directories and
+// symlinks (whose target is the data) are always stored, the caller
+// must reject other types of entries.
+int ar_zip_header(struct ar_zip* self, struct archive_entry* entry, int store) {
+    const char* pathname = archive_entry_pathname(entry);
+    const char* link = NULL;
+    int type = archive_entry_filetype(entry);
+    time_t mtime = archive_entry_mtime(entry);
+    struct ar_zip_file* file;
+    struct tm tm;
+    size_t i;
+
+    if ( ! ar_zip_end_entry(self) ) return 0;
+    if ( NULL == pathname ) pathname = "";
+
+    if ( self->files_len == self->files_size ) {
+        size_t size = self->files_size > 0 ? 2 * self->files_size : 256;
+        struct ar_zip_file* files =
+            (struct ar_zip_file*)realloc(self->files, size * sizeof(struct ar_zip_file));
+        if ( NULL == files ) {
+            self->error = "out of memory";
+            return 0;
+        }
+        self->files = files;
+        self->files_size = size;
+    }
+    file = &self->files[self->files_len];
+    memset(file, 0, sizeof(struct ar_zip_file));
+
+    file->name_len = strlen(pathname);
+    file->name = (char*)malloc(file->name_len + 1);
+    if ( NULL == file->name ) {
+        self->error = "out of memory";
+        return 0;
+    }
+    self->files_len++;
+    memcpy(file->name, pathname, file->name_len);
+    if ( AE_IFDIR == type &&
+         ( 0 == file->name_len || '/' != file->name[file->name_len - 1] ) )
+    {
+        file->name[file->name_len++] = '/';
+    }
+    for ( i=0; i < file->name_len; i++ ) {
+        // Names are UTF-8:
+        if ( file->name[i] & 0x80 ) file->flags |= 0x800;
+    }
+
+    file->method = ( store || AE_IFREG != type ) ? 0 : 8;
+    file->attr = ( (uint32_t)archive_entry_mode(entry) & 0xffff ) << 16;
+    if ( AE_IFDIR == type ) file->attr |= 0x10;
+    file->mtime = (uint32_t)mtime;
+    if ( NULL == localtime_r(&mtime, &tm) || tm.tm_year < 80 ) {
+        file->dos_time = (uint32_t)(1 << 5 | 1) << 16; // 1980-01-01
+    } else {
+        file->dos_time =
+            (uint32_t)((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday) << 16 |
+            (uint32_t)(tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+    }
+
+    file->size_set = 1;
+    if ( AE_IFLNK == type ) {
+        link = archive_entry_symlink(entry);
+        if ( NULL == link ) link = "";
+        file->declared = strlen(link);
+    } else if ( AE_IFREG == type ) {
+        file->size_set = archive_entry_size_is_set(entry);
+        if ( file->size_set ) file->declared = archive_entry_size(entry);
+    }
+    self->remaining = file->declared;
+
+    self->current = ar_deflate_job_new(NULL, 0, file->size_set ?
+                                       ar_zip_block_size(file->declared) : AR_ZIP_UNKNOWN_SIZE);
+    if ( NULL == self->current ) {
+        self->error = "out of memory";
+        return 0;
+    }
+    self->current->file = self->files_len - 1;
+    self->current->store = 0 == file->method;
+    self->current->first = 1;
+
+    if ( NULL != link ) {
+        if ( ! ar_zip_append(self, (const unsigned char*)link, (size_t)file->declared) ) return 0;
+        self->remaining = 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Append data to the current entry.  If the size of the entry was set
+// only that much is accepted.
+int ar_zip_data(struct ar_zip* self, const void* buff, size_t len, size_t* accepted) {
+    *accepted = 0;
+    if ( NULL != self->error ) return 0;
+    if ( NULL == self->current ) return 1;
+
+    if ( self->files[self->current->file].size_set && len > self->remaining ) {
+        len = (size_t)self->remaining;
+    }
+    if ( ! ar_zip_append(self, (const unsigned char*)buff, len) ) return 0;
+    self->remaining -= len;
+    *accepted = len;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Finish the current entry, data is ignored until the next header.
+int ar_zip_end_entry(struct ar_zip* self) {
+    if ( NULL != self->error ) return 0;
+    if ( NULL != self->current && ! ar_zip_submit(self, 1) ) return 0;
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+static int ar_zip_central(struct ar_zip* self, struct ar_zip_file* file) {
+    unsigned char buf[46];
+    unsigned char extra[9 + 28];
+    unsigned char* p = buf;
+    unsigned char* x = ar_zip_put_mtime(extra, file);
+    int zip64 = file->size >= AR_ZIP_MAX32 || file->csize >= AR_ZIP_MAX32 ||
+        file->offset >= AR_ZIP_MAX32;
+
+    if ( zip64 ) {
+        unsigned char* len;
+        x = ar_zip_put16(x, 0x0001);
+        len = x;
+        x += 2;
+        if ( file->size   >= AR_ZIP_MAX32 ) x = ar_zip_put64(x, file->size);
+        if ( file->csize  >= AR_ZIP_MAX32 ) x = ar_zip_put64(x, file->csize);
+        if ( file->offset >= AR_ZIP_MAX32 ) x = ar_zip_put64(x, file->offset);
+        ar_zip_put16(len, x - len - 2);
+    }
+
+    p = ar_zip_put32(p, 0x02014b50);
+    p = ar_zip_put16(p, 3 << 8 | 45); // made by unix
+    p = ar_zip_put16(p, zip64 || file->zip64 ? 45 : 20);
+    p = ar_zip_put16(p, file->flags);
+    p = ar_zip_put16(p, file->method);
+    p = ar_zip_put32(p, file->dos_time);
+    p = ar_zip_put32(p, file->crc);
+    p = ar_zip_put32(p, file->csize >= AR_ZIP_MAX32 ? AR_ZIP_MAX32 : (uint32_t)file->csize);
+    p = ar_zip_put32(p, file->size  >= AR_ZIP_MAX32 ? AR_ZIP_MAX32 : (uint32_t)file->size);
+    p = ar_zip_put16(p, file->name_len);
+    p = ar_zip_put16(p, x - extra);
+    p = ar_zip_put16(p, 0); // comment
+    p = ar_zip_put16(p, 0); // disk
+    p = ar_zip_put16(p, 0); // internal attributes
+    p = ar_zip_put32(p, file->attr);
+    p = ar_zip_put32(p, file->offset >= AR_ZIP_MAX32 ? AR_ZIP_MAX32 : (uint32_t)file->offset);
+
+    return ar_zip_emit(self, buf, p - buf) &&
+        ar_zip_emit(self, file->name, file->name_len) &&
+        ar_zip_emit(self, extra, x - extra);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the end of central directory record, preceded by the ZIP64
+// record and locator if needed.
+static int ar_zip_end(struct ar_zip* self, uint64_t cd_offset, uint64_t cd_size) {
+    unsigned char buf[56 + 20 + 22];
+    unsigned char* p = buf;
+    uint64_t entries = self->files_len;
+
+    if ( entries >= 0xffff || cd_offset >= AR_ZIP_MAX32 || cd_size >= AR_ZIP_MAX32 ) {
+        uint64_t eocd64 = self->offset;
+        p = ar_zip_put32(p, 0x06064b50);
+        p = ar_zip_put64(p, 44);
+        p = ar_zip_put16(p, 3 << 8 | 45);
+        p = ar_zip_put16(p, 45);
+        p = ar_zip_put32(p, 0);
+        p = ar_zip_put32(p, 0);
+        p = ar_zip_put64(p, entries);
+        p = ar_zip_put64(p, entries);
+        p = ar_zip_put64(p, cd_size);
+        p = ar_zip_put64(p, cd_offset);
+
+        p = ar_zip_put32(p, 0x07064b50);
+        p = ar_zip_put32(p, 0);
+        p = ar_zip_put64(p, eocd64);
+        p = ar_zip_put32(p, 1);
+    }
+    p = ar_zip_put32(p, 0x06054b50);
+    p = ar_zip_put16(p, 0);
+    p = ar_zip_put16(p, 0);
+    p = ar_zip_put16(p, entries >= 0xffff ? 0xffff : (uint32_t)entries);
+    p = ar_zip_put16(p, entries >= 0xffff ? 0xffff : (uint32_t)entries);
+    p = ar_zip_put32(p, cd_size   >= AR_ZIP_MAX32 ? AR_ZIP_MAX32 : (uint32_t)cd_size);
+    p = ar_zip_put32(p, cd_offset >= AR_ZIP_MAX32 ? AR_ZIP_MAX32 : (uint32_t)cd_offset);
+    p = ar_zip_put16(p, 0); // comment
+    return ar_zip_emit(self, buf, p - buf);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Finish the last entry, write everything out and the central
+// directory.
+int ar_zip_finish(struct ar_zip* self) {
+    uint64_t cd_offset;
+    size_t i;
+
+    if ( NULL != self->error ) return 0;
+    if ( self->finished ) return 1;
+    self->finished = 1;
+
+    if ( ! ar_zip_end_entry(self) || ! ar_deflate_flush(self->pool) ) return 0;
+    cd_offset = self->offset;
+    for ( i=0; i < self->files_len; i++ ) {
+        if ( ! ar_zip_central(self, &self->files[i]) ) return 0;
+    }
+    return ar_zip_end(self, cd_offset, self->offset - cd_offset);
+}
+
+//////////////////////////////////////////////////////////////////////
+const char* ar_zip_error(struct ar_zip* self) {
+    return self->error;
+}
+
+//////////////////////////////////////////////////////////////////////
+void ar_zip_free(struct ar_zip* self) {
+    size_t i;
+    if ( NULL == self ) return;
+
+    ar_deflate_free(self->pool);
+    ar_deflate_job_free(self->current);
+    for ( i=0; i < self->files_len; i++ ) free(self->files[i].name);
+    free(self->files);
+    free(self);
+}
+
+#endif
@@ -0,0 +1,17 @@
+// This is a private header subject to change.
+
+// Called (always from the thread calling ar_zip_header(),
+// ar_zip_data() or ar_zip_finish()) with the zip file in order,
+// returns false on error.
+typedef int (*ar_zip_sink)(void* ctx, const void* buff, size_t len);
+
+struct ar_zip;
+struct archive_entry;
+
+struct ar_zip* ar_zip_new(int threads, int level, ar_zip_sink sink, void* ctx);
+int  ar_zip_header(struct ar_zip* self, struct archive_entry* entry, int store);
+int  ar_zip_data(struct ar_zip* self, const void* buff, size_t len, size_t* accepted);
+int  ar_zip_end_entry(struct ar_zip* self);
+int  ar_zip_finish(struct ar_zip* self);
+void ar_zip_free(struct ar_zip* self);
+const char* ar_zip_error(struct ar_zip* self);
@@ -0,0 +1,268 @@
+-- Benchmarks for lua-archive.  Run them like test.lua:
+--
+--   lua bench.lua <src_dir> <build_dir> <name> [args...]
+--
+-- Where name is one of:
+--
+--   extract [files] [size] [threads]
+--
+--       Extract an uncompressed tar of many small files (default
+--       20000 files of 4096 bytes) with the single threaded
+--       read:extract() and then with a pool of writer threads
+--       (default 4).
+--
+--   copy [files] [size]
+--
+--       Copy a tar of many files (default 2000 files of 65536 bytes)
+--       into another tar with a Lua loop over next_header, header and
+--       data, then with archive.copy().  The output is not compressed
+--       so that the per block overhead is what gets measured.
+--
+--   compress [compression] [megabytes] [max_threads]
+--
+--       Write a tar of semi-compressible data (default 64MB) with gzip
+--       (or xz, zstd) compression using 1, 2, 4, ... up to max_threads
+--       (default 8) threads to show how compression scales with the
+--       number of cores.
+--
+--   zip [files] [size] [max_threads]
+--
+--       Write a zip of many semi-compressible files (default 20000
+--       files of 16384 bytes) with libarchive's zip writer and then
+--       with 2, 4, ... up to max_threads (default 8) threads deflating
+--       entries in parallel.
+--
+--   add_tree [files] [size] [threads]
+--
+--       Archive a tree of many small files (default 20000 files of
+--       4096 bytes) with write:add_tree() without prefetch threads and
+--       then with threads (default 4).  Drop the page cache between
+--       runs to see the effect on a cold cache.
+
+local src_dir, build_dir, name = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local archive = require("archive")
+local benchmarks = {}
+
+-- Returns a fresh (non-existent) temporary path:
+local function tmp_path()
+   local path = os.tmpname()
+   os.remove(path)
+   return path
+end
+
+local function write_small_files(path, files, size)
+   local fh = assert(io.open(path, "wb"))
+   local ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   local data = string.rep("x", size)
+   for i = 1, files do
+      if ( i % 1000 == 1 ) then
+         ar:header(archive.entry {
+                      pathname = string.format("dir%d", i / 1000),
+                      mode = 0x41ED })
+      end
+      ar:header(archive.entry {
+                   pathname = string.format("dir%d/file%d", i / 1000, i),
+                   size = size,
+                   mode = 0x81A4 })
+      ar:data(data)
+   end
+   ar:close()
+   fh:close()
+end
+
+function benchmarks.extract(files, size, threads)
+   files   = tonumber(files) or 20000
+   size    = tonumber(size) or 4096
+   threads = tonumber(threads) or 4
+
+   local path = tmp_path()
+   write_small_files(path, files, size)
+
+   for _, n in ipairs { 1, threads } do
+      local dir = tmp_path()
+      local ar = archive.read { path = path, block_size = 1024*1024 }
+      local stats = ar:extract { dir = dir, threads = n }
+      ar:close()
+      print(string.format("extract threads=%d files=%d bytes=%d seconds=%.3f files/s=%.0f",
+                          n, stats.files, stats.bytes, stats.seconds,
+                          stats.files / stats.seconds))
+      os.execute("rm -rf '" .. dir .. "'")
+   end
+   os.remove(path)
+end
+
+function benchmarks.copy(files, size)
+   files = tonumber(files) or 2000
+   size  = tonumber(size) or 65536
+
+   local path = tmp_path()
+   write_small_files(path, files, size)
+
+   local function discard(ar, str)
+      if ( nil ~= str ) then return #str end
+   end
+   local function report(method, bytes, seconds)
+      print(string.format("copy %-5s bytes=%d seconds=%.3f MB/s=%.1f",
+                          method, bytes, seconds, bytes / seconds / 1e6))
+   end
+
+   local src = archive.read { path = path }
+   local dst = archive.write { writer = discard }
+   local start = os.clock()
+   local bytes = 0
+   for header in src:headers() do
+      dst:header(header)
+      for data in src.data, src do
+         dst:data(data)
+         bytes = bytes + #data
+      end
+   end
+   src:close()
+   dst:close()
+   report("lua", bytes, os.clock() - start)
+
+   src = archive.read { path = path }
+   dst = archive.write { writer = discard }
+   start = os.clock()
+   local stats = archive.copy(src, dst)
+   src:close()
+   dst:close()
+   report("c", stats.bytes, os.clock() - start)
+
+   os.remove(path)
+end
+
+function benchmarks.compress(compression, megabytes, max_threads)
+   compression = compression or "gzip"
+   megabytes   = tonumber(megabytes) or 64
+   max_threads = tonumber(max_threads) or 8
+
+   -- Every megabyte is different so no compressor can find long
+   -- repeats, generated up front so it isn't part of the timing:
+   local blocks = {}
+   local seed = 1
+   for mb = 1, megabytes do
+      local parts = {}
+      for i = 1, 1024*1024 / 16 do
+         seed = (seed * 1103515245 + 12345) % 2147483648
+         parts[i] = string.format("%08x%08x", mb * 65536 + i, seed % 65536)
+      end
+      blocks[mb] = table.concat(parts)
+   end
+   local size = megabytes * 1024 * 1024
+
+   local threads = 1
+   while ( threads <= max_threads ) do
+      local compressed = 0
+      local ar = archive.write {
+         compression = compression,
+         threads = threads,
+         writer = function(ar, str)
+            if ( nil ~= str ) then
+               compressed = compressed + #str
+               return #str
+            end
+         end,
+      }
+      ar:header(archive.entry { pathname = "data", size = size })
+      for _, block in ipairs(blocks) do ar:data(block) end
+      ar:close()
+      local seconds = ar:stats().seconds
+      print(string.format("compress %s threads=%d MB=%d ratio=%.2f seconds=%.3f MB/s=%.1f",
+                          compression, threads, megabytes,
+                          compressed / size, seconds, megabytes / seconds))
+      threads = threads * 2
+   end
+end
+
+function benchmarks.zip(files, size, max_threads)
+   files       = tonumber(files) or 20000
+   size        = tonumber(size) or 16384
+   max_threads = tonumber(max_threads) or 8
+
+   -- Distinct contents for every file, generated up front:
+   local contents = {}
+   local seed = 1
+   for i = 1, files do
+      local parts = {}
+      for j = 1, size / 16 do
+         seed = (seed * 1103515245 + 12345) % 2147483648
+         parts[j] = string.format("%08x%08x", i * 65536 + j, seed % 65536)
+      end
+      contents[i] = table.concat(parts)
+   end
+
+   local threads = 1
+   while ( threads <= max_threads ) do
+      local compressed = 0
+      local ar = archive.write {
+         format = "zip",
+         threads = threads,
+         writer = function(ar, str)
+            if ( nil ~= str ) then
+               compressed = compressed + #str
+               return #str
+            end
+         end,
+      }
+      for i, data in ipairs(contents) do
+         ar:header(archive.entry { pathname = "file" .. i, size = #data, mode = 0x81A4 })
+         ar:data(data)
+      end
+      ar:close()
+      local seconds = ar:stats().seconds
+      print(string.format("zip threads=%d files=%d ratio=%.2f seconds=%.3f files/s=%.0f",
+                          threads, files, compressed / (files * size),
+                          seconds, files / seconds))
+      threads = threads * 2
+   end
+end
+
+function benchmarks.add_tree(files, size, threads)
+   files   = tonumber(files) or 20000
+   size    = tonumber(size) or 4096
+   threads = tonumber(threads) or 4
+
+   local path = tmp_path()
+   local dir = tmp_path()
+   write_small_files(path, files, size)
+   local ar = archive.read { path = path }
+   ar:extract { dir = dir }
+   ar:close()
+   os.remove(path)
+
+   for _, n in ipairs { 0, threads } do
+      local ar = archive.write {
+         writer = function(ar, str)
+            if ( nil ~= str ) then return #str end
+         end,
+      }
+      local stats = ar:add_tree(dir, { threads = n })
+      ar:close()
+      print(string.format("add_tree threads=%d files=%d bytes=%d seconds=%.3f files/s=%.0f",
+                          n, stats.files, stats.bytes, stats.seconds,
+                          stats.files / stats.seconds))
+   end
+   os.execute("rm -rf '" .. dir .. "'")
+end
+
+local benchmark = benchmarks[name]
+if ( nil == benchmark ) then
+   local names = {}
+   for name in pairs(benchmarks) do names[#names + 1] = name end
+   table.sort(names)
+   io.stderr:write("usage: lua bench.lua <src_dir> <build_dir> <" ..
+                   table.concat(names, "|") .. "> [args...]\n")
+   os.exit(1)
+end
+benchmark(select(4, ...))
@@ -1,4 +1,4 @@
-print "1..41"
+print "1..135"
 
 local src_dir, build_dir = ...
 package.path  = src_dir .. "?.lua;" .. package.path
@@ -13,6 +13,26 @@ function main()
    test_missing_reader()
    test_missing_writer()
    test_basic()
+   test_native_sources()
+   test_buffer()
+   test_skip()
+   test_index()
+   test_list()
+   test_extract()
+   test_data_to()
+   test_copy()
+   test_reader_push()
+   test_write_sinks()
+   test_output_buffer()
+   test_data_from()
+   test_add_file()
+   test_add_tree()
+   test_threads()
+   test_filters()
+   test_zip_store()
+   test_zip_threads()
+   test_entries()
+   test_memory()
 end
 
 function test_missing_writer()
@@ -173,6 +193,1085 @@ function test_basic()
 
 end
 
+-- Writes a small tar archive to path, returns the content of the
+-- single "test.txt" entry:
+function write_test_archive(path)
+   local content = "Native source test data"
+   local fh = assert(io.open(path, "wb"))
+   local ar = archive.write {
+      writer = function(ar, str)
+         if ( nil == str ) then
+            fh:close()
+         else
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = "test.txt", size = #content })
+   ar:data(content)
+   ar:close()
+   return content
+end
+
+-- Read every entry of the archive in data (a string or buffer), and
+-- returns an array of { pathname, data } pairs:
+function read_entries(data, opts)
+   opts = opts or {}
+   opts.data = data
+   local ar = archive.read(opts)
+   local result = {}
+   for header in ar:headers() do
+      local chunks = {}
+      for chunk in ar.data, ar do chunks[#chunks + 1] = chunk end
+      result[#result + 1] = { header:pathname(), table.concat(chunks) }
+   end
+   ar:close()
+   return result
+end
+
+-- Returns "pathname=data,..." for the entries of the archive in data:
+function list_entries(data, opts)
+   local result = {}
+   for i, entry in ipairs(read_entries(data, opts)) do
+      result[i] = entry[1] .. "=" .. entry[2]
+   end
+   return table.concat(result, ",")
+end
+
+-- Write content as a single entry in memory and read it back.
+-- Returns true if it reads back the same, and the archive written:
+function roundtrip(pathname, content, write_opts, read_opts)
+   write_opts.memory = true
+   local ar = archive.write(write_opts)
+   ar:header(archive.entry { pathname = pathname, size = #content })
+   ar:data(content)
+   local result = ar:result()
+   return list_entries(result, read_opts) == pathname .. "=" .. content, result
+end
+
+function test_native_sources()
+   local path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local ar = archive.read { path = path, block_size = 512 }
+   ok(ar:next_header():pathname() == "test.txt", "path source header")
+   ok(ar:data() == content, "path source data")
+   ar:close()
+
+   ar = archive.read { path = path, mmap = true }
+   ok(ar:next_header():pathname() == "test.txt", "mmap source header")
+   ok(ar:data() == content, "mmap source data")
+   ar:close()
+
+   local fh = assert(io.open(path, "rb"))
+   ar = archive.read { file = fh }
+   ok(ar:next_header():pathname() == "test.txt", "file source header")
+   ok(ar:data() == content, "file source data")
+   ar:close()
+   fh:close()
+
+   local path_ok, path_err = pcall(archive.read, { path = true })
+   ok(not path_ok and string.match(path_err, "InvalidArgument: 'path' must be a string"),
+      "read path= must be a string")
+
+   os.remove(path)
+end
+
+function test_buffer()
+   local path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local buf = archive.buffer(4)
+   ok(buf:size() == 4 and #buf == 0, "new buffer is empty")
+
+   local ar = archive.read { path = path }
+   ar:next_header()
+   local parts = {}
+   while true do
+      local len, offset = ar:data_into(buf)
+      if nil == len then break end
+      parts[#parts + 1] = buf:tostring()
+   end
+   ar:close()
+   os.remove(path)
+   ok(table.concat(parts) == content, "data_into reassembles the entry")
+
+   local out = {}
+   local wbuf = archive.buffer()
+   local writer_got_buffer = true
+   ar = archive.write {
+      writer_buffer = wbuf,
+      writer = function(ar, data)
+         if ( nil ~= data ) then
+            writer_got_buffer = writer_got_buffer and data == wbuf
+            out[#out + 1] = data:tostring()
+            return #data
+         end
+      end,
+   }
+   buf:set(content)
+   ar:header(archive.entry { pathname = "buf.txt", size = #buf })
+   ar:data(buf)
+   ar:close()
+   ok(writer_got_buffer, "writer is passed the writer_buffer")
+
+   out = table.concat(out)
+   ok(list_entries(out) == "buf.txt=" .. content, "write:data accepts a buffer")
+
+   -- Have the reader fill in a ring of buffers:
+   local pos = 1
+   local seen = {}
+   local seen_count = 0
+   ar = archive.read {
+      reader_buffers = 2,
+      block_size = 7,
+      reader = function(ar, rbuf)
+         if ( nil == rbuf ) then return end
+         if ( not seen[rbuf] ) then
+            seen[rbuf] = true
+            seen_count = seen_count + 1
+         end
+         rbuf:set(string.sub(out, pos, pos + rbuf:size() - 1))
+         pos = pos + #rbuf
+         return #rbuf
+      end,
+   }
+   ar:next_header()
+   local parts = {}
+   for data in ar.data, ar do parts[#parts + 1] = data end
+   ok(table.concat(parts) == content, "reader fills in library buffers")
+   ar:close()
+   ok(seen_count == 2, "reader buffers are recycled (" .. seen_count .. ")")
+end
+
+function test_skip()
+   local path = os.tmpname()
+   local big = string.rep("x", 100000)
+   local fh = assert(io.open(path, "wb"))
+   local ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = "big.bin", size = #big })
+   ar:data(big)
+   ar:header(archive.entry { pathname = "small.txt", size = 5 })
+   ar:data("small")
+   ar:close()
+   fh:close()
+
+   fh = assert(io.open(path, "rb"))
+   local bytes_read = 0
+   local skipper_called = false
+   ar = archive.read {
+      reader = function(ar)
+         local data = fh:read(1024)
+         if ( data ) then bytes_read = bytes_read + #data end
+         return data
+      end,
+      skipper = function(ar, request)
+         skipper_called = true
+         local before = fh:seek()
+         return fh:seek("cur", request) - before
+      end,
+   }
+   local names = {}
+   for header in ar:headers() do
+      names[#names + 1] = header:pathname()
+   end
+   ar:close()
+   ok(table.concat(names, ",") == "big.bin,small.txt", "listed all headers")
+   ok(skipper_called and bytes_read < #big,
+      "skipper avoids reading entry data (read " .. bytes_read .. " bytes)")
+   fh:close()
+
+   ar = archive.read { path = path }
+   ar:next_header()
+   ar:skip()
+   ok(ar:next_header():pathname() == "small.txt", "read:skip() skips data")
+   ar:close()
+
+   ar = archive.read { path = path }
+   local seen = {}
+   local distinct = 0
+   names = {}
+   for header in ar:headers { reuse = true } do
+      if ( not seen[header] ) then
+         seen[header] = true
+         distinct = distinct + 1
+      end
+      names[#names + 1] = header:pathname()
+   end
+   ar:close()
+   ok(distinct == 1 and table.concat(names, ",") == "big.bin,small.txt",
+      "headers{reuse=true} recycles one entry")
+
+   local function filtered(opts)
+      local ar = archive.read { path = path }
+      local names = {}
+      for header in ar:headers(opts) do
+         names[#names + 1] = header:pathname()
+      end
+      ar:close()
+      return table.concat(names, ",")
+   end
+   ok(filtered { include = { "*.txt" } } == "small.txt",
+      "headers{include} matches globs")
+   ok(filtered { exclude = { "small*" }, reuse = true } == "big.bin",
+      "headers{exclude} rejects globs")
+   ok(filtered { paths = { ["small.txt"] = true, ["missing"] = true } } == "small.txt",
+      "headers{paths} matches an exact set")
+
+   local entry = archive.entry()
+   ar = archive.read { path = path }
+   ok(ar:next_header(entry) == entry and entry:pathname() == "big.bin",
+      "next_header(entry) refills the entry")
+   ar:close()
+   os.remove(path)
+end
+
+function test_index()
+   local path = os.tmpname()
+   local index_path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local ar = archive.read { path = path }
+   local index = ar:index()
+   ar:close()
+   local header_offset, data_offset, size = index:lookup("test.txt")
+   ok(size == #content and data_offset > header_offset,
+      "index has test.txt")
+
+   index:save(index_path)
+   index = archive.load_index(index_path)
+   ok(index.source == path and index:lookup("test.txt") == header_offset,
+      "index survives save and load")
+
+   local header
+   ar, header = archive.open_entry(index, "test.txt")
+   ok(header:pathname() == "test.txt" and ar:data() == content,
+      "open_entry reads the entry")
+   ar:close()
+
+   -- Duplicate pathnames keep their order, lookup finds the last:
+   local fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil == str ) then
+            fh:close()
+         else
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   for _, name in ipairs { "a", "b", "a" } do
+      ar:header(archive.entry { pathname = name, size = 1 })
+      ar:data(name)
+   end
+   ar:close()
+   ar = archive.read { path = path }
+   index = ar:index()
+   ar:close()
+   local e = index.entries
+   ok(#e == 3 and e[1][4] == "a" and e[2][4] == "b" and e[3][4] == "a" and
+      index:lookup("a") == e[3][1],
+      "index keeps duplicate pathnames in order")
+
+   -- A pax global header before the second entry:
+   local fh = assert(io.open(path, "wb"))
+   local global = "18 comment=global\n"
+   fh:write(tar_block("one", 3, "0"), tar_pad("one"),
+            tar_block("pax_global_header", #global, "g"), tar_pad(global),
+            tar_block("two", 3, "0"), tar_pad("two"),
+            string.rep("\0", 1024))
+   fh:close()
+   ar = archive.read { path = path }
+   index = ar:index()
+   ar:close()
+   local header
+   ar, header = index:open_entry("two")
+   ok(index.globals[1] == 1024 and index.globals[2] == 1024 and
+      #index.entries == 2 and header:pathname() == "two" and ar:data() == "two",
+      "index records pax global headers")
+   ar:close()
+
+   index:save(index_path)
+   index = archive.load_index(index_path)
+   ar, header = index:open_entry("two")
+   ok(index.globals[1] == 1024 and index.entries[2][4] == "two" and
+      ar:data() == "two",
+      "index globals survive save and load")
+   ar:close()
+
+   os.remove(index_path)
+   os.remove(path)
+end
+
+-- A ustar header block for a hand built tar archive:
+function tar_block(name, size, typeflag, linkname)
+   linkname = linkname or ""
+   local block = name .. string.rep("\0", 100 - #name) ..
+      "0000644\0" .. "0000000\0" .. "0000000\0" ..
+      string.format("%011o\0", size) .. "00000000000\0" ..
+      "        " .. typeflag .. linkname .. string.rep("\0", 100 - #linkname) ..
+      "ustar\0" .. "00"
+   block = block .. string.rep("\0", 512 - #block)
+   local sum = 0
+   for i=1, #block do
+      sum = sum + block:byte(i)
+   end
+   return block:sub(1, 148) .. string.format("%06o\0 ", sum) .. block:sub(157)
+end
+
+-- The data followed by padding to a whole tar block:
+function tar_pad(data)
+   return data .. string.rep("\0", (512 - #data % 512) % 512)
+end
+
+function test_list()
+   local path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local ar = archive.read { path = path }
+   local list = ar:list { fields = { "pathname", "size", "mtime" } }
+   ar:close()
+   os.remove(path)
+   ok(list.n == 1 and list.pathname[1] == "test.txt",
+      "list has pathname column")
+   ok(list.size[1] == #content and list.mtime[1] ~= nil and list.mode == nil,
+      "list only has the requested columns")
+end
+
+function test_extract()
+   local path = os.tmpname()
+   local dir = os.tmpname()
+   local content = write_test_archive(path)
+   os.remove(dir)
+
+   local ar = archive.read { path = path }
+   local stats = ar:extract { dir = dir, flags = { "time", "perm" } }
+   ar:close()
+   ok(stats.entries == 1 and stats.files == 1 and stats.bytes == #content,
+      "extract stats (entries=" .. stats.entries .. " bytes=" .. stats.bytes .. ")")
+
+   local fh = assert(io.open(dir .. "/test.txt", "rb"))
+   ok(fh:read("*a") == content, "extracted file content")
+   fh:close()
+
+   os.remove(dir .. "/test.txt")
+   os.remove(dir)
+
+   -- A dir with '..' in it is fine, an entry with '..' is not:
+   fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   for _, name in ipairs { "ok.txt", "../evil.txt" } do
+      ar:header(archive.entry { pathname = name, size = 2, mode = 0x81A4 })
+      ar:data("ok")
+   end
+   ar:close()
+   fh:close()
+   os.execute("mkdir -p '" .. dir .. "/a/sub'")
+   ar = archive.read { path = path }
+   stats = ar:extract { dir = dir .. "/a/sub/.." }
+   ar:close()
+   local evil = io.open(dir .. "/evil.txt", "rb")
+   if evil then evil:close() end
+   ok(stats.files == 1 and stats.failed == 1 and nil == evil and
+      io.open(dir .. "/a/ok.txt", "rb"),
+      "extract into a dir with '..' rejects only '../evil.txt' (" ..
+      tostring(stats.errors[1]) .. ")")
+   os.execute("rm -rf '" .. dir .. "'")
+
+   -- Extract a small tree with a pool of writer threads:
+   fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = "d", mode = 0x41ED })
+   for i = 1, 20 do
+      local data = string.rep(tostring(i), i)
+      ar:header(archive.entry { pathname = "d/f" .. i, size = #data, mode = 0x81A4 })
+      ar:data(data)
+   end
+   ar:header(archive.entry { pathname = "d/link", mode = 0xA1FF, symlink = "f1" })
+   ar:header(archive.entry { pathname = "d/hard", hardlink = "d/f2" })
+   ar:close()
+   fh:close()
+
+   ar = archive.read { path = path }
+   stats = ar:extract { dir = dir, threads = 4 }
+   ar:close()
+   ok(stats.files == 20 and stats.directories == 1 and stats.symlinks == 1 and
+      stats.hardlinks == 1 and stats.failed == 0,
+      "threaded extract stats (files=" .. stats.files .. " failed=" .. stats.failed .. ")")
+
+   local all_match = true
+   for i = 1, 20 do
+      fh = assert(io.open(dir .. "/d/f" .. i, "rb"))
+      all_match = all_match and fh:read("*a") == string.rep(tostring(i), i)
+      fh:close()
+   end
+   ok(all_match, "threaded extract file content")
+   fh = assert(io.open(dir .. "/d/hard", "rb"))
+   ok(fh:read("*a") == "22", "threaded extract hardlinks see the file data")
+   fh:close()
+
+   for _, name in ipairs { "link", "hard" } do os.remove(dir .. "/d/" .. name) end
+   for i = 1, 20 do os.remove(dir .. "/d/f" .. i) end
+   os.remove(dir .. "/d")
+   os.remove(dir)
+
+   -- Without a dir the pool still rejects '..':
+   local evil = "../" .. string.match(os.tmpname(), "[^/]*$") .. ".evil"
+   fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = evil, size = 4, mode = 0x81A4 })
+   ar:data("evil")
+   ar:close()
+   fh:close()
+   ar = archive.read { path = path }
+   stats = ar:extract { threads = 4 }
+   ar:close()
+   local written = io.open(evil, "rb")
+   if written then
+      written:close()
+      os.remove(evil)
+   end
+   ok(stats.failed == 1 and stats.files == 0 and nil == written,
+      "threaded extract without dir rejects '..' (" .. tostring(stats.errors[1]) .. ")")
+
+   -- The last entry for a path wins, whatever its type:
+   fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   local function file(name, data)
+      ar:header(archive.entry { pathname = name, size = #data, mode = 0x81A4 })
+      ar:data(data)
+   end
+   local function symlink(name, target)
+      ar:header(archive.entry { pathname = name, mode = 0xA1FF, symlink = target })
+   end
+   file("target.txt", "T")
+   symlink("a", "missing.txt")
+   file("a", "A")
+   file("b", "B")
+   symlink("b", "target.txt")
+   ar:close()
+   fh:close()
+   ar = archive.read { path = path }
+   stats = ar:extract { dir = dir, threads = 4 }
+   ar:close()
+   local function slurp(name)
+      local fh = io.open(dir .. "/" .. name, "rb")
+      if not fh then return nil end
+      local data = fh:read("*a")
+      fh:close()
+      return data
+   end
+   ok(stats.failed == 0 and slurp("a") == "A" and slurp("b") == "T",
+      "threaded extract keeps archive order for the same path")
+   os.execute("rm -rf '" .. dir .. "'")
+
+   -- An existing file is replaced rather than written through, so a
+   -- hardlink to a file outside dir is left alone:
+   local outside = os.tmpname()
+   os.execute("printf outside > '" .. outside .. "' && mkdir -p '" .. dir ..
+              "' && ln '" .. outside .. "' '" .. dir .. "/x'")
+   ar = archive.write { memory = true }
+   ar:entries { { { pathname = "x", mode = 0x81A4 }, "X" } }
+   ar = archive.read { data = ar:result() }
+   stats = ar:extract { dir = dir, threads = 2 }
+   ar:close()
+   fh = assert(io.open(outside, "rb"))
+   ok(stats.failed == 0 and slurp("x") == "X" and fh:read("*a") == "outside",
+      "threaded extract replaces a hardlinked file")
+   fh:close()
+   os.remove(outside)
+   os.execute("rm -rf '" .. dir .. "'")
+
+   -- Files queued below a directory are written before an entry that
+   -- would replace the directory:
+   ar = archive.write { memory = true }
+   ar:entries {
+      { { pathname = "c1/b/pwned", mode = 0x81A4 }, "P" },
+      { { pathname = "c1/b", mode = 0xA1FF, symlink = "." } },
+   }
+   ar = archive.read { data = ar:result() }
+   stats = ar:extract { dir = dir, threads = 2 }
+   ar:close()
+   local dir_kept = os.execute("test -d '" .. dir .. "/c1/b' -a ! -h '" .. dir .. "/c1/b'")
+   ok(stats.files == 1 and stats.failed == 1 and slurp("c1/b/pwned") == "P" and
+      ( 0 == dir_kept or true == dir_kept ),
+      "threaded extract writes queued files before replacing their parent (" ..
+      tostring(stats.errors[1]) .. ")")
+   os.execute("rm -rf '" .. dir .. "'")
+
+   -- Flags the pool can't honour are left to write_disk:
+   fh = assert(io.open(path, "wb"))
+   ar = archive.write {
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            fh:write(str)
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = "old.txt", size = 3, mode = 0x81A4, mtime = 1 })
+   ar:data("old")
+   ar:close()
+   fh:close()
+   os.execute("mkdir -p '" .. dir .. "' && printf new > '" .. dir .. "/old.txt'")
+   ar = archive.read { path = path }
+   stats = ar:extract { dir = dir, threads = 4, flags = { "no_overwrite_newer" } }
+   ar:close()
+   ok(slurp("old.txt") == "new", "threaded extract honours no_overwrite_newer")
+   os.execute("rm -rf '" .. dir .. "'")
+
+   os.remove(path)
+end
+
+function test_data_to()
+   local path = os.tmpname()
+   local out_path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local ar = archive.read { path = path }
+   ar:next_header()
+   local bytes, seconds = ar:data_to_file(out_path)
+   ar:close()
+   local fh = assert(io.open(out_path, "rb"))
+   ok(bytes == #content and seconds >= 0 and fh:read("*a") == content,
+      "data_to_file writes the entry")
+   fh:close()
+
+   fh = io.tmpfile()
+   ar = archive.read { path = path }
+   ar:next_header()
+   ar:data_to_fd(fh)
+   ar:close()
+   fh:seek("set")
+   ok(fh:read("*a") == content, "data_to_fd writes to an io handle")
+   fh:close()
+
+   os.remove(out_path)
+   os.remove(path)
+end
+
+function test_copy()
+   local path = os.tmpname()
+   local content = write_test_archive(path)
+
+   local dst = archive.write { compression = "gzip", memory = true }
+   local src = archive.read { path = path }
+   local renamed = {}
+   local stats = archive.copy(src, dst, {
+      rename = function(pathname)
+         renamed[#renamed + 1] = pathname
+         return "copy/" .. pathname
+      end,
+      rename_match = { include = { "*.txt" } },
+   })
+   src:close()
+   local out = dst:result()
+   os.remove(path)
+   ok(stats.entries == 1 and stats.renamed == 1 and stats.bytes == #content,
+      "copy stats (entries=" .. stats.entries .. " bytes=" .. stats.bytes .. ")")
+   ok(#renamed == 1 and renamed[1] == "test.txt", "rename hook is called")
+
+   ok(list_entries(out) == "copy/test.txt=" .. content,
+      "copied entry is renamed and recompressed")
+
+   -- A hardlink with data (allowed by pax) loses it when written as
+   -- ustar, which is a failure rather than a copied entry:
+   local pax = "12 uid=1000\n"
+   src = archive.read {
+      data = tar_block("PaxHeader", #pax, "x") .. tar_pad(pax) ..
+         tar_block("link", 3, "1", "missing") .. tar_pad("abc") ..
+         string.rep("\0", 1024),
+   }
+   dst = archive.write { format = "ustar", memory = true }
+   stats = archive.copy(src, dst)
+   src:close()
+   dst:close()
+   ok(stats.entries == 0 and stats.failed == 1 and stats.bytes == 0,
+      "copy counts truncated entries as failed (" .. tostring(stats.errors[1]) .. ")")
+end
+
+function test_reader_push()
+   local ar = archive.write { compression = "gzip", memory = true }
+   -- More than the gzip reader decompresses at a time, and not too
+   -- compressible, so events are returned before all of it is fed
+   -- (made the same way every run, so the chunks are too):
+   local content = {}
+   local seed = 1
+   for i=1, 100000 do
+      seed = seed * 16807 % 2147483647
+      content[i] = string.char(32 + seed % 95)
+   end
+   content = table.concat(content)
+   ar:header(archive.entry { pathname = "a.txt", size = #content })
+   ar:data(content)
+   ar:header(archive.entry { pathname = "b.txt", size = 1 })
+   ar:data("b")
+   local out = ar:result()
+
+   local push = archive.reader_push()
+   local names = {}
+   local data = {}
+   local function handle(events)
+      for _, event in ipairs(events) do
+         if ( event.type == "header" ) then
+            names[#names + 1] = event.entry:pathname()
+            data[#names] = {}
+         else
+            table.insert(data[#names], event.data)
+         end
+      end
+   end
+   local first_events
+   for pos = 1, #out, 100 do
+      local events = push:feed(string.sub(out, pos, pos + 99))
+      if ( nil == first_events and #events > 0 ) then first_events = pos end
+      handle(events)
+   end
+   handle(push:finish())
+   push:close()
+
+   ok(table.concat(names, ",") == "a.txt,b.txt", "push reader headers")
+   ok(table.concat(data[1]) == content and table.concat(data[2]) == "b",
+      "push reader data")
+   ok(first_events ~= nil and first_events < #out,
+      "push reader returns events before the end of the input")
+
+   -- Once the parser fails every later call raises the error:
+   push = archive.reader_push()
+   local errors = {}
+   for _, call in ipairs {
+      function() return push:feed(string.rep("not an archive ", 100)) end,
+      function() return push:finish() end,
+      function() return push:feed("more") end,
+      function() return push:finish() end,
+   } do
+      local success, msg = pcall(call)
+      if ( not success ) then errors[#errors + 1] = msg:gsub("^[^:]*:%d+: ", "") end
+   end
+   push:close()
+   ok(#errors == 3 and errors[1] == errors[2] and errors[2] == errors[3],
+      "push reader raises its error again (" .. tostring(errors[1]) .. ")")
+end
+
+function test_write_sinks()
+   local content = string.rep("native sink ", 1000)
+   local function write_to(opts)
+      opts.compression = "gzip"
+      local ar = archive.write(opts)
+      ar:header(archive.entry { pathname = "sink.txt", size = #content })
+      ar:data(content)
+      ar:close()
+   end
+   local function read_back(path)
+      local ar = archive.read { path = path }
+      local header = ar:next_header()
+      local result = header and header:pathname() == "sink.txt" and
+         ar:data() == content
+      ar:close()
+      return result
+   end
+
+   local path = os.tmpname()
+   write_to { path = path, fsync = true }
+   ok(read_back(path), "write to path")
+
+   local fh = assert(io.open(path, "w+b"))
+   write_to { file = fh }
+   fh:close()
+   ok(read_back(path), "write to io handle")
+
+   write_to { path = path, direct = true }
+   ok(read_back(path), "write to path with direct")
+
+   -- A caller's fd is left without O_DIRECT, even when the output
+   -- ends on an aligned block (20480 bytes of tar):
+   fh = assert(io.open(path, "w+b"))
+   local ar = archive.write { file = fh, direct = true, format = "ustar" }
+   ar:header(archive.entry { pathname = "sink.txt", size = #content })
+   ar:data(content)
+   ar:close()
+   local wrote = fh:write("x") and fh:flush()
+   fh:close()
+   ok(wrote, "direct restores the flags of a caller's fd")
+
+   os.remove(path)
+end
+
+function test_output_buffer()
+   local content = string.rep("output buffer ", 10000)
+   local out = {}
+   local ar = archive.write {
+      output_buffer = 64*1024,
+      writer = function(ar, str)
+         if ( nil ~= str ) then
+            out[#out + 1] = str
+            return #str
+         end
+      end,
+   }
+   ar:header(archive.entry { pathname = "big.txt", size = #content })
+   ar:data(content)
+   ar:close()
+   local stats = ar:stats()
+   ok(#out == stats.writer_calls and stats.writer_calls < stats.blocks,
+      "output_buffer coalesces blocks (blocks=" .. stats.blocks ..
+      " writer_calls=" .. stats.writer_calls .. ")")
+   ok(stats.callbacks_saved == stats.blocks - stats.writer_calls and
+      stats.bytes == #table.concat(out), "output_buffer stats")
+
+   ok(list_entries(table.concat(out)) == "big.txt=" .. content,
+      "output_buffer output reads back")
+end
+
+function test_data_from()
+   local content = string.rep("data from ", 200000)
+   local path = os.tmpname()
+   local fh = assert(io.open(path, "wb"))
+   fh:write(content)
+   fh:close()
+
+   local out_path = os.tmpname()
+   local ar = archive.write { path = out_path }
+   ar:header(archive.entry { pathname = "file.txt", size = #content })
+   local bytes = ar:data_from_file(path)
+   ar:header(archive.entry { pathname = "part.txt", size = 10 })
+   fh = assert(io.open(path, "rb"))
+   fh:seek("set", 5)
+   local part_bytes = ar:data_from_fd(fh, 10)
+   fh:close()
+   ar:close()
+   ok(bytes == #content and part_bytes == 10, "data_from_file and data_from_fd bytes")
+
+   ar = archive.read { path = out_path }
+   local got = {}
+   for header in ar:headers() do
+      local data = {}
+      for chunk in ar.data, ar do data[#data + 1] = chunk end
+      got[header:pathname()] = table.concat(data)
+   end
+   ar:close()
+   ok(got["file.txt"] == content and got["part.txt"] == string.sub(content, 6, 15),
+      "data_from_file and data_from_fd contents")
+
+   os.remove(out_path)
+   os.remove(path)
+end
+
+function test_add_file()
+   local content = string.rep("add file ", 1000)
+   local path = os.tmpname()
+   local fh = assert(io.open(path, "wb"))
+   fh:write(content)
+   fh:close()
+   local link = path .. ".link"
+   os.execute("ln -s '" .. path .. "' '" .. link .. "'")
+
+   local out_path = os.tmpname()
+   local ar = archive.write { path = out_path }
+   local bytes = ar:add_file(path, "dir/file.txt")
+   ar:add_file(link, "dir/link")
+   ar:close()
+   ok(bytes == #content, "add_file bytes")
+
+   ar = archive.read { path = out_path }
+   local header = ar:next_header()
+   ok(header:pathname() == "dir/file.txt" and header:size() == #content and
+      ar:data() == content, "add_file entry")
+   header = ar:next_header()
+   ok(header:pathname() == "dir/link" and header:symlink() == path,
+      "add_file symlink")
+   ar:close()
+
+   os.remove(out_path)
+   os.remove(link)
+   os.remove(path)
+end
+
+function test_add_tree()
+   local dir = os.tmpname()
+   os.remove(dir)
+   os.execute("mkdir -p '" .. dir .. "/sub/skip' && ln -s a.txt '" .. dir .. "/link'")
+   local big = string.rep("big file ", 200000)
+   for path, content in pairs { ["a.txt"] = "aaa", ["sub/b.txt"] = big,
+                                ["sub/skip/c.txt"] = "ccc", ["sub/d.o"] = "ddd" } do
+      local fh = assert(io.open(dir .. "/" .. path, "wb"))
+      fh:write(content)
+      fh:close()
+   end
+
+   for _, threads in ipairs { 0, 2 } do
+      local ar = archive.write { memory = true }
+      local stats = ar:add_tree(dir, { prefix = "root", threads = threads,
+                                       exclude = { "root/sub/skip", "*.o" } })
+      local names = {}
+      local contents = {}
+      for _, entry in ipairs(read_entries(ar:result())) do
+         names[#names + 1] = entry[1]
+         contents[entry[1]] = entry[2]
+      end
+      ok(table.concat(names, ",") == "root/,root/a.txt,root/link,root/sub/,root/sub/b.txt" and
+         stats.files == 2 and stats.skipped == 2 and stats.failed == 0,
+         "add_tree threads=" .. threads .. " (" .. table.concat(names, ",") .. ")")
+      if ( threads > 0 ) then
+         ok(contents["root/a.txt"] == "aaa" and contents["root/sub/b.txt"] == big,
+            "add_tree contents")
+      end
+   end
+   os.execute("rm -rf '" .. dir .. "'")
+end
+
+function test_threads()
+   -- Enough data for several compression blocks:
+   local parts = {}
+   for i = 1, 40000 do parts[#parts + 1] = string.format("line %d %x\n", i, i * 7919) end
+   local content = table.concat(parts)
+
+   local result, compressed =
+      roundtrip("threads.txt", content, { compression = "gzip", threads = 3, level = 6 })
+   ok(result and string.byte(compressed, 1) == 0x1f and string.byte(compressed, 2) == 0x8b,
+      "gzip with threads")
+
+   local path = os.tmpname()
+   local ar = archive.write { path = path, compression = "gzip", threads = 2 }
+   ar:header(archive.entry { pathname = "threads.txt", size = #content })
+   ar:data(content)
+   ar:close()
+   os.execute("gzip -dc < '" .. path .. "' > '" .. path .. ".tar'")
+   ar = archive.read { path = path .. ".tar" }
+   local header = ar:next_header()
+   local data = {}
+   for chunk in ar.data, ar do data[#data + 1] = chunk end
+   ar:close()
+   os.remove(path .. ".tar")
+   os.remove(path)
+   ok(header and table.concat(data) == content, "gzip with threads is readable by gzip")
+
+   ok(roundtrip("threads.txt", content, { compression = "xz", threads = 2 }), "xz with threads")
+end
+
+function test_filters()
+   local content = string.rep("filter chain ", 5000)
+   local result, compressed =
+      roundtrip("filters.txt", content,
+                { filters = { { "zstd", level = 19, threads = 2 } } }, { filters = { "zstd" } })
+   ok(result and string.byte(compressed, 1) == 0x28 and string.byte(compressed, 2) == 0xb5,
+      "zstd filter with options")
+   result, compressed = roundtrip("filters.txt", content, { filters = { "lz4" } },
+                                  { compression = "lz4" })
+   ok(result and string.byte(compressed, 1) == 0x04 and string.byte(compressed, 2) == 0x22,
+      "lz4 filter")
+   result, compressed = roundtrip("filters.txt", content, { filters = { "gzip", "uuencode" } })
+   ok(result and string.sub(compressed, 1, 6) == "begin ", "filter chain")
+   ok(roundtrip("filters.txt", content, { filters = { "zstd", "uuencode" }, level = 9 }),
+      "level only applies to the filters that support it")
+   ok(roundtrip("filters.txt", content, { filters = { "gzip", "uuencode" }, threads = 2 }),
+      "threads only apply to the filters that support them")
+   ok(not pcall(archive.write, { filters = { "nosuchfilter" }, writer = function() end }),
+      "unknown filter is an error")
+   local _, plain = roundtrip("filters.txt", "x", { format = "ustar" })
+   local _, none = roundtrip("filters.txt", "x", { format = "ustar", compression = "none" })
+   ok(#plain == 10240 and #none == #plain, "compression none is padded like no compression")
+end
+
+function test_zip_store()
+   local random = {}
+   for i=1, 16384 do random[i] = string.char(math.random(0, 255)) end
+   random = table.concat(random)
+   local text = string.rep("compress me please ", 4000)
+   local files = {
+      { "photo.JPG",  random },
+      { "random.bin", random },
+      { "notes.txt",  text, "store" },
+      { "keep.dat",   text },
+      { "text.log",   text },
+   }
+
+   local ar = archive.write {
+      format = "zip",
+      memory = true,
+      store_extensions = true,
+      store_probe = true,
+      store = function(pathname, size)
+         if ( pathname == "keep.dat" ) then return true end
+      end,
+   }
+   for _, file in ipairs(files) do
+      ar:header(archive.entry { pathname = file[1], size = #file[2] }, file[3])
+      ar:data(file[2])
+   end
+   local out = ar:result()
+   local stats = ar:stats()
+   ok(stats.stored == 4 and stats.deflated == 1,
+      "zip entries stored=" .. stats.stored .. " deflated=" .. stats.deflated)
+
+   ok(#out > 2 * (#random + #text) and #out < 2 * #random + 3 * #text,
+      "zip size " .. #out .. " shows which entries were stored")
+   local matched = 0
+   for i, entry in ipairs(read_entries(out)) do
+      if ( entry[1] == files[i][1] and entry[2] == files[i][2] ) then
+         matched = matched + 1
+      end
+   end
+   ok(matched == #files, "zip entries read back")
+   ok(not pcall(archive.write, { store_probe = true, writer = function() end }),
+      "store_probe requires zip")
+
+   -- archive.copy() goes through the same policy:
+   ar = archive.write { format = "zip", memory = true, store_extensions = true }
+   local stats = archive.copy(archive.read { data = out }, ar)
+   local copy = ar:result()
+   stats = ar:stats()
+   ok(stats.stored == 1 and stats.deflated == 4 and list_entries(copy) == list_entries(out),
+      "copy to zip stored=" .. stats.stored .. " deflated=" .. stats.deflated)
+
+   -- Without a policy the options decide:
+   ar = archive.write { format = "zip", memory = true, options = "zip:compression=store" }
+   ar:header(archive.entry { pathname = "text.log", size = #text })
+   ar:data(text)
+   local zip = ar:result()
+   ok(#zip > #text and list_entries(zip) == "text.log=" .. text,
+      "options='zip:compression=store' is not overridden")
+end
+
+function test_zip_threads()
+   local lines = {}
+   for i=1, 40000 do lines[i] = "line " .. i .. "\n" end
+   local big = table.concat(lines)
+   local files = {
+      { "dir",            nil, 0x41ED },
+      { "dir/small.txt",  "small\n" },
+      { "dir/big.txt",    big },
+      { "dir/nosize.txt", big, nil, true },
+      { "dir/empty",      "" },
+      { "dir/stored.txt", big, nil, false, "store" },
+   }
+   local function write_zip(threads)
+      local ar = archive.write { format = "zip", threads = threads, memory = true }
+      for _, file in ipairs(files) do
+         local entry = archive.entry { pathname = file[1], mode = file[3] or 0x81A4 }
+         if ( file[2] and not file[4] ) then entry:size(#file[2]) end
+         ar:header(entry, file[5])
+         -- In pieces that don't line up with blocks:
+         for pos = 1, #(file[2] or ""), 50000 do
+            ar:data(string.sub(file[2], pos, pos + 49999))
+         end
+      end
+      return ar:result(), ar:stats()
+   end
+
+   local zip, stats = write_zip(3)
+   ok(stats.stored == 1 and stats.deflated == 3,
+      "threaded zip stored=" .. stats.stored .. " deflated=" .. stats.deflated)
+   ok(#zip > #big and #zip < 2 * #big, "threaded zip is compressed")
+   ok(list_entries(zip) == list_entries(write_zip(1)),
+      "threaded zip reads back the same as libarchive's")
+
+   local ar = archive.write { format = "zip", threads = 3, memory = true }
+   local src = archive.read { data = zip }
+   local stats = archive.copy(src, ar)
+   src:close()
+   local copy = ar:result()
+   ok(stats.entries == #files and stats.failed == 0 and string.sub(copy, 1, 2) == "PK" and
+      list_entries(copy) == list_entries(zip),
+      "copy to a threaded zip")
+end
+
+function test_entries()
+   local ar = archive.write { format = "ustar", memory = true }
+   local count = ar:entries {
+      { { pathname = "dir", mode = 0x41ED } },
+      { { pathname = "dir/chunks.txt", mtime = { 1 } }, { "one ", "two ", "", "three" } },
+      { archive.entry { pathname = "dir/entry.txt", size = 5 }, "entry" },
+      { { pathname = "dir/empty.txt" } },
+   }
+   ok(count == 4, "entries wrote " .. tostring(count) .. " entries")
+   ok(not pcall(ar.entries, ar, { { { pathname = "bad" }, { "ok", true } } }),
+      "entries rejects data that is not a string")
+
+   local result = list_entries(ar:result())
+   ok(result == "dir/=,dir/chunks.txt=one two three,dir/entry.txt=entry,dir/empty.txt=",
+      "entries read back as " .. result)
+
+   ar = archive.write { format = "ustar", memory = true }
+   local long_ok, long_err = pcall(ar.entries, ar, { { { pathname = "long", size = 2 }, "toolong" } })
+   ok(not long_ok and string.match(long_err, "InvalidArgument: entries%[1%] data exceeds the entry size"),
+      "entries rejects data longer than the entry size")
+end
+
+function test_memory()
+   local body = string.rep("in memory ", 20000)
+   local function write_memory(as_buffer)
+      local ar = archive.write { format = "ustar", compression = "gzip", memory = true }
+      ar:entries {
+         { { pathname = "a.txt" }, body },
+         { { pathname = "b.txt" }, "b" },
+      }
+      return ar:result(as_buffer), ar:stats()
+   end
+
+   local str, stats = write_memory()
+   ok(type(str) == "string" and #str == stats.bytes and #str < #body / 10 and
+      stats.writer_calls == 0,
+      "memory write returned " .. #str .. " bytes without calling a writer")
+   ok(list_entries(str) == "a.txt=" .. body .. ",b.txt=b", "read data=string")
+   local buf = write_memory(true)
+   ok(list_entries(buf) == "a.txt=" .. body .. ",b.txt=b" and buf:tostring() == str,
+      "read data=archive{buffer}")
+
+   -- The buffer can't change while it is being read:
+   local ar = archive.read { data = buf }
+   local other = archive.read { data = str }
+   other:next_header()
+   local set_ok, set_err = pcall(buf.set, buf, "changed")
+   local resize_ok = pcall(buf.resize, buf, 0)
+   local into_ok = pcall(other.data_into, other, buf)
+   local header, block = ar:next_header(), ar:data()
+   ok(not set_ok and set_err:match("InvalidState:") and not resize_ok and not into_ok and
+      header:pathname() == "a.txt" and block == body:sub(1, #block),
+      "read data=archive{buffer} pins the buffer")
+   ar:close()
+   other:close()
+   buf:set("changed")
+   ok(buf:tostring() == "changed", "buffer can change once the read is closed")
+end
+
 function header_is(got_header, expected_header)
    for key, value in pairs(expected_header) do
       local got = {got_header[key](got_header)}